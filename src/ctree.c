@@ -6,18 +6,26 @@
  * be rewritten with iterative approach.
  *
  * About thread safety...
- * Having mix and match of which functions are thread safe and which
- * ones are not would be the ideal solution.
- * Only read operations can be thread safe or
- * operations that increment/decrement a simple counter
- * or set/unset a flag using atomic increment/decrement.
- * These operations should be the only ones that can be safely
- * called from any thread.
+ * Default 'ctree' is not thread safe and pays nothing for it.
  *
+ * Tree constructed with 'CTREE_CONCURRENT' mode lets any number of
+ * threads read ('ctree_entry', 'ctree_key', iteration) without taking
+ * any lock, while writers serialize on the tree mutex.
  * Operations that affect tree balance won't benefit from
  * the multithreading anyways, if the balance changes when
  * insertion '1' is done inserting then the conccurent insertion '2'
  * must start all the way from the root because tree might have been rebalanced.
+ * So the writer never touches the nodes the readers can see, it copies the
+ * path from the root to the modified node, rebalances the copy and publishes
+ * the new root with a single atomic store.
+ * Replaced nodes (and removed keys/values) are reclaimed once no reader
+ * can hold a reference to them (see EPOCH BASED RECLAMATION below).
+ *
+ * Tree constructed with 'CTREE_PERSISTENT' mode uses the same path copying
+ * to keep the older versions of the tree intact, 'ctree_snapshot' returns
+ * such version in O(1). Nodes shared between the versions are reference
+ * counted, snapshot can be read and freed by another thread while the
+ * writer keeps modifying the tree.
  */
 
 #define __COL_TREE_C_FILE__
@@ -29,12 +37,24 @@
 #define __COL_SRC_FILE__
 #include "citer.h"
 #undef __COL_SRC_FILE__
+#define __COL_VEC_C_FILE__
+#include "cvec.h"
+#undef __COL_VEC_C_FILE__
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <memc.h>
 #include <memory.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
  * Group of flags that are used for state checking inside
@@ -58,6 +78,10 @@
  * Detecting the key getting replaced can be only done by
  * setting this flag inside the ctreenode_insert function
  * inside nested recursion.
+ *
+ * Flag 'size_stale' is not an operation flag, it stays set after
+ * splitting/joining the tree (or removing the range in the background)
+ * until the size of the tree gets recounted.
  */
 
 typedef u_char byte;
@@ -67,9 +91,11 @@ typedef u_char byte;
 #endif
 
 typedef enum {
-    REMOVED  = 1 << 0,
-    INSERTED = 1 << 1,
-    REPLACED = 1 << 2,
+    REMOVED    = 1 << 0,
+    INSERTED   = 1 << 1,
+    REPLACED   = 1 << 2,
+    SIZE_STALE = 1 << 3,
+    UPDATED    = 1 << 4,
 } _opflags;
 
 /*
@@ -85,20 +111,120 @@ typedef enum {
  * invariant is violated.
  * If so then the tree rebalances itself until the balance factor
  * of all nodes is one of the values of the given set {-1, 0, 1}
+ *
+ * 'parent' is kept up to date through insertion, removal and rotations,
+ * iterators rely on it to walk the tree without comparing keys.
+ *
+ * When the library is built with 'COL_CTREE_THREADED' each node also
+ * holds its in-order successor ('next') and predecessor ('prev'),
+ * which turns every iteration step into a single pointer load.
+ *
+ * 'COL_MEMORY_CONSTRAINED' builds don't cache the key prefix and keep
+ * height/balance as single bytes at the end of the node (AVL height of 255
+ * needs far more nodes than can be addressed). That only gives back the
+ * 8 bytes the prefix costs, node stays at 48 bytes on 64-bit (64 with
+ * 'COL_CTREE_THREADED'), the same as without the prefix cache.
+ *
+ * TODO: Truly compact layout (balance in the pointer tag bits, no height,
+ * optionally 32-bit arena indices instead of pointers) down to 40 bytes,
+ * needs every link access behind accessors (slots written through
+ * '_ctreenode_slot' included) and the AVL paths driven by the balance
+ * factors instead of the heights.
  */
 struct ctree_node {
     cptr_t key;
     cptr_t value;
-    uint   height;
-    int    balance;
+#ifndef COL_MEMORY_CONSTRAINED
+    ulong prefix;
+    uint  height;
+    int   balance;
+#endif
 
     struct ctree_node* right;
     struct ctree_node* left;
     struct ctree_node* parent;
+#ifdef COL_CTREE_THREADED
+    struct ctree_node* next;
+    struct ctree_node* prev;
+#endif
+#ifdef COL_MEMORY_CONSTRAINED
+    byte        height;
+    signed char balance;
+#endif
 };
 
 /*
- * CTree is AVL tree (self-balancing binary search tree).
+ * Cached prefix of the node key, 'COL_MEMORY_CONSTRAINED' nodes don't
+ * cache it and the prefixes are never compared ('_ctreenode_cmp').
+ */
+#ifndef COL_MEMORY_CONSTRAINED
+#define _CTREENODE_PREFIX(node) ((node)->prefix)
+#else
+#define _CTREENODE_PREFIX(node) 0
+#endif
+
+/*
+ * Nodes of the 'CTREE_CONCURRENT' trees are allocated together with
+ * this header placed right in front of them.
+ * 'stamp' holds the writer operation that created the node, writer is
+ * only allowed to mutate the nodes it created itself (readers can't see
+ * them yet), every other node gets copied instead.
+ */
+typedef struct {
+    ulong stamp;
+} _ctreenode_hdr;
+
+#define _CTREENODE_HDR(node) (((_ctreenode_hdr*) (node)) - 1)
+
+/*
+ * Keys and values of the 'CTREE_PERSISTENT' tree are shared between
+ * the node copies of different versions, payload owns them.
+ *
+ * Low half of the 'refs' counts the nodes holding the payload, value gets
+ * freed once the last one is gone.
+ * High half counts the payloads borrowing the key ('key_src'), that is
+ * the payload created when the value of the shared node gets updated,
+ * key gets freed once no node and no borrower is left.
+ */
+typedef struct _ctree_payload {
+    atomic_ullong          refs;
+    cptr_t                 key;
+    cptr_t                 value;
+    struct _ctree_payload* key_src;
+} _ctree_payload;
+
+#define _CTREE_PAYLOAD_REFS   0xffffffffULL
+#define _CTREE_PAYLOAD_BORROW (_CTREE_PAYLOAD_REFS + 1)
+
+/*
+ * Nodes of the 'CTREE_PERSISTENT' trees are allocated together with
+ * this header placed right in front of them.
+ * 'refs' counts the references to the node (from the parent nodes
+ * or the roots of the versions), only the node referenced once can be
+ * mutated in place.
+ */
+typedef struct {
+    atomic_uint     refs;
+    _ctree_payload* payload;
+} _ctreenode_phdr;
+
+#define _CTREENODE_PHDR(node) (((_ctreenode_phdr*) (node)) - 1)
+
+/*
+ * Modes whose nodes are never mutated once visible to others.
+ */
+#define _CTREE_COW (CTREE_CONCURRENT | CTREE_PERSISTENT)
+
+/*
+ * Private mode bit of the trees returned by 'ctree_snapshot'.
+ */
+#define _CTREE_SNAPSHOT (1 << 7)
+
+typedef struct _ctree_sync _ctree_sync;
+
+/*
+ * CTree is AVL tree (self-balancing binary search tree), unless
+ * constructed with the other 'ctree_policy'.
  * Comparisons are done based on the comparison function provided upon
  * constructing the CTree ('CCompareKeyFn').
  * Comparison function must be provided in order to construct the tree.
@@ -119,574 +245,6587 @@ struct ctree {
     ctree_node* root;
 
     CCompareKeyFn compare_key_fn;
+    CPrefixKeyFn  prefix_key_fn;
     CFreeKeyFn    free_key_fn;
     CFreeValueFn  free_value_fn;
     CClone        clone_key_fn;
     CClone        clone_value_fn;
 
-    atomic_uint size;
-    byte        flags;
+    uint         size;
+    byte         flags;
+    byte         mode;
+    byte         policy;
+    _ctree_sync* sync;
+    ctree_node*  finger;
+    ctree_node*  min;
+    ctree_node*  max;
+
+    uint key_size;
+    uint value_size;
+
+    struct _ctree_pool*  pool;
+    struct _ctree_arena* arena;
+    ctree_node*          compact;
+    struct _ctree_cache* cache;
 };
 
 /*
- * CTree constructor
- * 'compare_key_fn' is required.
- * 'free_key_fn' is optional, if user provides free_key_fn
- * then the key that gets removed gets also freed as specified
- * in the implementation of free_key_fn, if it is NULL then the
- * user is responsible for freeing the key memory.
+ * Free list of the removed nodes reused by the insertions into the tree
+ * owning it (shards of the 'ctree_sharded'), holds at most
+ * 'COL_CTREE_POOL_SIZE' nodes, linked through 'right'.
  */
-ctree*
-ctree_new(CCompareKeyFn compare_key_fn,
-          CFreeKeyFn    free_key_fn,
-          CFreeValueFn  free_value_fn,
-          CClone        clone_key_fn,
-          CClone        clone_value_fn)
-{
-    ctree* tree = memc_malloc(ctree);
-
-#ifndef COL_MEMORY_CONSTRAINED
-    if(__builtin_expect(tree == NULL, 0)) {
-#else
-    if(tree != NULL) {
+#ifndef COL_CTREE_POOL_SIZE
+#define COL_CTREE_POOL_SIZE 256
 #endif
-        COL_ALLOC_ERROR;
-        return NULL;
-    }
 
-    if((tree->compare_key_fn = compare_key_fn) == NULL) {
-        COL_INVALID_CMPFN_ERROR;
-        free(tree);
-        return NULL;
-    }
+typedef struct _ctree_pool {
+    ctree_node* head;
+    uint        size;
+} _ctree_pool;
 
-    tree->clone_key_fn   = clone_key_fn;
-    tree->clone_value_fn = clone_value_fn;
-    tree->free_key_fn    = free_key_fn;
-    tree->free_value_fn  = free_value_fn;
-    tree->root           = NULL;
-    tree->size           = 0;
-    tree->flags          = COL_BYTE;
+/*
+ * Block the nodes got relocated into by the compaction, nodes are laid
+ * out 'stride' bytes apart. 'live' counts the nodes still inside, their
+ * memory is released once it drops to zero (block being filled by the
+ * incremental compaction is kept until the pass ends), emptied blocks
+ * stay on the list of the tree (newest first) until the next compaction.
+ */
+typedef struct _ctree_arena {
+    struct _ctree_arena* next;
+    byte*                base;
+    size_t               stride;
+    size_t               capacity;
+    size_t               used;
+    size_t               live;
+} _ctree_arena;
 
-    return tree;
+/*
+ * Lookup cache of the hot keys ('ctree_cache_enable'), 2-way set
+ * associative table of the nodes found by 'ctree_entry'/'ctree_key'
+ * indexed by the key hash, most recently used way first.
+ * Hash stored next to the node skips the comparisons of the keys
+ * sharing the set, hit costs a single 'CCompareKeyFn' call.
+ */
+typedef struct {
+    ulong       hash;
+    ctree_node* node;
+} _ctree_cache_way;
+
+typedef struct _ctree_cache {
+    CHashKeyFn        hash_fn;
+    ulong             mask;
+    ulong             hits;
+    ulong             misses;
+    _ctree_cache_way* ways;
+} _ctree_cache;
+
+/*
+ * Keys (and values) of the tree made by 'ctree_new_inline' are stored
+ * right after the node in the same allocation, key first and then the
+ * value, both aligned to 8 bytes.
+ * 'key'/'value' of the node point into that storage.
+ */
+#define _CTREE_INLINE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+#define _CTREE_INLINE(tree)       ((tree)->key_size != 0)
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                       EPOCH BASED RECLAMATION                            */
+/****************************************************************************/
+
+/*
+ * Each thread that reads a 'CTREE_CONCURRENT' tree owns a '_ctree_reader'
+ * record, it gets registered in the global list the first time the thread
+ * reads and it is recycled by another thread once the owner exits.
+ *
+ * While inside of the read section 'epoch' holds the global epoch the reader
+ * observed upon entering, outside of it 'epoch' is 0.
+ * Global epoch can only advance if every reader inside of the read section
+ * observed the current one, therefore anything that got retired while the
+ * global epoch was 'e' can be freed once the global epoch reaches 'e + 2'.
+ * At that point every reader that could have seen the retired memory left
+ * the read section.
+ *
+ * Domain is global so threads register once no matter how many trees they read.
+ */
+typedef struct _ctree_reader {
+    atomic_ulong          epoch;
+    atomic_bool           in_use;
+    uint                  nesting;
+    struct _ctree_reader* next;
+} _ctree_reader;
+
+static atomic_ulong                 _ctree_global_epoch = 1;
+static _Atomic(_ctree_reader*)      _ctree_readers      = NULL;
+static pthread_key_t                _ctree_reader_key;
+static pthread_once_t               _ctree_reader_once = PTHREAD_ONCE_INIT;
+static _Thread_local _ctree_reader* _ctree_self        = NULL;
+
+/*
+ * Kinds of memory writer can retire.
+ */
+typedef enum {
+    RETIRED_NODE,
+    RETIRED_KEY,
+    RETIRED_VALUE,
+} _ctree_retired_kind;
+
+typedef struct {
+    cptr_t ptr;
+    byte   kind;
+} _ctree_retired;
+
+/*
+ * Growable list of the retired memory together with the global epoch
+ * it got retired in.
+ */
+typedef struct {
+    _ctree_retired* items;
+    size_t          len;
+    size_t          capacity;
+    ulong           epoch;
+} _ctree_limbo;
+
+/*
+ * Writer side state of the 'CTREE_CONCURRENT' tree.
+ *
+ * 'pending' holds everything retired by the operation in progress, it can't
+ * be tagged with the epoch until the new root is published (readers can still
+ * reach it through the old root).
+ * After publishing it is moved into one of the three 'limbo' lists, one for
+ * each of the epochs that can't be freed yet.
+ */
+struct _ctree_sync {
+    pthread_mutex_t lock;
+    ulong           stamp;
+    _ctree_limbo    pending;
+    _ctree_limbo    limbo[3];
+};
+
+/*
+ * Releases the '_ctree_reader' record on thread exit.
+ */
+static void
+_ctree_reader_release(cptr_t reader)
+{
+    _ctree_reader* self = reader;
+
+    atomic_store(&self->epoch, 0);
+    atomic_store(&self->in_use, false);
+}
+
+static void
+_ctree_reader_key_init(void)
+{
+    pthread_key_create(&_ctree_reader_key, _ctree_reader_release);
 }
 
 /*
- * CTreeNode constructor
+ * Returns the record of the calling thread, registering it (or recycling
+ * the record of some exited thread) on the first call.
  */
-static ctree_node*
-_ctreenode_new(cptr_t key, cptr_t value, ctree_node* parent)
+static _ctree_reader*
+_ctree_reader_self(void)
 {
-    ctree_node* node;
+    _ctree_reader* reader;
 
+    if((reader = _ctree_self) != NULL)
+        return reader;
+
+    pthread_once(&_ctree_reader_once, _ctree_reader_key_init);
+
+    for(reader = atomic_load(&_ctree_readers); reader != NULL; reader = reader->next) {
+        bool unused = false;
+        if(atomic_compare_exchange_strong(&reader->in_use, &unused, true))
+            break;
+    }
+
+    if(reader == NULL) {
 #ifndef COL_MEMORY_CONSTRAINED
-    if(__builtin_expect((node = memc_malloc(ctree_node)) == NULL, 0) || (node->key = key) == NULL) {
-#else
-    if((node = memc_malloc(cnode)) == NULL || (node->key = key) == NULL) {
-#endif
-#ifndef COL_MEMORY_CONSTRAINED
-        if(__builtin_expect(node == NULL, 0)) {
+        if(__builtin_expect((reader = memc_malloc(_ctree_reader)) == NULL, 0)) {
 #else
-        if(node == NULL) {
+        if((reader = memc_malloc(_ctree_reader)) == NULL) {
 #endif
             COL_ALLOC_ERROR;
-        } else {
-            COL_INVALID_KEY_ERROR;
-            free(node);
+            return NULL;
         }
-        return NULL;
+
+        atomic_init(&reader->epoch, 0);
+        atomic_init(&reader->in_use, true);
+        reader->next = atomic_load(&_ctree_readers);
+
+        while(!atomic_compare_exchange_weak(&_ctree_readers, &reader->next, reader))
+            ;
     }
 
-    node->value   = value;
-    node->height  = 0;
-    node->balance = 0;
-    node->right   = NULL;
-    node->left    = NULL;
-    node->parent  = parent;
+    reader->nesting = 0;
+    pthread_setspecific(_ctree_reader_key, reader);
 
-    return node;
+    return _ctree_self = reader;
 }
 
 /*
- * CTreeNode destructor
+ * Enters the read section, read sections can be nested.
+ * Returns false if the thread record could not be allocated.
  */
-void
-ctree_node_drop(ctree_node** nodep)
+static bool
+_ctree_read_enter(void)
 {
-    ctree_node* node;
-    if(nodep != NULL && (node = *nodep) != NULL) {
-        node->height  = 0;
-        node->balance = 0;
-        node->right   = NULL;
-        node->left    = NULL;
-        node->key     = NULL;
-        node->value   = NULL;
-        node->parent  = NULL;
-        *nodep        = NULL;
-        free(node);
+    _ctree_reader* self;
+
+    if((self = _ctree_reader_self()) == NULL)
+        return false;
+
+    if(self->nesting++ == 0) {
+        atomic_store(&self->epoch, atomic_load(&_ctree_global_epoch));
+        atomic_thread_fence(memory_order_seq_cst);
     }
+
+    return true;
 }
 
 /*
- * Helper function for CTree destructor.
- * Recursively frees all the nodes
+ * Leaves the read section.
  */
 static void
-_ctreenode_freeall(ctree* tree, ctree_node* node)
+_ctree_read_exit(void)
 {
-    if(node != NULL) {
-        _ctreenode_freeall(tree, node->left);
-        _ctreenode_freeall(tree, node->right);
+    _ctree_reader* self = _ctree_self;
 
-        if(tree->free_key_fn)
-            tree->free_key_fn(node->key);
+    if(self != NULL && self->nesting > 0 && --self->nesting == 0)
+        atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
 
-        if(tree->free_value_fn)
-            tree->free_value_fn(node->value);
+/*
+ * Advances the global epoch if all the readers inside of the read
+ * section observed the current one.
+ * Returns the current global epoch.
+ */
+static ulong
+_ctree_epoch_try_advance(void)
+{
+    ulong epoch = atomic_load(&_ctree_global_epoch);
 
-        tree->size--;
-        ctree_node_drop(&node);
+    for(_ctree_reader* reader = atomic_load(&_ctree_readers); reader != NULL; reader = reader->next) {
+        ulong seen = atomic_load(&reader->epoch);
+        if(seen != 0 && seen != epoch)
+            return epoch;
     }
+
+    if(atomic_compare_exchange_strong(&_ctree_global_epoch, &epoch, epoch + 1))
+        return epoch + 1;
+
+    return epoch;
 }
 
 /*
- * Updates the CTreeNode height and balance factor
+ * Appends the retired 'ptr' to the 'limbo'.
+ * Returns false if the limbo could not grow.
  */
-static void
-_ctreenode_update(ctree_node* node)
+static bool
+_ctree_limbo_push(_ctree_limbo* limbo, cptr_t ptr, byte kind)
 {
-    int left      = (node->left != NULL) ? (int) node->left->height : -1;
-    int right     = (node->right != NULL) ? (int) node->right->height : -1;
-    node->height  = ((left > right) ? left : right) + 1;
-    node->balance = right - left;
+    if(limbo->len == limbo->capacity) {
+        size_t          capacity = (limbo->capacity == 0) ? 64 : limbo->capacity * 2;
+        _ctree_retired* items    = realloc(limbo->items, capacity * sizeof(_ctree_retired));
+
+#ifndef COL_MEMORY_CONSTRAINED
+        if(__builtin_expect(items == NULL, 0)) {
+#else
+        if(items == NULL) {
+#endif
+            COL_ALLOC_ERROR;
+            return false;
+        }
+
+        limbo->items    = items;
+        limbo->capacity = capacity;
+    }
+
+    limbo->items[limbo->len++] = (_ctree_retired) { .ptr = ptr, .kind = kind };
+
+    return true;
 }
 
 /*
- * Rotation function, performs right rotation, after rotation
- * it updates the pivot and root node (height and balance factor)
+ * Frees everything inside of the 'limbo'.
  */
-static ctree_node*
-_ctreenode_rotate_right(ctree_node* node)
+static void
+_ctree_limbo_reclaim(ctree* tree, _ctree_limbo* limbo)
 {
-    ctree_node* new_root = node->left;
-    node->left           = new_root->right;
-    new_root->right      = node;
-    _ctreenode_update(node);
-    _ctreenode_update(new_root);
-    return new_root;
+    for(size_t i = 0; i < limbo->len; i++) {
+        _ctree_retired* retired = &limbo->items[i];
+
+        switch(retired->kind) {
+            case RETIRED_NODE:
+                free(_CTREENODE_HDR(retired->ptr));
+                break;
+            case RETIRED_KEY:
+                tree->free_key_fn(retired->ptr);
+                break;
+            case RETIRED_VALUE:
+                tree->free_value_fn(retired->ptr);
+                break;
+        }
+    }
+
+    limbo->len = 0;
 }
 
 /*
- * Rotation function, performs left rotation, after rotation
- * it updates the pivot and root node (height and balance factor)
+ * Retires the memory that is no longer reachable from the root being built
+ * by the writer, it will be freed once readers can't reach it anymore.
+ * Keys and values are only retired if the tree has the free function for them.
+ * If retiring fails memory is leaked rather than freed under the readers.
  */
-static ctree_node*
-_ctreenode_rotate_left(ctree_node* node)
+static void
+_ctree_retire(ctree* tree, cptr_t ptr, byte kind)
 {
-    ctree_node* new_root = node->right;
-    node->right          = new_root->left;
-    new_root->left       = node;
-    _ctreenode_update(node);
-    _ctreenode_update(new_root);
-    return new_root;
+    if((kind == RETIRED_KEY && tree->free_key_fn == NULL)
+       || (kind == RETIRED_VALUE && tree->free_value_fn == NULL))
+        return;
+
+    _ctree_limbo_push(&tree->sync->pending, ptr, kind);
 }
 
 /*
- * Rotation function, performs multiple rotations by first rotating the right
- * child of the root by applying the right rotation on it, then rotates the root
- * and pivot (new right child) by applying left rotation
+ * Starts the writer operation on the 'CTREE_CONCURRENT' tree.
  */
-static ctree_node*
-_ctreenode_rotate_right_left(ctree_node* node)
+static void
+_ctree_sync_begin(ctree* tree)
 {
-    node->right = _ctreenode_rotate_right(node->right);
-    return _ctreenode_rotate_left(node);
+    pthread_mutex_lock(&tree->sync->lock);
+    tree->sync->stamp++;
 }
 
 /*
- * Rotation function, performs multiple rotations by first rotating the left
- * child of the root by applying the left rotation on it, then rotates the root
- * and pivot (new left child) by applying right rotation
+ * Publishes the 'root' and the 'size' built by the writer, moves the memory it
+ * retired into the limbo of the current epoch, frees whatever became
+ * unreachable and ends the writer operation.
  */
-static ctree_node*
-_ctreenode_rotate_left_right(ctree_node* node)
+static void
+_ctree_sync_end(ctree* tree, ctree_node* root, uint size)
 {
-    node->left = _ctreenode_rotate_left(node->left);
-    return _ctreenode_rotate_right(node);
+    _ctree_sync*  sync = tree->sync;
+    _ctree_limbo* limbo;
+    ulong         epoch;
+
+    __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+    __atomic_store_n(&tree->size, size, __ATOMIC_RELAXED);
+
+    if(sync->pending.len > 0) {
+        epoch = atomic_load(&_ctree_global_epoch);
+        limbo = &sync->limbo[epoch % 3];
+
+        // Everything in there is at least 3 epochs old
+        if(limbo->epoch != epoch) {
+            _ctree_limbo_reclaim(tree, limbo);
+            limbo->epoch = epoch;
+        }
+
+        for(size_t i = 0; i < sync->pending.len; i++)
+            _ctree_limbo_push(limbo, sync->pending.items[i].ptr, sync->pending.items[i].kind);
+
+        sync->pending.len = 0;
+    }
+
+    epoch = _ctree_epoch_try_advance();
+
+    for(uint i = 0; i < 3; i++) {
+        limbo = &sync->limbo[i];
+        if(limbo->len > 0 && limbo->epoch + 2 <= epoch)
+            _ctree_limbo_reclaim(tree, limbo);
+    }
+
+    pthread_mutex_unlock(&sync->lock);
 }
 
 /*
- * Rebalancing function, initiates rotations only
- * if the node balance factor is not part of the
- * {-1, 0, 1} set.
+ * Enters the read section of the 'CTREE_CONCURRENT' tree.
+ * Does nothing for the trees constructed in other modes.
  */
-static ctree_node*
-_ctreenode_rebalance(ctree_node* node)
+void
+ctree_read_enter(ctree* tree)
 {
-    if(node->balance < -1) {
-        // AVL tree invariant must not be broken
-        assert(node->balance == -2);
+    if(tree != NULL && (tree->mode & CTREE_CONCURRENT))
+        _ctree_read_enter();
+}
+
+/*
+ * Leaves the read section of the 'CTREE_CONCURRENT' tree.
+ * Does nothing for the trees constructed in other modes.
+ */
+void
+ctree_read_exit(ctree* tree)
+{
+    if(tree != NULL && (tree->mode & CTREE_CONCURRENT))
+        _ctree_read_exit();
+}
+
+/*
+ * Loads the current root of the 'tree'.
+ */
+static inline ctree_node*
+_ctree_root(const ctree* tree)
+{
+    if(tree->mode & CTREE_CONCURRENT)
+        return __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+
+    return tree->root;
+}
+
+/*
+ * CTree constructor
+ * 'compare_key_fn' is required.
+ * 'free_key_fn' is optional, if user provides free_key_fn
+ * then the key that gets removed gets also freed as specified
+ * in the implementation of free_key_fn, if it is NULL then the
+ * user is responsible for freeing the key memory.
+ */
+ctree*
+ctree_new(CCompareKeyFn compare_key_fn,
+          CFreeKeyFn    free_key_fn,
+          CFreeValueFn  free_value_fn,
+          CClone        clone_key_fn,
+          CClone        clone_value_fn)
+{
+    return ctree_new_with_mode(compare_key_fn,
+                               free_key_fn,
+                               free_value_fn,
+                               clone_key_fn,
+                               clone_value_fn,
+                               CTREE_DEFAULT);
+}
+
+/*
+ * Allocates the writer state for the 'CTREE_CONCURRENT' tree.
+ */
+static _ctree_sync*
+_ctree_sync_new(void)
+{
+    _ctree_sync* sync = calloc(1, sizeof(_ctree_sync));
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(sync == NULL, 0)) {
+#else
+    if(sync == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    pthread_mutex_init(&sync->lock, NULL);
+
+    return sync;
+}
+
+/*
+ * CTree constructor, same as 'ctree_new' except the tree is constructed
+ * in the given 'mode'.
+ */
+ctree*
+ctree_new_with_mode(CCompareKeyFn compare_key_fn,
+                    CFreeKeyFn    free_key_fn,
+                    CFreeValueFn  free_value_fn,
+                    CClone        clone_key_fn,
+                    CClone        clone_value_fn,
+                    ctree_mode    mode)
+{
+    return ctree_new_with_policy(compare_key_fn,
+                                 free_key_fn,
+                                 free_value_fn,
+                                 clone_key_fn,
+                                 clone_value_fn,
+                                 mode,
+                                 CTREE_AVL);
+}
+
+/*
+ * CTree constructor, same as 'ctree_new_with_mode' except the tree
+ * is balanced according to the given 'policy'.
+ */
+ctree*
+ctree_new_with_policy(CCompareKeyFn compare_key_fn,
+                      CFreeKeyFn    free_key_fn,
+                      CFreeValueFn  free_value_fn,
+                      CClone        clone_key_fn,
+                      CClone        clone_value_fn,
+                      ctree_mode    mode,
+                      ctree_policy  policy)
+{
+    ctree* tree = memc_malloc(ctree);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(tree == NULL, 0)) {
+#else
+    if(tree == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    if((tree->compare_key_fn = compare_key_fn) == NULL) {
+        COL_INVALID_CMPFN_ERROR;
+        free(tree);
+        return NULL;
+    }
+
+    tree->prefix_key_fn  = NULL;
+    tree->clone_key_fn   = clone_key_fn;
+    tree->clone_value_fn = clone_value_fn;
+    tree->free_key_fn    = free_key_fn;
+    tree->free_value_fn  = free_value_fn;
+    tree->root           = NULL;
+    tree->size           = 0;
+    tree->flags          = COL_BYTE;
+    tree->mode           = mode;
+    tree->policy         = policy;
+    tree->sync           = NULL;
+    tree->finger         = NULL;
+    tree->min            = NULL;
+    tree->max            = NULL;
+    tree->key_size       = 0;
+    tree->value_size     = 0;
+    tree->pool           = NULL;
+    tree->arena          = NULL;
+    tree->compact        = NULL;
+    tree->cache          = NULL;
+
+    if((mode & CTREE_CONCURRENT) && (mode & CTREE_PERSISTENT)) {
+        COL_ERROR("ctree can't be both concurrent and persistent");
+        free(tree);
+        return NULL;
+    }
+
+    if((mode & CTREE_FINGER) && (mode & _CTREE_COW)) {
+        COL_ERROR("ctree finger requires parent links");
+        free(tree);
+        return NULL;
+    }
+
+    if(policy > CTREE_SPLAY || (policy != CTREE_AVL && (mode & _CTREE_COW))) {
+        COL_ERROR("ctree policy requires parent links");
+        free(tree);
+        return NULL;
+    }
+
+    if((mode & CTREE_CONCURRENT) && (tree->sync = _ctree_sync_new()) == NULL) {
+        free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+/*
+ * CTree constructor, keys of the 'key_size' bytes and values of the
+ * 'value_size' bytes (0 for no values) get copied into the node itself,
+ * insertion and removal make a single allocation/deallocation.
+ * Tree owns the copies, there is nothing to free or clone.
+ */
+ctree*
+ctree_new_inline(size_t key_size, size_t value_size, CCompareKeyFn compare_key_fn, ctree_mode mode)
+{
+    ctree* tree;
+
+    if(key_size == 0 || key_size > UINT32_MAX || value_size > UINT32_MAX) {
+        COL_ERROR("invalid ctree inline key/value size");
+        return NULL;
+    }
+
+    if(mode & _CTREE_COW) {
+        COL_ERROR("ctree inline storage requires parent links");
+        return NULL;
+    }
+
+    if((tree = ctree_new_with_mode(compare_key_fn, NULL, NULL, NULL, NULL, mode)) != NULL) {
+        tree->key_size   = key_size;
+        tree->value_size = value_size;
+    }
+
+    return tree;
+}
+
+/*
+ * Payload constructor, payload starts with a single node reference.
+ * If 'key_src' is provided the key is borrowed from it.
+ */
+static _ctree_payload*
+_ctree_payload_new(cptr_t key, cptr_t value, _ctree_payload* key_src)
+{
+    _ctree_payload* payload = memc_malloc(_ctree_payload);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(payload == NULL, 0)) {
+#else
+    if(payload == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    atomic_init(&payload->refs, 1);
+    payload->key     = key;
+    payload->value   = value;
+    payload->key_src = key_src;
+
+    if(key_src != NULL)
+        atomic_fetch_add_explicit(&key_src->refs, _CTREE_PAYLOAD_BORROW, memory_order_relaxed);
+
+    return payload;
+}
+
+/*
+ * Drops either the node reference ('unit' is 1) or the borrow
+ * ('unit' is '_CTREE_PAYLOAD_BORROW') of the 'payload'.
+ */
+static void
+_ctree_payload_release(const ctree* tree, _ctree_payload* payload, unsigned long long unit)
+{
+    while(payload != NULL) {
+        // Once the reference is dropped payload can be freed by the borrower
+        cptr_t             value = (unit == 1) ? payload->value : NULL;
+        unsigned long long refs  = atomic_fetch_sub_explicit(&payload->refs, unit, memory_order_acq_rel);
+
+        if(unit == 1 && (refs & _CTREE_PAYLOAD_REFS) == 1 && tree->free_value_fn)
+            tree->free_value_fn(value);
+
+        if(refs != unit)
+            return;
+
+        _ctree_payload* key_src = payload->key_src;
+
+        if(key_src == NULL && tree->free_key_fn)
+            tree->free_key_fn(payload->key);
+
+        free(payload);
+
+        payload = key_src;
+        unit    = _CTREE_PAYLOAD_BORROW;
+    }
+}
+
+/*
+ * Sets the prefix extractor of the empty 'tree'.
+ * Returns false if the tree is not empty.
+ */
+bool
+ctree_set_prefix_fn(ctree* tree, CPrefixKeyFn prefix_key_fn)
+{
+    return_val_if_fail(tree != NULL, false);
+
+    if(tree->root != NULL) {
+        COL_ERROR("ctree prefix fn can only be set on the empty tree");
+        return false;
+    }
+
+    tree->prefix_key_fn = prefix_key_fn;
+    return true;
+}
+
+/*
+ * Prefix extractor for the null terminated strings, first 8 bytes
+ * of the string packed big-endian (zero padded).
+ */
+ulong
+ctree_prefix_str(cconstptr_t key)
+{
+    const unsigned char* str    = key;
+    ulong                prefix = 0;
+
+    for(uint i = 0; i < sizeof(ulong); i++) {
+        prefix <<= 8;
+
+        if(*str != '\0')
+            prefix |= *str++;
+    }
+
+    return prefix;
+}
+
+/*
+ * Prefix of the 'key', 0 if the 'tree' has no prefix extractor.
+ */
+static inline ulong
+_ctree_prefix(const ctree* tree, cconstptr_t key)
+{
+#ifndef COL_MEMORY_CONSTRAINED
+    return (tree->prefix_key_fn != NULL) ? tree->prefix_key_fn(key) : 0;
+#else
+    (void) tree;
+    (void) key;
+    return 0;
+#endif
+}
+
+/*
+ * Compares the key of the 'node' with the 'key' having the 'prefix',
+ * prefixes are compared first and 'CCompareKeyFn' only runs
+ * (touching the key of the node) when they are equal.
+ */
+static inline int
+_ctreenode_cmp(const ctree* tree, const ctree_node* node, cconstptr_t key, ulong prefix)
+{
+#ifndef COL_MEMORY_CONSTRAINED
+    if(node->prefix != prefix)
+        return (node->prefix > prefix) ? 1 : -1;
+#else
+    (void) prefix;
+#endif
+
+    return tree->compare_key_fn(node->key, key);
+}
+
+/*
+ * Allocates the memory for the node of the 'tree'.
+ * Nodes of the 'CTREE_CONCURRENT' tree get the header stamped with
+ * the current writer operation, nodes of the 'CTREE_PERSISTENT' tree
+ * get the header with a single reference.
+ */
+static ctree_node*
+_ctreenode_alloc(const ctree* tree)
+{
+    if(tree->mode & CTREE_CONCURRENT) {
+        _ctreenode_hdr* hdr = malloc(sizeof(_ctreenode_hdr) + sizeof(ctree_node));
+
+        if(hdr == NULL)
+            return NULL;
+
+        hdr->stamp = tree->sync->stamp;
+        return (ctree_node*) (hdr + 1);
+    } else if(tree->mode & CTREE_PERSISTENT) {
+        _ctreenode_phdr* hdr = malloc(sizeof(_ctreenode_phdr) + sizeof(ctree_node));
+
+        if(hdr == NULL)
+            return NULL;
+
+        atomic_init(&hdr->refs, 1);
+        hdr->payload = NULL;
+        return (ctree_node*) (hdr + 1);
+    }
+
+    if(_CTREE_INLINE(tree))
+        return malloc(sizeof(ctree_node) + _CTREE_INLINE_ALIGN(tree->key_size) + tree->value_size);
+
+    if(tree->pool != NULL && tree->pool->head != NULL) {
+        ctree_node* node = tree->pool->head;
+        tree->pool->head = node->right;
+        tree->pool->size--;
+        return node;
+    }
+
+    return memc_malloc(ctree_node);
+}
+
+/*
+ * Stores the 'value' into the 'node', value of the inline tree
+ * is copied into the node (zeroed if NULL).
+ */
+static inline void
+_ctreenode_put_value(const ctree* tree, ctree_node* node, cptr_t value)
+{
+    if(!_CTREE_INLINE(tree))
+        node->value = value;
+    else if(value != NULL)
+        memcpy(node->value, value, tree->value_size);
+    else if(node->value != NULL)
+        memset(node->value, 0, tree->value_size);
+}
+
+/*
+ * Returns the set (both ways) of the lookup cache the 'hash' maps to.
+ */
+static inline _ctree_cache_way*
+_ctree_cache_set(const _ctree_cache* cache, ulong hash)
+{
+    return cache->ways + 2 * (((hash * 0x9E3779B97F4A7C15UL) >> 32) & cache->mask);
+}
+
+/*
+ * Returns the cached node holding the 'key', NULL on the cache miss.
+ * Hit in the second way makes it the most recently used one.
+ */
+static inline ctree_node*
+_ctree_cache_get(const ctree* tree, cconstptr_t key, ulong prefix, ulong hash)
+{
+    _ctree_cache*     cache = tree->cache;
+    _ctree_cache_way* way   = _ctree_cache_set(cache, hash);
+    _ctree_cache_way  hit;
+
+    for(int i = 0; i < 2; i++) {
+        if(way[i].node != NULL && way[i].hash == hash && _ctreenode_cmp(tree, way[i].node, key, prefix) == 0) {
+            hit    = way[i];
+            way[i] = way[0];
+            way[0] = hit;
+            cache->hits++;
+            return hit.node;
+        }
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+/*
+ * Caches the 'node' found by the key of the 'hash', evicting
+ * the least recently used way of its set.
+ */
+static inline void
+_ctree_cache_put(_ctree_cache* cache, ulong hash, ctree_node* node)
+{
+    _ctree_cache_way* way = _ctree_cache_set(cache, hash);
+
+    way[1]      = way[0];
+    way[0].hash = hash;
+    way[0].node = node;
+}
+
+/*
+ * Drops the cached 'node' holding the 'key' (or the key equal to it).
+ */
+static inline void
+_ctree_cache_forget(const ctree* tree, cconstptr_t key, const ctree_node* node)
+{
+    _ctree_cache_way* way = _ctree_cache_set(tree->cache, tree->cache->hash_fn(key));
+
+    if(way[1].node == node)
+        way[1].node = NULL;
+
+    if(way[0].node == node) {
+        way[0]      = way[1];
+        way[1].node = NULL;
+    }
+}
+
+/*
+ * Replaces the key of the 'node' with the equal 'key'.
+ */
+static inline void
+_ctreenode_put_key(const ctree* tree, ctree_node* node, cptr_t key)
+{
+    if(tree->cache != NULL)
+        _ctree_cache_forget(tree, key, node);
+
+    if(_CTREE_INLINE(tree))
+        memcpy(node->key, key, tree->key_size);
+    else
+        node->key = key;
+}
+
+/*
+ * Returns true if the nodes of the 'tree' can be moved into the 'other'
+ * tree, that is both store keys/values the same way and cache the same
+ * key prefixes.
+ */
+static bool
+_ctree_same_layout(const ctree* tree, const ctree* other)
+{
+    if(tree->key_size != other->key_size || tree->value_size != other->value_size) {
+        COL_ERROR("ctree node layouts differ");
+        return false;
+    }
+
+    if(tree->prefix_key_fn != other->prefix_key_fn) {
+        COL_ERROR("ctree prefix fns differ");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Returns true if the 'node' lives inside the 'arena'.
+ */
+static inline bool
+_ctree_arena_holds(const _ctree_arena* arena, const ctree_node* node)
+{
+    return arena->base != NULL && (const byte*) node >= arena->base
+           && (const byte*) node < arena->base + arena->capacity * arena->stride;
+}
+
+/*
+ * Gives the 'node' back to the compaction block it lives in.
+ * Returns false if the node is not inside any of the blocks of the 'tree'.
+ */
+static bool
+_ctree_arena_put(const ctree* tree, ctree_node* node)
+{
+    _ctree_arena* arena;
+
+    for(arena = tree->arena; arena != NULL; arena = arena->next) {
+        if(_ctree_arena_holds(arena, node)) {
+            if(--arena->live == 0 && (arena != tree->arena || tree->compact == NULL)) {
+                free(arena->base);
+                arena->base = NULL;
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Drops the blocks of the 'tree' all the nodes moved out of,
+ * every block is released if 'all' is true.
+ */
+static void
+_ctree_arena_prune(ctree* tree, bool all)
+{
+    _ctree_arena** link = &tree->arena;
+    _ctree_arena*  arena;
+
+    while((arena = *link) != NULL) {
+        if(all || arena->live == 0) {
+            *link = arena->next;
+            free(arena->base);
+            free(arena);
+        } else {
+            link = &arena->next;
+        }
+    }
+}
+
+/*
+ * Releases the memory of the node allocated with '_ctreenode_alloc'
+ * (or relocated by the compaction).
+ */
+static void
+_ctreenode_free(const ctree* tree, ctree_node* node)
+{
+    if(tree->mode & CTREE_CONCURRENT) {
+        free(_CTREENODE_HDR(node));
+    } else if(tree->mode & CTREE_PERSISTENT) {
+        free(_CTREENODE_PHDR(node));
+    } else if(tree->arena != NULL && _ctree_arena_put(tree, node)) {
+        return;
+    } else if(tree->pool != NULL && tree->pool->size < COL_CTREE_POOL_SIZE) {
+        node->right      = tree->pool->head;
+        tree->pool->head = node;
+        tree->pool->size++;
+    } else {
+        free(node);
+    }
+}
+
+/*
+ * CTreeNode constructor
+ */
+static ctree_node*
+_ctreenode_new(const ctree* tree, cptr_t key, cptr_t value, ctree_node* parent)
+{
+    ctree_node* node;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect((node = _ctreenode_alloc(tree)) == NULL, 0) || (node->key = key) == NULL) {
+#else
+    if((node = _ctreenode_alloc(tree)) == NULL || (node->key = key) == NULL) {
+#endif
+#ifndef COL_MEMORY_CONSTRAINED
+        if(__builtin_expect(node == NULL, 0)) {
+#else
+        if(node == NULL) {
+#endif
+            COL_ALLOC_ERROR;
+        } else {
+            COL_INVALID_KEY_ERROR;
+            _ctreenode_free(tree, node);
+        }
+        return NULL;
+    }
+
+    node->value   = value;
+#ifndef COL_MEMORY_CONSTRAINED
+    node->prefix  = _ctree_prefix(tree, key);
+#endif
+
+    if(_CTREE_INLINE(tree)) {
+        node->key   = memcpy(node + 1, key, tree->key_size);
+        node->value = (tree->value_size != 0) ? (byte*) node->key + _CTREE_INLINE_ALIGN(tree->key_size) : NULL;
+        _ctreenode_put_value(tree, node, value);
+    }
+
+    node->height  = 0;
+    node->balance = 0;
+    node->right   = NULL;
+    node->left    = NULL;
+    node->parent  = parent;
+#ifdef COL_CTREE_THREADED
+    node->next = NULL;
+    node->prev = NULL;
+#endif
+
+    if((tree->mode & CTREE_PERSISTENT)
+       && (_CTREENODE_PHDR(node)->payload = _ctree_payload_new(key, value, NULL)) == NULL) {
+        _ctreenode_free(tree, node);
+        return NULL;
+    }
+
+    return node;
+}
+
+/*
+ * CTreeNode destructor
+ */
+void
+ctree_node_drop(ctree_node** nodep)
+{
+    ctree_node* node;
+    if(nodep != NULL && (node = *nodep) != NULL) {
+        node->height  = 0;
+        node->balance = 0;
+        node->right   = NULL;
+        node->left    = NULL;
+        node->key     = NULL;
+        node->value   = NULL;
+        node->parent  = NULL;
+#ifdef COL_CTREE_THREADED
+        node->next = NULL;
+        node->prev = NULL;
+#endif
+        *nodep = NULL;
+        free(node);
+    }
+}
+
+/*
+ * Frees the key/value (using the free functions of the 'tree') and the
+ * node removed from the 'tree'.
+ */
+static void
+_ctreenode_destroy(const ctree* tree, ctree_node* node)
+{
+    if(tree->free_key_fn)
+        tree->free_key_fn(node->key);
+
+    if(tree->free_value_fn)
+        tree->free_value_fn(node->value);
+
+    _ctreenode_free(tree, node);
+}
+
+/*
+ * Counts the nodes of the subtree.
+ */
+static ulong
+_ctreenode_count(const ctree_node* node)
+{
+    ulong count = 0;
+
+    for(; node != NULL; node = node->right)
+        count += _ctreenode_count(node->left) + 1;
+
+    return count;
+}
+
+/*
+ * Helper function for CTree destructor.
+ * Recursively frees all the nodes, size of the tree is left as is.
+ */
+static void
+_ctreenode_freeall(const ctree* tree, ctree_node* node)
+{
+    if(node != NULL) {
+        _ctreenode_freeall(tree, node->left);
+        _ctreenode_freeall(tree, node->right);
+        _ctreenode_destroy(tree, node);
+    }
+}
+
+/*
+ * Frees up to 'budget' nodes of the subtree '*rootp' points to without
+ * recursion, left children are rotated up until the smallest node is
+ * the root, which is then freed and replaced by its right child.
+ * Remaining subtree is stored back into '*rootp'.
+ * Returns the number of freed nodes.
+ */
+static ulong
+_ctreenode_free_batch(const ctree* tree, ctree_node** rootp, ulong budget)
+{
+    ctree_node* node  = *rootp;
+    ctree_node* next;
+    ulong       freed = 0;
+
+    while(node != NULL && freed < budget) {
+        if((next = node->left) != NULL) {
+            node->left  = next->right;
+            next->right = node;
+        } else {
+            next = node->right;
+            _ctreenode_destroy(tree, node);
+            freed++;
+        }
+
+        node = next;
+    }
+
+    *rootp = node;
+
+    return freed;
+}
+
+/*
+ * Returns the height (rank in 'CTREE_WAVL' tree) of the subtree, -1 if empty.
+ */
+static inline int
+_ctreenode_height(const ctree_node* node)
+{
+    return (node != NULL) ? (int) node->height : -1;
+}
+
+/*
+ * Updates the CTreeNode height and balance factor
+ */
+static void
+_ctreenode_update(ctree_node* node)
+{
+    int left      = (node->left != NULL) ? (int) node->left->height : -1;
+    int right     = (node->right != NULL) ? (int) node->right->height : -1;
+    node->height  = ((left > right) ? left : right) + 1;
+    node->balance = right - left;
+}
+
+/*
+ * Performs right rotation relinking the nodes only,
+ * balance fields are left to the caller.
+ */
+static ctree_node*
+_ctreenode_pivot_right(ctree_node* node)
+{
+    ctree_node* new_root = node->left;
+    node->left           = new_root->right;
+    new_root->right      = node;
+    new_root->parent     = node->parent;
+    node->parent         = new_root;
+
+    if(node->left != NULL)
+        node->left->parent = node;
+
+    return new_root;
+}
+
+/*
+ * Performs left rotation relinking the nodes only,
+ * balance fields are left to the caller.
+ */
+static ctree_node*
+_ctreenode_pivot_left(ctree_node* node)
+{
+    ctree_node* new_root = node->right;
+    node->right          = new_root->left;
+    new_root->left       = node;
+    new_root->parent     = node->parent;
+    node->parent         = new_root;
+
+    if(node->right != NULL)
+        node->right->parent = node;
+
+    return new_root;
+}
+
+/*
+ * Rotation function, performs right rotation, after rotation
+ * it updates the pivot and root node (height and balance factor)
+ */
+static ctree_node*
+_ctreenode_rotate_right(ctree_node* node)
+{
+    ctree_node* new_root = _ctreenode_pivot_right(node);
+
+    _ctreenode_update(node);
+    _ctreenode_update(new_root);
+    return new_root;
+}
+
+/*
+ * Rotation function, performs left rotation, after rotation
+ * it updates the pivot and root node (height and balance factor)
+ */
+static ctree_node*
+_ctreenode_rotate_left(ctree_node* node)
+{
+    ctree_node* new_root = _ctreenode_pivot_left(node);
+
+    _ctreenode_update(node);
+    _ctreenode_update(new_root);
+    return new_root;
+}
+
+/*
+ * Rotation function, performs multiple rotations by first rotating the right
+ * child of the root by applying the right rotation on it, then rotates the root
+ * and pivot (new right child) by applying left rotation
+ */
+static ctree_node*
+_ctreenode_rotate_right_left(ctree_node* node)
+{
+    node->right = _ctreenode_rotate_right(node->right);
+    return _ctreenode_rotate_left(node);
+}
+
+/*
+ * Rotation function, performs multiple rotations by first rotating the left
+ * child of the root by applying the left rotation on it, then rotates the root
+ * and pivot (new left child) by applying right rotation
+ */
+static ctree_node*
+_ctreenode_rotate_left_right(ctree_node* node)
+{
+    node->left = _ctreenode_rotate_left(node->left);
+    return _ctreenode_rotate_right(node);
+}
+
+/*
+ * Rebalancing function, initiates rotations only
+ * if the node balance factor is not part of the
+ * {-1, 0, 1} set.
+ */
+static ctree_node*
+_ctreenode_rebalance(ctree_node* node)
+{
+    if(node->balance < -1) {
+        // AVL tree invariant must not be broken
+        assert(node->balance == -2);
         return (node->left->balance <= 0) ? _ctreenode_rotate_right(node)
                                           : _ctreenode_rotate_left_right(node);
     } else if(node->balance > 1) {
-        // AVL tree invariant must not be broken
-        assert(node->balance == 2);
-        return (node->right->balance >= 0) ? _ctreenode_rotate_left(node)
-                                           : _ctreenode_rotate_right_left(node);
+        // AVL tree invariant must not be broken
+        assert(node->balance == 2);
+        return (node->right->balance >= 0) ? _ctreenode_rotate_left(node)
+                                           : _ctreenode_rotate_right_left(node);
+    }
+    return node;
+}
+
+/*
+ * Finds the smallest node given the root 'node'.
+ */
+static ctree_node*
+_ctree_min(const ctree_node* node)
+{
+    return_val_if_fail(node != NULL, NULL);
+
+    while(node->left != NULL)
+        node = node->left;
+
+    return (ctree_node*) node;
+}
+
+/*
+ * Finds the largest node given the root 'node'.
+ */
+static ctree_node*
+_ctree_max(const ctree_node* node)
+{
+    return_val_if_fail(node != NULL, NULL);
+
+    while(node->right != NULL)
+        node = node->right;
+
+    return (ctree_node*) node;
+}
+
+/*
+ * Returns the in-order successor of the 'node' inside the subtree rooted
+ * at 'root' through the parent links, NULL once the subtree is done.
+ * Walks of the subtree built on it don't recurse, so they are safe for
+ * the arbitrarily deep 'CTREE_SPLAY' tree.
+ */
+static ctree_node*
+_ctreenode_next_in(const ctree_node* node, const ctree_node* root)
+{
+    if(node->right != NULL)
+        return _ctree_min(node->right);
+
+    while(node != root && node->parent->right == node)
+        node = node->parent;
+
+    return (node == root) ? NULL : node->parent;
+}
+
+/*
+ * Trees that mutate the nodes in place cache their smallest and largest
+ * node ('min', 'max'). Cache follows the nodes attached and unlinked one
+ * at a time, bulk operations (split, join, set operations, batches) reset
+ * it to NULL and it is looked up again once asked for.
+ * Rotations never change which node holds which key, so they don't
+ * touch the cache.
+ */
+
+/*
+ * Updates the cached edges once the freshly inserted 'node' got linked
+ * under its parent (or became the root of the empty tree).
+ */
+static inline void
+_ctree_edges_attach(ctree* tree, ctree_node* node)
+{
+    ctree_node* parent = node->parent;
+
+    if(parent == NULL) {
+        tree->min = node;
+        tree->max = node;
+    } else if(parent->left == node) {
+        if(parent == tree->min)
+            tree->min = node;
+    } else if(parent == tree->max) {
+        tree->max = node;
+    }
+}
+
+/*
+ * Updates the cached edges before the 'node' gets unlinked from the tree,
+ * edge node never has two children so its neighbour is either down its
+ * only subtree or its parent.
+ * Cursor of the incremental compaction steps back to the parent.
+ */
+static inline void
+_ctree_edges_detach(ctree* tree, const ctree_node* node)
+{
+    if(node == tree->compact)
+        tree->compact = node->parent;
+
+    if(tree->cache != NULL)
+        _ctree_cache_forget(tree, node->key, node);
+
+#ifdef COL_CTREE_THREADED
+    if(node == tree->min)
+        tree->min = node->next;
+    if(node == tree->max)
+        tree->max = node->prev;
+#else
+    if(node == tree->min)
+        tree->min = (node->right != NULL) ? _ctree_min(node->right) : node->parent;
+    if(node == tree->max)
+        tree->max = (node->left != NULL) ? _ctree_max(node->left) : node->parent;
+#endif
+}
+
+/*
+ * Forgets the cached edges (and the lookup cache) after the bulk
+ * operation, pass of the incremental compaction ends early.
+ */
+static inline void
+_ctree_edges_reset(ctree* tree)
+{
+    tree->min     = NULL;
+    tree->max     = NULL;
+    tree->compact = NULL;
+
+    if(tree->cache != NULL)
+        memset(tree->cache->ways, 0, 2 * (tree->cache->mask + 1) * sizeof(_ctree_cache_way));
+}
+
+/*
+ * Returns the smallest node of the tree that is not copy-on-write,
+ * NULL if the tree is empty.
+ */
+static inline ctree_node*
+_ctree_first(ctree* tree)
+{
+    if(tree->min == NULL && tree->root != NULL)
+        tree->min = _ctree_min(tree->root);
+
+    return tree->min;
+}
+
+/*
+ * Returns the largest node of the tree that is not copy-on-write,
+ * NULL if the tree is empty.
+ */
+static inline ctree_node*
+_ctree_last(ctree* tree)
+{
+    if(tree->max == NULL && tree->root != NULL)
+        tree->max = _ctree_max(tree->root);
+
+    return tree->max;
+}
+
+#ifdef COL_CTREE_THREADED
+/*
+ * Threads freshly inserted 'node' into the in-order list
+ * right before its 'succ' (node is the left child of 'succ').
+ */
+static void
+_ctreenode_thread_before(ctree_node* node, ctree_node* succ)
+{
+    node->next = succ;
+    node->prev = succ->prev;
+
+    if(succ->prev != NULL)
+        succ->prev->next = node;
+
+    succ->prev = node;
+}
+
+/*
+ * Threads freshly inserted 'node' into the in-order list
+ * right after its 'pred' (node is the right child of 'pred').
+ */
+static void
+_ctreenode_thread_after(ctree_node* node, ctree_node* pred)
+{
+    node->prev = pred;
+    node->next = pred->next;
+
+    if(pred->next != NULL)
+        pred->next->prev = node;
+
+    pred->next = node;
+}
+
+/*
+ * Removes the 'node' from the in-order list.
+ */
+static void
+_ctreenode_unthread(ctree_node* node)
+{
+    if(node->prev != NULL)
+        node->prev->next = node->next;
+
+    if(node->next != NULL)
+        node->next->prev = node->prev;
+}
+#endif
+
+/*
+ * Detaches the node with the smallest key from the subtree
+ * rooted at 'node' storing it into 'min'.
+ * Returns the new (rebalanced) root of the subtree.
+ */
+static ctree_node*
+_ctreenode_detach_min(ctree_node* node, ctree_node** min)
+{
+    if(node->left == NULL) {
+        *min = node;
+
+        if(node->right != NULL)
+            node->right->parent = node->parent;
+
+        return node->right;
+    }
+
+    node->left = _ctreenode_detach_min(node->left, min);
+    _ctreenode_update(node);
+    return _ctreenode_rebalance(node);
+}
+
+/*
+ * Detaches the node with the largest key from the subtree
+ * rooted at 'node' storing it into 'max'.
+ * Returns the new (rebalanced) root of the subtree.
+ */
+static ctree_node*
+_ctreenode_detach_max(ctree_node* node, ctree_node** max)
+{
+    if(node->right == NULL) {
+        *max = node;
+
+        if(node->left != NULL)
+            node->left->parent = node->parent;
+
+        return node->left;
+    }
+
+    node->right = _ctreenode_detach_max(node->right, max);
+    _ctreenode_update(node);
+    return _ctreenode_rebalance(node);
+}
+
+/*
+ * Internal recursive BST insertion function.
+ * It updates the node parameters and does the
+ * recursive tree rebalancing.
+ */
+static ctree_node*
+_ctreenode_insert(ctree*      tree,
+                  ctree_node* parent,
+                  ctree_node* node,
+                  cptr_t      key,
+                  ulong       prefix,
+                  cptr_t      value,
+                  bool        replace)
+{
+    int cmp;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(node == NULL && __builtin_expect((node = _ctreenode_new(tree, key, value, parent)) != NULL, 1)) {
+#else
+    if(node == NULL && (node = _ctreenode_new(tree, key, value, parent)) != NULL) {
+#endif
+        tree->size++;
+        tree->flags |= INSERTED;
+
+        if(parent == NULL)
+            _ctree_edges_attach(tree, node);
+    } else if((cmp = _ctreenode_cmp(tree, node, key, prefix)) > 0) {
+        ctree_node* left = node->left;
+        node->left       = _ctreenode_insert(tree, node, left, key, prefix, value, replace);
+
+        if(left == NULL && node->left != NULL) {
+            _ctree_edges_attach(tree, node->left);
+#ifdef COL_CTREE_THREADED
+            _ctreenode_thread_before(node->left, node);
+#endif
+        }
+    } else if(cmp < 0) {
+        ctree_node* right = node->right;
+        node->right       = _ctreenode_insert(tree, node, right, key, prefix, value, replace);
+
+        if(right == NULL && node->right != NULL) {
+            _ctree_edges_attach(tree, node->right);
+#ifdef COL_CTREE_THREADED
+            _ctreenode_thread_after(node->right, node);
+#endif
+        }
+    } else {
+
+        if(tree->free_value_fn)
+            tree->free_value_fn(node->value);
+
+        _ctreenode_put_value(tree, node, value);
+
+        if(replace) {
+            tree->flags |= REPLACED;
+
+            if(tree->free_key_fn)
+                tree->free_key_fn(node->key);
+
+            _ctreenode_put_key(tree, node, key);
+        }
+    }
+
+    if(tree->flags & INSERTED) {
+        _ctreenode_update(node);
+        return _ctreenode_rebalance(node);
+    }
+
+    return node;
+}
+
+/*
+ * Internal recursive function behind the entry API, descends once
+ * to the 'key' and stores its node into 'entry', if the key is not
+ * found it is inserted with the NULL value.
+ * Rebalances the path only if the node got inserted.
+ */
+static ctree_node*
+_ctreenode_entry(ctree* tree, ctree_node* parent, ctree_node* node, cptr_t key, ulong prefix, ctree_node** entry)
+{
+    int cmp;
+
+    if(node == NULL) {
+#ifndef COL_MEMORY_CONSTRAINED
+        if(__builtin_expect((node = _ctreenode_new(tree, key, NULL, parent)) != NULL, 1)) {
+#else
+        if((node = _ctreenode_new(tree, key, NULL, parent)) != NULL) {
+#endif
+            tree->size++;
+            tree->flags |= INSERTED;
+
+            if(parent == NULL)
+                _ctree_edges_attach(tree, node);
+        }
+
+        *entry = node;
+        return node;
+    }
+
+    if((cmp = _ctreenode_cmp(tree, node, key, prefix)) > 0) {
+        ctree_node* left = node->left;
+        node->left       = _ctreenode_entry(tree, node, left, key, prefix, entry);
+
+        if(left == NULL && node->left != NULL) {
+            _ctree_edges_attach(tree, node->left);
+#ifdef COL_CTREE_THREADED
+            _ctreenode_thread_before(node->left, node);
+#endif
+        }
+    } else if(cmp < 0) {
+        ctree_node* right = node->right;
+        node->right       = _ctreenode_entry(tree, node, right, key, prefix, entry);
+
+        if(right == NULL && node->right != NULL) {
+            _ctree_edges_attach(tree, node->right);
+#ifdef COL_CTREE_THREADED
+            _ctreenode_thread_after(node->right, node);
+#endif
+        }
+    } else {
+        *entry = node;
+    }
+
+    if(tree->flags & INSERTED) {
+        _ctreenode_update(node);
+        return _ctreenode_rebalance(node);
+    }
+
+    return node;
+}
+
+/*
+ * Climbs from the 'node' through the parent links only as far as needed
+ * for the subtree to cover the 'key', the key is then searched for by
+ * descending from the returned node.
+ * Costs O(log d) comparisons where 'd' is the in-order distance
+ * between the 'node' and the 'key'.
+ */
+static ctree_node*
+_ctreenode_climb(const ctree* tree, ctree_node* node, cconstptr_t key, ulong prefix)
+{
+    ctree_node* parent;
+    ctree_node* sub = node;
+    int         cmp = _ctreenode_cmp(tree, node, key, prefix);
+
+    if(cmp == 0)
+        return node;
+
+    // Only the parents on the side of the key bound the subtree, the
+    // lowest subtree whose bound lies past the key is the one to search
+    for(; (parent = node->parent) != NULL; node = parent) {
+        if((cmp < 0) == (parent->left == node)) {
+            int pcmp = _ctreenode_cmp(tree, parent, key, prefix);
+
+            if(pcmp == 0)
+                return parent;
+            if((pcmp < 0) != (cmp < 0))
+                break;
+
+            sub = parent;
+        }
+    }
+
+    return sub;
+}
+
+/*
+ * Rebalances the path from the 'node' up to the root through the parent
+ * links, stops as soon as the height of the subtree stays the same.
+ */
+static void
+_ctreenode_retrace(ctree* tree, ctree_node* node)
+{
+    ctree_node*  parent;
+    ctree_node** slot;
+    ctree_node*  sub;
+    uint         height;
+
+    for(; node != NULL; node = parent) {
+        parent = node->parent;
+        slot   = (parent == NULL) ? &tree->root : (parent->left == node) ? &parent->left : &parent->right;
+        height = node->height;
+
+        _ctreenode_update(node);
+        *slot = sub = _ctreenode_rebalance(node);
+
+        if(sub == node && node->height == height)
+            break;
+    }
+}
+
+/*
+ * 'CTREE_RB' and 'CTREE_WAVL' trees are rebalanced bottom-up through the
+ * parent links, insertion and removal stop as soon as the tree is valid
+ * again and do at most two (three for the red-black removal) rotations,
+ * instead of updating the whole path like the AVL recursion does.
+ *
+ * Red-black tree keeps the node color in the 'balance' field (new node
+ * is red), WAVL tree keeps the node rank in the 'height' field, rank
+ * difference between the node and its child is either 1 or 2 and the
+ * leaves have the rank 0.
+ */
+#define _CTREENODE_RED   0
+#define _CTREENODE_BLACK 1
+
+static inline bool
+_ctreenode_red(const ctree_node* node)
+{
+    return node != NULL && node->balance == _CTREENODE_RED;
+}
+
+/*
+ * Returns the link of the parent (or the tree root) pointing to the 'node'.
+ */
+static inline ctree_node**
+_ctreenode_slot(ctree* tree, const ctree_node* node)
+{
+    ctree_node* parent = node->parent;
+    return (parent == NULL) ? &tree->root : (parent->left == node) ? &parent->left : &parent->right;
+}
+
+/*
+ * Rotates the 'node' down to the left (or right), its right (or left)
+ * child takes its place in the tree.
+ */
+static void
+_ctreenode_rotate_down(ctree* tree, ctree_node* node, bool left)
+{
+    ctree_node** slot = _ctreenode_slot(tree, node);
+    *slot             = left ? _ctreenode_pivot_left(node) : _ctreenode_pivot_right(node);
+}
+
+#ifndef COL_CTREE_SPLAY_DEPTH
+/*
+ * Depth up to which the nodes of the 'CTREE_SPLAY' tree are left in place
+ * on access, hot keys already near the root don't push each other around.
+ */
+#define COL_CTREE_SPLAY_DEPTH 4
+#endif
+
+/*
+ * Splays the accessed 'node' of the 'CTREE_SPLAY' tree up until it is
+ * no deeper than 'COL_CTREE_SPLAY_DEPTH' (semi-splaying). Zig-zig step
+ * rotates the grandparent first so the whole access path roughly halves
+ * in depth, which keeps the accesses amortized O(log n).
+ */
+static void
+_ctree_splay(ctree* tree, ctree_node* node)
+{
+    ctree_node* parent;
+    ctree_node* grand;
+    uint        depth = 0;
+
+    for(parent = node->parent; parent != NULL; parent = parent->parent)
+        depth++;
+
+    while(depth > COL_CTREE_SPLAY_DEPTH) {
+        parent = node->parent;
+        grand  = parent->parent;
+
+        if(grand == NULL) {
+            _ctreenode_rotate_down(tree, parent, parent->right == node);
+            depth--;
+        } else if((grand->left == parent) == (parent->left == node)) {
+            _ctreenode_rotate_down(tree, grand, grand->right == parent);
+            _ctreenode_rotate_down(tree, parent, parent->right == node);
+            depth -= 2;
+        } else {
+            _ctreenode_rotate_down(tree, parent, parent->right == node);
+            _ctreenode_rotate_down(tree, grand, grand->right == node);
+            depth -= 2;
+        }
+    }
+}
+
+/*
+ * Descends from the subtree rooted at 'node' (NULL if the tree is empty)
+ * to the 'key' without rebalancing, if the key is not found it is
+ * attached as the new leaf with the NULL value.
+ * Returns the node holding the key, NULL if it could not be inserted.
+ */
+static ctree_node*
+_ctreenode_attach(ctree* tree, ctree_node* node, cptr_t key, ulong prefix, bool* inserted)
+{
+    ctree_node*  parent = (node != NULL) ? node->parent : NULL;
+    ctree_node** slot   = (node != NULL) ? _ctreenode_slot(tree, node) : &tree->root;
+    int          cmp;
+
+    *inserted = false;
+
+    while(node != NULL) {
+        if((cmp = _ctreenode_cmp(tree, node, key, prefix)) == 0)
+            return node;
+
+        parent = node;
+        slot   = (cmp > 0) ? &node->left : &node->right;
+        node   = *slot;
+    }
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect((node = _ctreenode_new(tree, key, NULL, parent)) == NULL, 0))
+#else
+    if((node = _ctreenode_new(tree, key, NULL, parent)) == NULL)
+#endif
+        return NULL;
+
+    *slot     = node;
+    *inserted = true;
+    tree->size++;
+
+    _ctree_edges_attach(tree, node);
+
+#ifdef COL_CTREE_THREADED
+    if(parent != NULL && parent->left == node)
+        _ctreenode_thread_before(node, parent);
+    else if(parent != NULL)
+        _ctreenode_thread_after(node, parent);
+#endif
+
+    return node;
+}
+
+/*
+ * Restores the red-black tree invariants after the red 'node' got attached.
+ */
+static void
+_ctree_rb_insert_fixup(ctree* tree, ctree_node* node)
+{
+    ctree_node* parent;
+    ctree_node* grand;
+    ctree_node* uncle;
+    bool        left;
+
+    // Red parent is never the root
+    while(_ctreenode_red(parent = node->parent)) {
+        grand = parent->parent;
+        left  = grand->left == parent;
+        uncle = left ? grand->right : grand->left;
+
+        if(_ctreenode_red(uncle)) {
+            parent->balance = _CTREENODE_BLACK;
+            uncle->balance  = _CTREENODE_BLACK;
+            grand->balance  = _CTREENODE_RED;
+            node            = grand;
+            continue;
+        }
+
+        // Inner grandchild gets rotated to the outside first
+        if((parent->left == node) != left) {
+            _ctreenode_rotate_down(tree, parent, left);
+            parent = node;
+        }
+
+        parent->balance = _CTREENODE_BLACK;
+        grand->balance  = _CTREENODE_RED;
+        _ctreenode_rotate_down(tree, grand, !left);
+        break;
+    }
+
+    tree->root->balance = _CTREENODE_BLACK;
+}
+
+/*
+ * Restores the red-black tree invariants after the black node got removed
+ * from the position now held by the 'node' (possibly NULL) under the 'parent'.
+ */
+static void
+_ctree_rb_remove_fixup(ctree* tree, ctree_node* node, ctree_node* parent)
+{
+    ctree_node* sibling;
+    bool        left;
+
+    // Path through the 'node' is one black node short, removed black node
+    // had the sibling subtree of the black height at least one
+    while(parent != NULL && !_ctreenode_red(node)) {
+        left    = parent->left == node;
+        sibling = left ? parent->right : parent->left;
+
+        if(_ctreenode_red(sibling)) {
+            sibling->balance = _CTREENODE_BLACK;
+            parent->balance  = _CTREENODE_RED;
+            _ctreenode_rotate_down(tree, parent, left);
+            sibling = left ? parent->right : parent->left;
+        }
+
+        if(!_ctreenode_red(sibling->left) && !_ctreenode_red(sibling->right)) {
+            sibling->balance = _CTREENODE_RED;
+            node             = parent;
+            parent           = node->parent;
+            continue;
+        }
+
+        if(!_ctreenode_red(left ? sibling->right : sibling->left)) {
+            (left ? sibling->left : sibling->right)->balance = _CTREENODE_BLACK;
+            sibling->balance                                 = _CTREENODE_RED;
+            _ctreenode_rotate_down(tree, sibling, !left);
+            sibling = left ? parent->right : parent->left;
+        }
+
+        sibling->balance                                 = parent->balance;
+        parent->balance                                  = _CTREENODE_BLACK;
+        (left ? sibling->right : sibling->left)->balance = _CTREENODE_BLACK;
+        _ctreenode_rotate_down(tree, parent, left);
+        return;
+    }
+
+    if(node != NULL)
+        node->balance = _CTREENODE_BLACK;
+}
+
+/*
+ * Restores the WAVL rank rule after the leaf 'node' got attached.
+ */
+static void
+_ctree_wavl_insert_fixup(ctree* tree, ctree_node* node)
+{
+    ctree_node* parent;
+    ctree_node* inner;
+    bool        left;
+
+    // Node is the 0-child, parent gets promoted while its other child is the 1-child
+    while((parent = node->parent) != NULL && parent->height == node->height) {
+        left = parent->left == node;
+
+        if((int) parent->height - _ctreenode_height(left ? parent->right : parent->left) == 1) {
+            parent->height++;
+            node = parent;
+            continue;
+        }
+
+        inner = left ? node->right : node->left;
+
+        if(inner == NULL || node->height - inner->height == 2) {
+            _ctreenode_rotate_down(tree, parent, !left);
+            parent->height--;
+        } else {
+            _ctreenode_rotate_down(tree, node, left);
+            _ctreenode_rotate_down(tree, parent, !left);
+            inner->height++;
+            node->height--;
+            parent->height--;
+        }
+        break;
+    }
+}
+
+/*
+ * Restores the WAVL rank rule after the node got removed from the
+ * position now held by the 'node' (possibly NULL) under the 'parent'.
+ */
+static void
+_ctree_wavl_remove_fixup(ctree* tree, ctree_node* node, ctree_node* parent)
+{
+    ctree_node* sibling;
+    ctree_node* inner;
+    bool        left;
+
+    // Parent left without children is the leaf of the rank 1 (2,2-leaf)
+    if(parent != NULL && parent->left == NULL && parent->right == NULL) {
+        parent->height = 0;
+        node           = parent;
+        parent         = node->parent;
+    }
+
+    // Node is the 3-child, parent gets demoted while that is enough
+    while(parent != NULL && (int) parent->height - _ctreenode_height(node) == 3) {
+        left    = parent->left == node;
+        sibling = left ? parent->right : parent->left;
+
+        if(parent->height - sibling->height == 2) {
+            parent->height--;
+            node   = parent;
+            parent = node->parent;
+            continue;
+        }
+
+        if(_ctreenode_height(sibling->left) + 2 == (int) sibling->height
+           && _ctreenode_height(sibling->right) + 2 == (int) sibling->height) {
+            parent->height--;
+            sibling->height--;
+            node   = parent;
+            parent = node->parent;
+            continue;
+        }
+
+        inner = left ? sibling->left : sibling->right;
+
+        if(_ctreenode_height(left ? sibling->right : sibling->left) + 1 == (int) sibling->height) {
+            _ctreenode_rotate_down(tree, parent, left);
+            sibling->height++;
+            parent->height -= (parent->left == NULL && parent->right == NULL) ? 2 : 1;
+        } else {
+            _ctreenode_rotate_down(tree, sibling, !left);
+            _ctreenode_rotate_down(tree, parent, left);
+            inner->height += 2;
+            sibling->height--;
+            parent->height -= 2;
+        }
+        break;
+    }
+}
+
+/*
+ * Unlinks the 'node' from the tree, node with two children is replaced by
+ * its in-order successor which takes over its links and balance fields.
+ * Stores the node now holding the vacated position (possibly NULL) into
+ * 'child' and its parent into 'parent'.
+ * Returns the balance field the vacated position had.
+ */
+static int
+_ctreenode_unlink(ctree* tree, ctree_node* node, ctree_node** child, ctree_node** parent)
+{
+    ctree_node*  succ = node->right;
+    ctree_node** slot = _ctreenode_slot(tree, node);
+    int          balance;
+
+    if(node->left == NULL || node->right == NULL) {
+        *child  = (node->left != NULL) ? node->left : node->right;
+        *parent = node->parent;
+        *slot   = *child;
+
+        if(*child != NULL)
+            (*child)->parent = *parent;
+
+        return node->balance;
+    }
+
+    while(succ->left != NULL)
+        succ = succ->left;
+
+    balance = succ->balance;
+    *child  = succ->right;
+
+    if(succ->parent == node) {
+        *parent = succ;
+    } else {
+        *parent         = succ->parent;
+        (*parent)->left = *child;
+
+        if(*child != NULL)
+            (*child)->parent = *parent;
+
+        succ->right         = node->right;
+        node->right->parent = succ;
+    }
+
+    succ->left         = node->left;
+    node->left->parent = succ;
+    succ->parent       = node->parent;
+    succ->height       = node->height;
+    succ->balance      = node->balance;
+    *slot              = succ;
+
+    return balance;
+}
+
+/*
+ * Unlinks the 'node' from the tree through the parent links (without
+ * searching for its key) and rebalances the tree bottom-up according
+ * to its policy. Key/value and the node itself are left to the caller.
+ */
+static void
+_ctree_unlink_node(ctree* tree, ctree_node* node)
+{
+    ctree_node* child;
+    ctree_node* parent;
+
+    _ctree_edges_detach(tree, node);
+
+    int balance = _ctreenode_unlink(tree, node, &child, &parent);
+
+    if(tree->policy == CTREE_WAVL)
+        _ctree_wavl_remove_fixup(tree, child, parent);
+    else if(tree->policy == CTREE_RB && balance == _CTREENODE_BLACK)
+        _ctree_rb_remove_fixup(tree, child, parent);
+    else if(tree->policy == CTREE_AVL)
+        _ctreenode_retrace(tree, parent);
+    else if(tree->policy == CTREE_SPLAY && parent != NULL)
+        _ctree_splay(tree, parent);
+
+#ifdef COL_CTREE_THREADED
+    _ctreenode_unthread(node);
+#endif
+
+    if(tree->finger == node)
+        tree->finger = NULL;
+
+    tree->size--;
+}
+
+/*
+ * Removes the key from the 'CTREE_RB', 'CTREE_WAVL' or 'CTREE_SPLAY' tree.
+ * Returns true if the key was found.
+ */
+static bool
+_ctree_policy_remove(ctree* tree, cptr_t key, ulong prefix)
+{
+    ctree_node* node = tree->root;
+    ctree_node* last = NULL;
+    int         cmp;
+
+    while(node != NULL && (cmp = _ctreenode_cmp(tree, node, key, prefix)) != 0) {
+        last = node;
+        node = (cmp > 0) ? node->left : node->right;
+    }
+
+    if(node == NULL) {
+        // Missed path is paid for the same as the found one
+        if(tree->policy == CTREE_SPLAY && last != NULL)
+            _ctree_splay(tree, last);
+
+        return false;
+    }
+
+    _ctree_unlink_node(tree, node);
+    _ctreenode_destroy(tree, node);
+
+    return true;
+}
+
+/*
+ * Finds or inserts (with the NULL value) the key descending from the
+ * subtree found by climbing from the 'hint' (root if NULL), path above
+ * the subtree is then retraced bottom-up.
+ * Returns the node holding the key, NULL if it could not be inserted.
+ */
+static ctree_node*
+_ctree_entry_at(ctree* tree, ctree_node* hint, cptr_t key, bool* inserted)
+{
+    ulong        prefix = _ctree_prefix(tree, key);
+    ctree_node*  entry  = NULL;
+    ctree_node*  sub    = (hint != NULL) ? _ctreenode_climb(tree, hint, key, prefix) : tree->root;
+    ctree_node*  parent = (sub != NULL) ? sub->parent : NULL;
+    ctree_node** slot   = (parent == NULL) ? &tree->root : (parent->left == sub) ? &parent->left : &parent->right;
+
+    if(tree->policy == CTREE_RB) {
+        if((entry = _ctreenode_attach(tree, sub, key, prefix, inserted)) != NULL && *inserted)
+            _ctree_rb_insert_fixup(tree, entry);
+    } else if(tree->policy == CTREE_WAVL) {
+        if((entry = _ctreenode_attach(tree, sub, key, prefix, inserted)) != NULL && *inserted)
+            _ctree_wavl_insert_fixup(tree, entry);
+    } else if(tree->policy == CTREE_SPLAY) {
+        if((entry = _ctreenode_attach(tree, sub, key, prefix, inserted)) != NULL)
+            _ctree_splay(tree, entry);
+    } else {
+        *slot     = _ctreenode_entry(tree, parent, sub, key, prefix, &entry);
+        *inserted = (tree->flags & INSERTED) != 0;
+
+        if(*inserted) {
+            tree->flags &= ~(COL_BYTE | INSERTED);
+            _ctreenode_retrace(tree, parent);
+        }
+    }
+
+    if(entry != NULL && (tree->mode & CTREE_FINGER))
+        tree->finger = entry;
+
+    return entry;
+}
+
+/*
+ * Same as '_ctree_entry_at' except the 'value' is stored into the node,
+ * value of the existing key gets freed.
+ */
+static ctree_node*
+_ctree_insert_at(ctree* tree, ctree_node* hint, cptr_t key, cptr_t value, bool* inserted)
+{
+    ctree_node* entry = _ctree_entry_at(tree, hint, key, inserted);
+
+    if(entry != NULL) {
+        if(!*inserted && tree->free_value_fn)
+            tree->free_value_fn(entry->value);
+
+        _ctreenode_put_value(tree, entry, value);
+    }
+
+    return entry;
+}
+
+/*
+ * Recursively searches for the key, if the key is found
+ * remove it, check if the 'CFreeKeyFn' is present, if
+ * it is call the function on the key, freeing it.
+ * If the 'CFreeValueFn' is present call it on the value,
+ * freeing it.
+ * If either one or both of the functions are not present,
+ * then the user is responsible for freeing the value and/or key.
+ *
+ * Node with two children is not overwritten with the contents of its
+ * in-order neighbour, instead the neighbour gets detached from the
+ * taller subtree and relinked in place of the removed node.
+ * This way nodes (and their parent/thread links) always keep the
+ * key/value pair they were created with.
+ */
+static ctree_node*
+_ctreenode_remove(ctree* tree, ctree_node* node, cptr_t key, ulong prefix, bool return_ele)
+{
+    if(node == NULL)
+        return NULL;
+
+    int cmp = _ctreenode_cmp(tree, node, key, prefix);
+
+    if(cmp > 0) {
+        node->left = _ctreenode_remove(tree, node->left, key, prefix, return_ele);
+    } else if(cmp < 0) {
+        node->right = _ctreenode_remove(tree, node->right, key, prefix, return_ele);
+    } else {
+        ctree_node* temp;
+
+        _ctree_edges_detach(tree, node);
+
+        if(node->right == NULL || node->left == NULL) {
+            temp = (node->right != NULL) ? node->right : node->left;
+
+            if(temp != NULL)
+                temp->parent = node->parent;
+        } else {
+            ctree_node* left  = node->left;
+            ctree_node* right = node->right;
+
+            if(left->height > right->height)
+                left = _ctreenode_detach_max(left, &temp);
+            else
+                right = _ctreenode_detach_min(right, &temp);
+
+            temp->left   = left;
+            temp->right  = right;
+            temp->parent = node->parent;
+
+            if(left != NULL)
+                left->parent = temp;
+            if(right != NULL)
+                right->parent = temp;
+
+            _ctreenode_update(temp);
+            temp = _ctreenode_rebalance(temp);
+        }
+
+#ifdef COL_CTREE_THREADED
+        _ctreenode_unthread(node);
+#endif
+
+        _ctreenode_destroy(tree, node);
+
+        tree->size--;
+        tree->flags |= REMOVED;
+
+        return temp;
+    }
+
+    // During traceback only update if we removed the node
+    if(tree->flags & REMOVED) {
+        _ctreenode_update(node);
+        return _ctreenode_rebalance(node);
+    }
+
+    return node;
+}
+
+/*
+ * Internal function, tries to find the key in tree.
+ * Returns NULL if key was not found or the pointer
+ * to the key if it was found.
+ * In 'CTREE_FINGER' mode search starts from the finger,
+ * found node of the 'CTREE_SPLAY' tree is splayed.
+ * Lookup cache (if enabled) is checked first.
+ */
+cptr_t
+_ctreenode_find(ctree* tree, cptr_t key)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    int         cmp;
+    ulong       prefix  = _ctree_prefix(tree, key);
+    ulong       hash    = 0;
+    ctree_node* current = _ctree_root(tree);
+    ctree_node* last    = NULL;
+
+    if(tree->cache != NULL) {
+        hash = tree->cache->hash_fn(key);
+
+        if((current = _ctree_cache_get(tree, key, prefix, hash)) != NULL)
+            return current;
+
+        current = tree->root;
+    }
+
+    if(tree->finger != NULL)
+        current = _ctreenode_climb(tree, tree->finger, key, prefix);
+
+    while(current != NULL) {
+        if((cmp = _ctreenode_cmp(tree, current, key, prefix)) == 0) {
+            if(tree->cache != NULL)
+                _ctree_cache_put(tree->cache, hash, current);
+
+            if(tree->policy == CTREE_SPLAY)
+                _ctree_splay(tree, current);
+
+            return current;
+        }
+
+        last    = current;
+        current = (cmp > 0) ? current->left : current->right;
+    }
+
+    // Splaying the would-be parent keeps the repeated misses amortized O(log n)
+    if(tree->policy == CTREE_SPLAY && last != NULL)
+        _ctree_splay(tree, last);
+
+    return NULL;
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                        COPY-ON-WRITE OPERATIONS                          */
+/****************************************************************************/
+
+/*
+ * Both 'CTREE_CONCURRENT' and 'CTREE_PERSISTENT' trees never mutate
+ * the nodes some other version of the tree (or the reader) can see.
+ *
+ * Writer descends from the root taking over the nodes on its path
+ * ('_ctreenode_cow_own'), each node is either mutated in place if nobody
+ * else can see it or copied, all the nodes off the path are shared
+ * between the old and the new version.
+ *
+ * Every node pointer the writer passes down (the "slot") is a reference
+ * to the node, functions below take over that reference and return the
+ * reference that should be stored back into the slot.
+ */
+
+/*
+ * Takes a reference on the 'node' of the 'CTREE_PERSISTENT' tree.
+ */
+static inline void
+_ctreenode_acquire(const ctree* tree, ctree_node* node)
+{
+    if((tree->mode & CTREE_PERSISTENT) && node != NULL)
+        atomic_fetch_add_explicit(&_CTREENODE_PHDR(node)->refs, 1, memory_order_relaxed);
+}
+
+/*
+ * Drops the reference on the 'node' of the 'CTREE_PERSISTENT' tree,
+ * once the last version referencing the node is gone, node is freed
+ * together with its payload and its children lose the reference.
+ */
+static void
+_ctreenode_release(const ctree* tree, ctree_node* node)
+{
+    if(!(tree->mode & CTREE_PERSISTENT) || node == NULL
+       || atomic_fetch_sub_explicit(&_CTREENODE_PHDR(node)->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    _ctree_payload_release(tree, _CTREENODE_PHDR(node)->payload, 1);
+    _ctreenode_release(tree, node->left);
+    _ctreenode_release(tree, node->right);
+    _ctreenode_free(tree, node);
+}
+
+/*
+ * Takes over the reference on the 'node' and returns the node the writer
+ * is allowed to mutate in its place.
+ *
+ * Node is returned as is if it was created by the current writer operation
+ * ('CTREE_CONCURRENT') or if the reference is the only one ('CTREE_PERSISTENT'),
+ * otherwise it is copied.
+ * Returns NULL if the copy could not be allocated, 'node' is left untouched.
+ * Nodes of the copy-on-write trees don't maintain 'parent' links.
+ */
+static ctree_node*
+_ctreenode_cow_own(ctree* tree, ctree_node* node)
+{
+    if(tree->mode & CTREE_PERSISTENT) {
+        if(atomic_load_explicit(&_CTREENODE_PHDR(node)->refs, memory_order_acquire) == 1)
+            return node;
+    } else if(_CTREENODE_HDR(node)->stamp == tree->sync->stamp)
+        return node;
+
+    ctree_node* copy = _ctreenode_alloc(tree);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(copy == NULL, 0)) {
+#else
+    if(copy == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    memcpy(copy, node, sizeof(ctree_node));
+
+    if(tree->mode & CTREE_PERSISTENT) {
+        _ctree_payload* payload = _CTREENODE_PHDR(node)->payload;
+
+        atomic_fetch_add_explicit(&payload->refs, 1, memory_order_relaxed);
+        _CTREENODE_PHDR(copy)->payload = payload;
+
+        _ctreenode_acquire(tree, copy->left);
+        _ctreenode_acquire(tree, copy->right);
+        _ctreenode_release(tree, node);
+    } else
+        _ctree_retire(tree, node, RETIRED_NODE);
+
+    return copy;
+}
+
+/*
+ * Stores the new 'value' (and the 'key' if 'replace') into the owned 'node',
+ * previous ones are retired ('CTREE_CONCURRENT') or released together with
+ * the last version referencing them ('CTREE_PERSISTENT').
+ * Returns false if the new payload could not be allocated.
+ */
+static bool
+_ctreenode_cow_assign(ctree* tree, ctree_node* node, cptr_t key, cptr_t value, bool replace)
+{
+    if(tree->mode & CTREE_PERSISTENT) {
+        _ctree_payload*    payload = _CTREENODE_PHDR(node)->payload;
+        unsigned long long refs    = atomic_load_explicit(&payload->refs, memory_order_acquire);
+
+        if(refs == 1 || (!replace && (refs & _CTREE_PAYLOAD_REFS) == 1)) {
+            if(tree->free_value_fn)
+                tree->free_value_fn(payload->value);
+
+            payload->value = value;
+
+            if(replace) {
+                if(payload->key_src != NULL)
+                    _ctree_payload_release(tree, payload->key_src, _CTREE_PAYLOAD_BORROW);
+                else if(tree->free_key_fn)
+                    tree->free_key_fn(payload->key);
+
+                payload->key     = key;
+                payload->key_src = NULL;
+            }
+        } else {
+            _ctree_payload* key_src = NULL;
+
+            if(!replace) {
+                key = payload->key;
+                // Borrow from the payload that owns the key
+                key_src = (payload->key_src != NULL) ? payload->key_src : payload;
+            }
+
+            _ctree_payload* fresh = _ctree_payload_new(key, value, key_src);
+
+            if(fresh == NULL)
+                return false;
+
+            _ctree_payload_release(tree, payload, 1);
+            _CTREENODE_PHDR(node)->payload = fresh;
+        }
+    } else {
+        _ctree_retire(tree, node->value, RETIRED_VALUE);
+
+        if(replace)
+            _ctree_retire(tree, node->key, RETIRED_KEY);
+    }
+
+    node->value  = value;
+    tree->flags |= UPDATED;
+
+    if(replace) {
+        tree->flags |= REPLACED;
+        node->key = key;
+    }
+
+    return true;
+}
+
+/*
+ * Frees the owned 'node' that got removed from the tree, its children
+ * were already moved to the other nodes.
+ * Key and value are retired ('CTREE_CONCURRENT') or released together with
+ * the last version referencing them ('CTREE_PERSISTENT').
+ */
+static void
+_ctreenode_cow_destroy(ctree* tree, ctree_node* node)
+{
+    if(tree->mode & CTREE_PERSISTENT) {
+        _ctree_payload_release(tree, _CTREENODE_PHDR(node)->payload, 1);
+    } else {
+        _ctree_retire(tree, node->key, RETIRED_KEY);
+        _ctree_retire(tree, node->value, RETIRED_VALUE);
+    }
+
+    // Owned node was never visible to anyone else
+    _ctreenode_free(tree, node);
+}
+
+/*
+ * Rotations of the owned nodes, same as '_ctreenode_rotate_right'
+ * and '_ctreenode_rotate_left' except they don't touch the parent links
+ * (subtree moved by the rotation is shared with the other versions).
+ */
+static ctree_node*
+_ctreenode_cow_rotate_right(ctree_node* node)
+{
+    ctree_node* new_root = node->left;
+    node->left           = new_root->right;
+    new_root->right      = node;
+    _ctreenode_update(node);
+    _ctreenode_update(new_root);
+    return new_root;
+}
+
+static ctree_node*
+_ctreenode_cow_rotate_left(ctree_node* node)
+{
+    ctree_node* new_root = node->right;
+    node->right          = new_root->left;
+    new_root->left       = node;
+    _ctreenode_update(node);
+    _ctreenode_update(new_root);
+    return new_root;
+}
+
+/*
+ * Updates and rebalances the owned 'node', children that take part in
+ * the rotations are owned first.
+ * If owning fails the subtree is returned unbalanced but still valid.
+ */
+static ctree_node*
+_ctreenode_cow_rebalance(ctree* tree, ctree_node* node)
+{
+    ctree_node* child;
+    ctree_node* grandchild;
+
+    _ctreenode_update(node);
+
+    if(node->balance < -1) {
+        if((child = _ctreenode_cow_own(tree, node->left)) == NULL)
+            return node;
+
+        node->left = child;
+
+        if(child->balance > 0) {
+            if((grandchild = _ctreenode_cow_own(tree, child->right)) == NULL)
+                return node;
+
+            child->right = grandchild;
+            node->left   = _ctreenode_cow_rotate_left(child);
+        }
+
+        return _ctreenode_cow_rotate_right(node);
+    } else if(node->balance > 1) {
+        if((child = _ctreenode_cow_own(tree, node->right)) == NULL)
+            return node;
+
+        node->right = child;
+
+        if(child->balance < 0) {
+            if((grandchild = _ctreenode_cow_own(tree, child->left)) == NULL)
+                return node;
+
+            child->left = grandchild;
+            node->right = _ctreenode_cow_rotate_right(child);
+        }
+
+        return _ctreenode_cow_rotate_left(node);
+    }
+
+    return node;
+}
+
+/*
+ * Copy-on-write version of '_ctreenode_insert'.
+ * If the writer runs out of memory half way through the tree stays
+ * valid (and unchanged), but the copies made so far are kept.
+ */
+static ctree_node*
+_ctreenode_cow_insert(ctree* tree, ctree_node* node, cptr_t key, ulong prefix, cptr_t value, bool replace)
+{
+    ctree_node* owned;
+    int         cmp;
+
+    if(node == NULL) {
+        if((node = _ctreenode_new(tree, key, value, NULL)) != NULL)
+            tree->flags |= INSERTED;
+
+        return node;
+    }
+
+    if((owned = _ctreenode_cow_own(tree, node)) == NULL)
+        return node;
+
+    if((cmp = _ctreenode_cmp(tree, owned, key, prefix)) > 0)
+        owned->left = _ctreenode_cow_insert(tree, owned->left, key, prefix, value, replace);
+    else if(cmp < 0)
+        owned->right = _ctreenode_cow_insert(tree, owned->right, key, prefix, value, replace);
+    else
+        _ctreenode_cow_assign(tree, owned, key, value, replace);
+
+    if(tree->flags & INSERTED)
+        return _ctreenode_cow_rebalance(tree, owned);
+
+    return owned;
+}
+
+/*
+ * Copy-on-write version of '_ctreenode_detach_min'.
+ * 'min' is set to NULL if the writer ran out of memory.
+ */
+static ctree_node*
+_ctreenode_cow_detach_min(ctree* tree, ctree_node* node, ctree_node** min)
+{
+    ctree_node* owned;
+
+    if((owned = _ctreenode_cow_own(tree, node)) == NULL) {
+        *min = NULL;
+        return node;
+    }
+
+    if(owned->left == NULL) {
+        ctree_node* right = owned->right;
+        owned->right      = NULL;
+        *min              = owned;
+        return right;
+    }
+
+    owned->left = _ctreenode_cow_detach_min(tree, owned->left, min);
+
+    return _ctreenode_cow_rebalance(tree, owned);
+}
+
+/*
+ * Copy-on-write version of '_ctreenode_remove'.
+ */
+static ctree_node*
+_ctreenode_cow_remove(ctree* tree, ctree_node* node, cptr_t key, ulong prefix)
+{
+    ctree_node* owned;
+    int         cmp;
+
+    if(node == NULL)
+        return NULL;
+
+    if((owned = _ctreenode_cow_own(tree, node)) == NULL)
+        return node;
+
+    if((cmp = _ctreenode_cmp(tree, owned, key, prefix)) > 0) {
+        owned->left = _ctreenode_cow_remove(tree, owned->left, key, prefix);
+    } else if(cmp < 0) {
+        owned->right = _ctreenode_cow_remove(tree, owned->right, key, prefix);
+    } else {
+        ctree_node* child;
+
+        if(owned->left == NULL || owned->right == NULL) {
+            child = (owned->right != NULL) ? owned->right : owned->left;
+        } else {
+            ctree_node* min;
+            ctree_node* right = _ctreenode_cow_detach_min(tree, owned->right, &min);
+
+            if(min == NULL) {
+                owned->right = right;
+                return owned;
+            }
+
+            min->left  = owned->left;
+            min->right = right;
+            child      = _ctreenode_cow_rebalance(tree, min);
+        }
+
+        _ctreenode_cow_destroy(tree, owned);
+        tree->flags |= REMOVED;
+
+        return child;
+    }
+
+    if(tree->flags & REMOVED)
+        return _ctreenode_cow_rebalance(tree, owned);
+
+    return owned;
+}
+
+/*
+ * Finds the next node in order inside of the copy-on-write tree
+ * version rooted at 'root'.
+ * There are no parent links so the successor is found by descending
+ * from the root towards the 'node'.
+ */
+static ctree_node*
+_ctreenode_cow_next(const ctree* tree, const ctree_node* root, const ctree_node* node)
+{
+    ctree_node* succ = NULL;
+
+    if(node->right != NULL) {
+        for(succ = node->right; succ->left != NULL; succ = succ->left)
+            ;
+        return succ;
+    }
+
+    while(root != NULL && root != node) {
+        if(_ctreenode_cmp(tree, root, node->key, _CTREENODE_PREFIX(node)) > 0) {
+            succ = (ctree_node*) root;
+            root = root->left;
+        } else
+            root = root->right;
+    }
+
+    return succ;
+}
+
+/*
+ * Finds the previous node in order inside of the copy-on-write
+ * tree version rooted at 'root'.
+ */
+static ctree_node*
+_ctreenode_cow_prev(const ctree* tree, const ctree_node* root, const ctree_node* node)
+{
+    ctree_node* pred = NULL;
+
+    if(node->left != NULL) {
+        for(pred = node->left; pred->right != NULL; pred = pred->right)
+            ;
+        return pred;
+    }
+
+    while(root != NULL && root != node) {
+        if(_ctreenode_cmp(tree, root, node->key, _CTREENODE_PREFIX(node)) < 0) {
+            pred = (ctree_node*) root;
+            root = root->right;
+        } else
+            root = root->left;
+    }
+
+    return pred;
+}
+
+/*
+ * Publishes the new 'root' and 'size' of the copy-on-write tree.
+ */
+static void
+_ctree_cow_publish(ctree* tree, ctree_node* root, uint size)
+{
+    if(tree->mode & CTREE_CONCURRENT) {
+        _ctree_sync_end(tree, root, size);
+    } else {
+        tree->root = root;
+        tree->size = size;
+    }
+}
+
+/*
+ * Insertion into the copy-on-write tree.
+ * Returns the flags the operation set.
+ */
+static byte
+_ctree_cow_insert(ctree* tree, cptr_t key, cptr_t value, bool replace)
+{
+    byte flags;
+
+    if(tree->mode & _CTREE_SNAPSHOT) {
+        COL_ERROR("ctree snapshot is read only");
+        return COL_BYTE;
+    }
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_sync_begin(tree);
+
+    ctree_node* root = _ctreenode_cow_insert(tree, tree->root, key, _ctree_prefix(tree, key), value, replace);
+
+    flags       = tree->flags;
+    tree->flags = COL_BYTE;
+
+    _ctree_cow_publish(tree, root, tree->size + ((flags & INSERTED) ? 1 : 0));
+
+    return flags;
+}
+
+/*
+ * Removal from the copy-on-write tree.
+ * Returns true if the key was removed.
+ */
+static bool
+_ctree_cow_remove(ctree* tree, cptr_t key)
+{
+    byte flags;
+
+    if(tree->mode & _CTREE_SNAPSHOT) {
+        COL_ERROR("ctree snapshot is read only");
+        return false;
+    }
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_sync_begin(tree);
+
+    ctree_node* root = tree->root;
+
+    // Don't copy the path if there is nothing to remove
+    if(_ctreenode_find(tree, key) != NULL)
+        root = _ctreenode_cow_remove(tree, root, key, _ctree_prefix(tree, key));
+
+    flags       = tree->flags;
+    tree->flags = COL_BYTE;
+
+    _ctree_cow_publish(tree, root, tree->size - ((flags & REMOVED) ? 1 : 0));
+
+    return flags & REMOVED;
+}
+
+/*
+ * Creates the immutable snapshot of the 'CTREE_PERSISTENT' tree in O(1),
+ * snapshot shares all the nodes with the 'tree'.
+ */
+ctree*
+ctree_snapshot(ctree* tree)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    if(!(tree->mode & CTREE_PERSISTENT)) {
+        COL_ERROR("only persistent ctree can be snapshotted");
+        return NULL;
+    }
+
+    ctree* snapshot = memc_malloc(ctree);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(snapshot == NULL, 0)) {
+#else
+    if(snapshot == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    *snapshot = *tree;
+    snapshot->mode |= _CTREE_SNAPSHOT;
+    _ctreenode_acquire(tree, tree->root);
+
+    return snapshot;
+}
+
+/*
+ * CTree recursive BST insertion function
+ * Returns false if no insertion occured,
+ * meaning either tree is NULL or the same key
+ * was already in the tree, and only the value got
+ * updated, but the key was not inserted.
+ *
+ * together with the value, returning true.
+ * If the key was not found then the key is inserted
+ */
+bool
+ctree_insert(ctree* tree, cptr_t key, cptr_t value)
+{
+    return_val_if_fail(tree != NULL, false);
+
+    if(tree->mode & _CTREE_COW)
+        return _ctree_cow_insert(tree, key, value, false) & INSERTED;
+
+    if((tree->mode & CTREE_FINGER) || tree->policy != CTREE_AVL) {
+        bool inserted;
+        return _ctree_insert_at(tree, tree->finger, key, value, &inserted) != NULL && inserted;
+    }
+
+    tree->root = _ctreenode_insert(tree, NULL, tree->root, key, _ctree_prefix(tree, key), value, false);
+
+    if(tree->flags & INSERTED) {
+        tree->flags &= ~(COL_BYTE | INSERTED);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Replaces the key in the tree with the provided key.
+ * Returns false if no insertion occured,
+ * meaning either tree is NULL or the key was not found.
+ * If the key was found then the value gets updated and
+ * old one gets freed if the 'CFreeValueFn' is present.
+ * Old key gets replaced with the new key and freed if the
+ * 'CFreeKeyFn' is present.
+ */
+bool
+ctree_replace(ctree* tree, cptr_t key, cptr_t value)
+{
+    return_val_if_fail(tree != NULL, false);
+
+    if(tree->mode & _CTREE_COW)
+        return _ctree_cow_insert(tree, key, value, true) & REPLACED;
+
+    if(tree->policy != CTREE_AVL) {
+        bool        inserted;
+        ctree_node* entry = _ctree_insert_at(tree, tree->finger, key, value, &inserted);
+
+        if(entry == NULL || inserted)
+            return false;
+
+        if(tree->free_key_fn)
+            tree->free_key_fn(entry->key);
+
+        _ctreenode_put_key(tree, entry, key);
+        return true;
+    }
+
+    tree->root = _ctreenode_insert(tree, NULL, tree->root, key, _ctree_prefix(tree, key), value, true);
+
+    if(tree->flags & REPLACED) {
+        tree->flags &= ~(COL_BYTE | REPLACED);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Removes the given key from the tree.
+ * If the key was found and removed it returns true.
+ * If no matching key was found and no removal occured
+ * returns false.
+ * Additionally if tree or key are invalid (NULL) it
+ * returns false.
+ */
+bool
+ctree_remove(ctree* tree, cptr_t key, bool return_ele)
+{
+    return_val_if_fail((tree != NULL && key != NULL), false);
+
+    if(tree->mode & _CTREE_COW)
+        return _ctree_cow_remove(tree, key);
+
+    ulong prefix = _ctree_prefix(tree, key);
+
+    if(tree->finger != NULL && _ctreenode_cmp(tree, tree->finger, key, prefix) == 0)
+        tree->finger = NULL;
+
+    if(tree->policy != CTREE_AVL)
+        return _ctree_policy_remove(tree, key, prefix);
+
+    tree->root = _ctreenode_remove(tree, tree->root, key, prefix, return_ele);
+
+    if(tree->flags & REMOVED) {
+        tree->flags &= ~(COL_BYTE | REMOVED);
+        return true;
+    } else
+        return false;
+}
+
+/*
+ * Returns the node holding the smallest key, NULL if the tree is empty.
+ * O(1) once cached, copy-on-write trees descend from the root.
+ *
+ * Same rules as for 'ctree_entry' apply for 'CTREE_CONCURRENT' tree.
+ */
+ctree_node*
+ctree_first(ctree* tree)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    if(tree->mode & _CTREE_COW) {
+        ctree_node* root = _ctree_root(tree);
+        return (root != NULL) ? _ctree_min(root) : NULL;
+    }
+
+    return _ctree_first(tree);
+}
+
+/*
+ * Returns the node holding the largest key, NULL if the tree is empty.
+ * O(1) once cached, copy-on-write trees descend from the root.
+ *
+ * Same rules as for 'ctree_entry' apply for 'CTREE_CONCURRENT' tree.
+ */
+ctree_node*
+ctree_last(ctree* tree)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    if(tree->mode & _CTREE_COW) {
+        ctree_node* root = _ctree_root(tree);
+        return (root != NULL) ? _ctree_max(root) : NULL;
+    }
+
+    return _ctree_last(tree);
+}
+
+/*
+ * Unlinks the cached smallest (or largest) node, handing its key/value
+ * over to the caller or freeing them.
+ */
+static bool
+_ctree_pop(ctree* tree, bool first, cptr_t* key, cptr_t* value)
+{
+    ctree_node* node;
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("ctree pop requires parent links");
+        return false;
+    }
+
+    if(_CTREE_INLINE(tree) && (key != NULL || value != NULL)) {
+        COL_ERROR("inline ctree can't hand over its pairs");
+        return false;
+    }
+
+    if((node = first ? _ctree_first(tree) : _ctree_last(tree)) == NULL)
+        return false;
+
+    _ctree_unlink_node(tree, node);
+
+    if(key != NULL)
+        *key = node->key;
+    else if(tree->free_key_fn)
+        tree->free_key_fn(node->key);
+
+    if(value != NULL)
+        *value = node->value;
+    else if(tree->free_value_fn)
+        tree->free_value_fn(node->value);
+
+    _ctreenode_free(tree, node);
+
+    return true;
+}
+
+/*
+ * Removes the smallest key from the tree without searching for it,
+ * the key/value are stored into 'key'/'value' and are no longer owned
+ * by the tree, if either is NULL it gets freed as in 'ctree_remove'.
+ * Returns false if the tree is empty.
+ */
+bool
+ctree_pop_first(ctree* tree, cptr_t* key, cptr_t* value)
+{
+    return_val_if_fail(tree != NULL, false);
+    return _ctree_pop(tree, true, key, value);
+}
+
+/*
+ * Removes the largest key from the tree without searching for it,
+ * same as 'ctree_pop_first' otherwise.
+ */
+bool
+ctree_pop_last(ctree* tree, cptr_t* key, cptr_t* value)
+{
+    return_val_if_fail(tree != NULL, false);
+    return _ctree_pop(tree, false, key, value);
+}
+
+/*
+ * Returns pointer to the value of the key/value pair.
+ * Returns NULL if key is not inside the tree.
+ *
+ * 'CTREE_CONCURRENT' tree is searched without locking, returned value
+ * is guaranteed to stay alive only if the caller is inside of the
+ * 'ctree_read_enter'/'ctree_read_exit' section.
+ */
+cptr_t
+ctree_entry(ctree* tree, cptr_t key)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    ctree_node* entry;
+    cptr_t      value = NULL;
+
+    if((tree->mode & CTREE_CONCURRENT) && !_ctree_read_enter())
+        return NULL;
+
+    if((entry = _ctreenode_find(tree, key)) != NULL)
+        value = entry->value;
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_read_exit();
+
+    return value;
+}
+
+/*
+ * Returns pointer to the key of the key/value pair.
+ * Returns NULL if key is not inside the tree.
+ *
+ * Same rules as for 'ctree_entry' apply for 'CTREE_CONCURRENT' tree.
+ */
+cptr_t
+ctree_key(ctree* tree, cptr_t key)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    ctree_node* entry;
+    cptr_t      found = NULL;
+
+    if((tree->mode & CTREE_CONCURRENT) && !_ctree_read_enter())
+        return NULL;
+
+    if((entry = _ctreenode_find(tree, key)) != NULL)
+        found = entry->key;
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_read_exit();
+
+    return found;
+}
+
+/*
+ * Same as 'ctree_entry' except the tree is never restructured, lookup of
+ * the 'CTREE_SPLAY' tree only reads the nodes so any number of readers
+ * can run it at once (as long as there is no writer). Search always
+ * starts from the root.
+ */
+cptr_t
+ctree_peek(const ctree* tree, cconstptr_t key)
+{
+    return_val_if_fail(tree != NULL, NULL);
+
+    int         cmp;
+    ulong       prefix = _ctree_prefix(tree, key);
+    ctree_node* node;
+    cptr_t      value = NULL;
+
+    if((tree->mode & CTREE_CONCURRENT) && !_ctree_read_enter())
+        return NULL;
+
+    node = _ctree_root(tree);
+
+    while(node != NULL && (cmp = _ctreenode_cmp(tree, node, key, prefix)) != 0)
+        node = (cmp > 0) ? node->left : node->right;
+
+    if(node != NULL)
+        value = node->value;
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_read_exit();
+
+    return value;
+}
+
+#ifndef COL_CTREE_LOOKUP_LANES
+/*
+ * Number of the descents 'ctree_entry_batch' keeps in flight,
+ * enough to cover the memory latency with the independent loads.
+ */
+#define COL_CTREE_LOOKUP_LANES 16
+#endif
+
+/*
+ * Descent of one of the batched keys, 'index' is the key's position
+ * in the batch, 'node' is the (prefetched) node to compare next.
+ */
+typedef struct {
+    size_t      index;
+    ulong       prefix;
+    ctree_node* node;
+} _ctree_lookup_lane;
+
+/*
+ * Starts the descent of the 'index' key of the batch into the 'lane',
+ * root is shared by all descents so it is already in the cache.
+ */
+static inline void
+_ctree_lookup_lane_start(const ctree* tree, ctree_node* root, cptr_t* keys, size_t index, _ctree_lookup_lane* lane)
+{
+    lane->index  = index;
+    lane->prefix = _ctree_prefix(tree, keys[index]);
+    lane->node   = root;
+}
+
+/*
+ * Looks up the 'n' keys, storing the value of each key into 'out_values'
+ * at the key's position (NULL if the key is not inside the tree).
+ *
+ * Up to 'COL_CTREE_LOOKUP_LANES' descents are interleaved, each step
+ * compares one node for every descent and prefetches the node it moves
+ * to, so the cache misses of different keys overlap instead of being
+ * paid one after another. Descent that is done is replaced with the
+ * next key of the batch right away.
+ * Returns the number of keys found.
+ *
+ * Same rules as for 'ctree_entry' apply for 'CTREE_CONCURRENT' tree.
+ * Descents always start from the root, even in 'CTREE_FINGER' mode.
+ */
+ulong
+ctree_entry_batch(ctree* tree, cptr_t* keys, size_t n, cptr_t* out_values)
+{
+    return_val_if_fail(tree != NULL && (keys != NULL || n == 0) && (out_values != NULL || n == 0), 0);
+
+    _ctree_lookup_lane lanes[COL_CTREE_LOOKUP_LANES];
+    ctree_node*        root;
+    ulong              found = 0;
+    size_t             next;
+    uint               active;
+    int                cmp;
+
+    if((tree->mode & CTREE_CONCURRENT) && !_ctree_read_enter())
+        return 0;
+
+    root = _ctree_root(tree);
+
+    for(active = 0, next = 0; active < COL_CTREE_LOOKUP_LANES && next < n; active++, next++)
+        _ctree_lookup_lane_start(tree, root, keys, next, &lanes[active]);
+
+    while(active > 0) {
+        for(uint i = 0; i < active;) {
+            _ctree_lookup_lane* lane = &lanes[i];
+            ctree_node*         node = lane->node;
+
+            if(node != NULL && (cmp = _ctreenode_cmp(tree, node, keys[lane->index], lane->prefix)) != 0) {
+                lane->node = node = (cmp > 0) ? node->left : node->right;
+
+                if(node != NULL) {
+                    __builtin_prefetch(node, 0, 1);
+                    i++;
+                    continue;
+                }
+            }
+
+            if(node != NULL)
+                found++;
+
+            out_values[lane->index] = (node != NULL) ? node->value : NULL;
+
+            // Lane is done, either refill it or shrink the active lanes
+            if(next < n) {
+                _ctree_lookup_lane_start(tree, root, keys, next++, lane);
+                i++;
+            } else
+                *lane = lanes[--active];
+        }
+    }
+
+    if(tree->mode & CTREE_CONCURRENT)
+        _ctree_read_exit();
+
+    return found;
+}
+
+/*
+ * Finds or inserts (with the NULL value) the 'key' in one descent.
+ * Returns the slot holding the value, 'inserted' tells if the key
+ * got inserted, NULL if the key could not be inserted.
+ */
+static cptr_t*
+_ctree_entry_slot(ctree* tree, cptr_t key, bool* inserted)
+{
+    ctree_node* entry;
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("ctree value slots require parent links");
+        return NULL;
+    }
+
+    if(_CTREE_INLINE(tree)) {
+        COL_ERROR("ctree value slots require pointer values");
+        return NULL;
+    }
+
+    entry = _ctree_entry_at(tree, tree->finger, key, inserted);
+
+    return (entry != NULL) ? &entry->value : NULL;
+}
+
+/*
+ * Returns the slot holding the value of the 'key', if the key is not
+ * inside the tree it is inserted together with the value made by
+ * 'make_value_fn' (NULL value if the function is not provided).
+ * Only one descent is made.
+ */
+cptr_t*
+ctree_entry_or_insert(ctree* tree, cptr_t key, CMakeValueFn make_value_fn, cptr_t ctx)
+{
+    return_val_if_fail(tree != NULL && key != NULL, NULL);
+
+    bool    inserted;
+    cptr_t* slot = _ctree_entry_slot(tree, key, &inserted);
+
+    if(slot != NULL && inserted && make_value_fn != NULL)
+        *slot = make_value_fn(key, ctx);
+
+    return slot;
+}
+
+/*
+ * Same as 'ctree_entry_or_insert' except the missing key gets
+ * inserted together with the 'value'.
+ */
+cptr_t*
+ctree_get_or_insert(ctree* tree, cptr_t key, cptr_t value)
+{
+    return_val_if_fail(tree != NULL && key != NULL, NULL);
+
+    bool    inserted;
+    cptr_t* slot = _ctree_entry_slot(tree, key, &inserted);
+
+    if(slot != NULL && inserted)
+        *slot = value;
+
+    return slot;
+}
+
+/*
+ * Stores the value returned by the 'update_fn' into the slot of the 'key'
+ * in one descent, function gets the current value (NULL if the key is
+ * not inside the tree and it gets inserted).
+ * Replaced value is freed if the function returned the different one.
+ */
+cptr_t*
+ctree_update_with(ctree* tree, cptr_t key, CUpdateValueFn update_fn, cptr_t ctx)
+{
+    return_val_if_fail(tree != NULL && key != NULL && update_fn != NULL, NULL);
+
+    bool    inserted;
+    cptr_t  value;
+    cptr_t* slot = _ctree_entry_slot(tree, key, &inserted);
+
+    if(slot == NULL)
+        return NULL;
+
+    value = update_fn(key, *slot, ctx);
+
+    if(!inserted && value != *slot && tree->free_value_fn)
+        tree->free_value_fn(*slot);
+
+    *slot = value;
+    return slot;
+}
+
+/*
+ * Inserts the key-value pair starting the search from the 'hint'.
+ * Returns the node holding the key.
+ */
+ctree_node*
+ctree_insert_hint(ctree* tree, ctree_node* hint, cptr_t key, cptr_t value)
+{
+    return_val_if_fail(tree != NULL && key != NULL, NULL);
+
+    bool inserted;
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("ctree hints require parent links");
+        return NULL;
+    }
+
+    return _ctree_insert_at(tree, hint, key, value, &inserted);
+}
+
+/*
+ * Searches for the key starting from the 'hint'.
+ * Returns the node holding the key, NULL if not found.
+ */
+ctree_node*
+ctree_find_hint(ctree* tree, ctree_node* hint, cconstptr_t key)
+{
+    return_val_if_fail(tree != NULL && key != NULL, NULL);
+
+    int         cmp;
+    ulong       prefix = _ctree_prefix(tree, key);
+    ctree_node* node;
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("ctree hints require parent links");
+        return NULL;
+    }
+
+    node = (hint != NULL) ? _ctreenode_climb(tree, hint, key, prefix) : tree->root;
+
+    while(node != NULL && (cmp = _ctreenode_cmp(tree, node, key, prefix)) != 0)
+        node = (cmp > 0) ? node->left : node->right;
+
+    return node;
+}
+
+/*
+ * Returns the total node count in the CTree.
+ */
+uint
+ctree_size(ctree* tree)
+{
+    if(tree->mode & CTREE_CONCURRENT)
+        return __atomic_load_n(&tree->size, __ATOMIC_RELAXED);
+
+    if(tree->flags & SIZE_STALE) {
+        tree->size = _ctreenode_count(tree->root);
+        tree->flags &= ~SIZE_STALE;
+    }
+
+    return tree->size;
+}
+
+/*
+ * Returns the total size of the CTree (size of all nodes) in bytes.
+ * This represents only the size of nodes not the actual allocation size of
+ * key and value pairs (if they are malloc'ed).
+ */
+size_t
+ctree_size_bytes(ctree* tree)
+{
+    size_t inline_size = (tree != NULL && _CTREE_INLINE(tree)) ? _CTREE_INLINE_ALIGN(tree->key_size) + tree->value_size : 0;
+
+    return ctree_size(tree) * (sizeof(ctree_node) + inline_size);
+}
+
+/*
+ * Releases the writer state of the 'CTREE_CONCURRENT' tree,
+ * everything still in the limbo gets freed.
+ * Caller guarantees there are no readers left.
+ */
+static void
+_ctree_sync_free(ctree* tree)
+{
+    _ctree_sync* sync = tree->sync;
+
+    _ctree_limbo_reclaim(tree, &sync->pending);
+    free(sync->pending.items);
+
+    for(uint i = 0; i < 3; i++) {
+        _ctree_limbo_reclaim(tree, &sync->limbo[i]);
+        free(sync->limbo[i].items);
+    }
+
+    pthread_mutex_destroy(&sync->lock);
+    free(sync);
+    tree->sync = NULL;
+}
+
+/*
+ * Drops the 'ctree' freeing the wrapper, but the nodes are not freed.
+ * Pointer to the wrapper also gets nulled.
+ */
+void
+ctree_drop(ctree** treep, bool free_tree)
+{
+    ctree* tree;
+    if(treep != NULL && (tree = *treep) != NULL) {
+        tree->root   = NULL;
+        tree->size   = 0;
+        tree->flags  = COL_BYTE;
+        tree->finger = NULL;
+        *treep       = NULL;
+        _ctree_edges_reset(tree);
+        _ctree_arena_prune(tree, true);
+        if(free_tree) {
+            if(tree->sync != NULL)
+                _ctree_sync_free(tree);
+            if(tree->cache != NULL)
+                ctree_cache_enable(tree, NULL, 0);
+            free(tree);
+        }
+    }
+}
+
+/*
+ * Frees all the nodes (applying 'free_key_fn' and 'free_value_fn'
+ * if present) and then the 'ctree' itself.
+ * 'CTREE_CONCURRENT' tree must not be accessed by any other thread
+ * at this point.
+ * 'CTREE_PERSISTENT' tree (or snapshot) only frees the nodes no other
+ * version references.
+ */
+void
+ctree_free(ctree* tree)
+{
+    if(tree != NULL) {
+        if(tree->mode & CTREE_PERSISTENT)
+            _ctreenode_release(tree, tree->root);
+        else
+            _ctreenode_free_batch(tree, &tree->root, ULONG_MAX);
+        ctree_drop(&tree, true);
+    }
+}
+
+#ifndef COL_CTREE_RECLAIM_BATCH
+/*
+ * Number of the nodes the reclaimer thread frees before yielding
+ * the processor to the other threads.
+ */
+#define COL_CTREE_RECLAIM_BATCH 4096
+#endif
+
+/*
+ * Detached subtree waiting to be freed on the background thread,
+ * 'owner' is the copy of the tree it got removed from.
+ * 'tree' is the wrapper freed after the subtree, if the whole tree
+ * is being freed.
+ * 'detached' reclaimer frees itself once done, otherwise it is
+ * freed by 'ctree_reclaim_wait'.
+ */
+struct ctree_reclaim {
+    ctree       owner;
+    ctree_node* root;
+    ctree*      tree;
+    pthread_t   thread;
+    bool        detached;
+};
+
+static void*
+_ctree_reclaim_run(void* arg)
+{
+    ctree_reclaim* reclaim = arg;
+
+    if(reclaim->owner.mode & CTREE_PERSISTENT) {
+        _ctreenode_release(&reclaim->owner, reclaim->root);
+    } else {
+        while(_ctreenode_free_batch(&reclaim->owner, &reclaim->root, COL_CTREE_RECLAIM_BATCH) == COL_CTREE_RECLAIM_BATCH)
+            sched_yield();
+    }
+
+    if(reclaim->tree != NULL)
+        ctree_drop(&reclaim->tree, true);
+
+    if(reclaim->detached)
+        free(reclaim);
+
+    return NULL;
+}
+
+/*
+ * Starts freeing the subtree 'root' of the 'tree' on the background thread,
+ * 'whole' tells if the 'tree' wrapper itself gets freed too.
+ * Returns the joinable reclaimer if 'detached' is false (detached one
+ * must not be dereferenced).
+ * Returns NULL if the thread could not be started, nothing gets freed.
+ */
+static ctree_reclaim*
+_ctree_reclaim_start(ctree* tree, ctree_node* root, bool whole, bool detached)
+{
+    ctree_reclaim* reclaim = memc_malloc(ctree_reclaim);
+    pthread_t      thread;
+
+    if(reclaim == NULL)
+        return NULL;
+
+    reclaim->owner      = *tree;
+    reclaim->owner.pool = NULL;
+    reclaim->root       = root;
+    reclaim->tree       = whole ? tree : NULL;
+    reclaim->detached   = detached;
+
+    if(pthread_create(&thread, NULL, _ctree_reclaim_run, reclaim) != 0) {
+        free(reclaim);
+        return NULL;
+    }
+
+    // Detached reclaimer might be gone already, it is not touched anymore
+    if(detached)
+        pthread_detach(thread);
+    else
+        reclaim->thread = thread;
+
+    return reclaim;
+}
+
+/*
+ * Frees the 'tree' the same way as 'ctree_free' but on the background
+ * thread, caller only pays for starting the thread regardless of the
+ * tree size. Reclaimer frees the nodes in batches of 'COL_CTREE_RECLAIM_BATCH'
+ * yielding the processor in between.
+ * Tree must not be accessed anymore once this function is called.
+ *
+ * If 'reclaim' is not NULL it receives the handle which must be passed to
+ * 'ctree_reclaim_wait', otherwise the reclaimer runs detached.
+ * If the thread could not be started the tree is freed right away,
+ * '*reclaim' is then NULL and false is returned.
+ */
+bool
+ctree_free_async(ctree* tree, ctree_reclaim** reclaim)
+{
+    ctree_reclaim* started;
+
+    if(reclaim != NULL)
+        *reclaim = NULL;
+
+    if(tree == NULL)
+        return true;
+
+    // Node pool belongs to the owner of the tree (sharded tree)
+    tree->pool = NULL;
+
+    if((started = _ctree_reclaim_start(tree, tree->root, true, reclaim == NULL)) == NULL) {
+        ctree_free(tree);
+        return false;
+    }
+
+    if(reclaim != NULL)
+        *reclaim = started;
+
+    return true;
+}
+
+/*
+ * Waits until the reclaimer started by 'ctree_free_async' frees
+ * the whole tree, then frees the 'reclaim' handle.
+ */
+void
+ctree_reclaim_wait(ctree_reclaim* reclaim)
+{
+    if(reclaim != NULL) {
+        pthread_join(reclaim->thread, NULL);
+        free(reclaim);
+    }
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                       JOIN BASED SET OPERATIONS                          */
+/****************************************************************************/
+
+/*
+ * All the bulk operations below are built on top of the AVL 'join',
+ * concatenating two trees of arbitrary heights around the middle node
+ * costs O(|h(left) - h(right)|) instead of O(n).
+ * Set operations recursively split one tree by the root of the other
+ * and join the results back, which is work optimal O(m * log(n / m + 1))
+ * (m <= n), the recursive subproblems are independent and get forked
+ * onto the other threads when they are large enough.
+ *
+ * Parent links are fixed up every time the subtree gets attached to the
+ * node, 'COL_CTREE_THREADED' builds rethread the result in O(n).
+ */
+
+/*
+ * Minimal height of the subtrees on both sides before the recursion
+ * forks, subtrees of that height hold at least few thousand nodes.
+ */
+#ifndef COL_CTREE_PAR_HEIGHT
+#define COL_CTREE_PAR_HEIGHT 12
+#endif
+
+/*
+ * Makes 'left' and 'right' children of the 'node'.
+ */
+static ctree_node*
+_ctreenode_link(ctree_node* left, ctree_node* node, ctree_node* right)
+{
+    node->left  = left;
+    node->right = right;
+
+    if(left != NULL)
+        left->parent = node;
+    if(right != NULL)
+        right->parent = node;
+
+    _ctreenode_update(node);
+    return node;
+}
+
+/*
+ * Join where the 'left' is taller, 'node' is attached on the right spine
+ * of the 'left' where the heights match and the spine is rebalanced.
+ */
+static ctree_node*
+_ctreenode_join_right(ctree_node* left, ctree_node* node, ctree_node* right)
+{
+    ctree_node* child = left->right;
+
+    if(_ctreenode_height(child) <= _ctreenode_height(right) + 1) {
+        child = _ctreenode_link(child, node, right);
+
+        if(_ctreenode_height(child) <= _ctreenode_height(left->left) + 1)
+            return _ctreenode_link(left->left, left, child);
+
+        _ctreenode_link(left->left, left, _ctreenode_rotate_right(child));
+        return _ctreenode_rotate_left(left);
+    }
+
+    child = _ctreenode_join_right(child, node, right);
+    _ctreenode_link(left->left, left, child);
+
+    if(_ctreenode_height(child) <= _ctreenode_height(left->left) + 1)
+        return left;
+
+    return _ctreenode_rotate_left(left);
+}
+
+/*
+ * Mirror of '_ctreenode_join_right'.
+ */
+static ctree_node*
+_ctreenode_join_left(ctree_node* left, ctree_node* node, ctree_node* right)
+{
+    ctree_node* child = right->left;
+
+    if(_ctreenode_height(child) <= _ctreenode_height(left) + 1) {
+        child = _ctreenode_link(left, node, child);
+
+        if(_ctreenode_height(child) <= _ctreenode_height(right->right) + 1)
+            return _ctreenode_link(child, right, right->right);
+
+        _ctreenode_link(_ctreenode_rotate_left(child), right, right->right);
+        return _ctreenode_rotate_right(right);
+    }
+
+    child = _ctreenode_join_left(left, node, child);
+    _ctreenode_link(child, right, right->right);
+
+    if(_ctreenode_height(child) <= _ctreenode_height(right->right) + 1)
+        return right;
+
+    return _ctreenode_rotate_right(right);
+}
+
+/*
+ * Joins the trees 'left' and 'right' with the 'node' in between,
+ * all the keys in 'left' must be smaller than the key of the 'node'
+ * and all the keys in 'right' larger.
+ */
+static ctree_node*
+_ctreenode_join(ctree_node* left, ctree_node* node, ctree_node* right)
+{
+    int lh = _ctreenode_height(left);
+    int rh = _ctreenode_height(right);
+
+    if(lh > rh + 1)
+        return _ctreenode_join_right(left, node, right);
+    else if(rh > lh + 1)
+        return _ctreenode_join_left(left, node, right);
+
+    return _ctreenode_link(left, node, right);
+}
+
+/*
+ * Joins the trees 'left' and 'right' without the middle node,
+ * largest node of the 'left' becomes the middle node.
+ */
+static ctree_node*
+_ctreenode_join2(ctree_node* left, ctree_node* right)
+{
+    ctree_node* max;
+
+    if(left == NULL)
+        return right;
+
+    left = _ctreenode_detach_max(left, &max);
+
+    return _ctreenode_join(left, max, right);
+}
+
+/*
+ * Splits the tree rooted at 'node' by the 'key' into the tree of smaller
+ * keys ('left') and the tree of larger keys ('right').
+ * Node holding the 'key' is detached and returned, NULL if not found.
+ */
+static ctree_node*
+_ctreenode_split(const ctree* tree,
+                 ctree_node*  node,
+                 cconstptr_t  key,
+                 ulong        prefix,
+                 ctree_node** left,
+                 ctree_node** right)
+{
+    ctree_node* mid;
+    ctree_node* sub;
+    int         cmp;
+
+    if(node == NULL) {
+        *left  = NULL;
+        *right = NULL;
+        return NULL;
+    }
+
+    if((cmp = _ctreenode_cmp(tree, node, key, prefix)) == 0) {
+        *left       = node->left;
+        *right      = node->right;
+        node->left  = NULL;
+        node->right = NULL;
+        return node;
+    } else if(cmp > 0) {
+        mid    = _ctreenode_split(tree, node->left, key, prefix, left, &sub);
+        *right = _ctreenode_join(sub, node, node->right);
+    } else {
+        mid   = _ctreenode_split(tree, node->right, key, prefix, &sub, right);
+        *left = _ctreenode_join(node->left, node, sub);
+    }
+
+    return mid;
+}
+
+#ifdef COL_CTREE_THREADED
+/*
+ * Rebuilds the thread links of the whole subtree, 'prev' holds the
+ * last threaded node.
+ */
+static void
+_ctreenode_rethread(ctree_node* node, ctree_node** prev)
+{
+    if(node == NULL)
+        return;
+
+    _ctreenode_rethread(node->left, prev);
+
+    node->prev = *prev;
+    node->next = NULL;
+
+    if(*prev != NULL)
+        (*prev)->next = node;
+
+    *prev = node;
+
+    _ctreenode_rethread(node->right, prev);
+}
+#endif
+
+typedef enum {
+    SETOP_UNION,
+    SETOP_MERGE,
+    SETOP_INTERSECTION,
+    SETOP_DIFFERENCE,
+} _ctree_setop_kind;
+
+/*
+ * State shared by all the (sub)tasks of one set operation.
+ * 'tree' is the tree receiving the result and 'other' the consumed one.
+ */
+typedef struct {
+    const ctree*  tree;
+    const ctree*  other;
+    CMergeValueFn merge_fn;
+    byte          kind;
+} _ctree_setop_ctx;
+
+typedef struct {
+    const _ctree_setop_ctx* ctx;
+    ctree_node*             node;
+    ctree_node*             other;
+    ctree_node*             result;
+    uint                    depth;
+    ulong                   matches;
+} _ctree_setop_task;
+
+static ctree_node*
+_ctree_setop(const _ctree_setop_ctx* ctx, ctree_node* node, ctree_node* other, uint depth, ulong* matches);
+
+static bool
+_ctree_evacuate(ctree* tree);
+
+static void*
+_ctree_setop_run(void* arg)
+{
+    _ctree_setop_task* task = arg;
+
+    task->result = _ctree_setop(task->ctx, task->node, task->other, task->depth, &task->matches);
+
+    return NULL;
+}
+
+/*
+ * Decides what happens with the root 'pivot' of the 'other' tree and the
+ * matching node 'match' of the 'tree' (NULL if there is none).
+ * Returns the node that stays in the result, NULL if none.
+ */
+static ctree_node*
+_ctree_setop_pivot(const _ctree_setop_ctx* ctx, ctree_node* match, ctree_node* pivot, ulong* matches)
+{
+    if(match == NULL) {
+        if(ctx->kind == SETOP_UNION || ctx->kind == SETOP_MERGE)
+            return pivot;
+
+        _ctreenode_destroy(ctx->other, pivot);
+        return NULL;
+    }
+
+    (*matches)++;
+
+    if(ctx->kind == SETOP_MERGE) {
+        cptr_t value = ctx->merge_fn(match->key, match->value, pivot->value);
+
+        if(ctx->tree->free_value_fn && value != match->value)
+            ctx->tree->free_value_fn(match->value);
+
+        if(ctx->other->free_value_fn && value != pivot->value)
+            ctx->other->free_value_fn(pivot->value);
+
+        if(ctx->other->free_key_fn)
+            ctx->other->free_key_fn(pivot->key);
+
+        _ctreenode_put_value(ctx->tree, match, value);
+        _ctreenode_free(ctx->other, pivot);
+    } else
+        _ctreenode_destroy(ctx->other, pivot);
+
+    if(ctx->kind == SETOP_DIFFERENCE) {
+        _ctreenode_destroy(ctx->tree, match);
+        return NULL;
+    }
+
+    return match;
+}
+
+/*
+ * Recursive set operation on the subtree 'node' of the 'tree' and the
+ * subtree 'other' of the 'other' tree.
+ * 'depth' limits how many more times the recursion can fork,
+ * 'matches' counts the keys found in both subtrees.
+ */
+static ctree_node*
+_ctree_setop(const _ctree_setop_ctx* ctx, ctree_node* node, ctree_node* other, uint depth, ulong* matches)
+{
+    if(other == NULL) {
+        if(ctx->kind != SETOP_INTERSECTION)
+            return node;
+
+        _ctreenode_freeall(ctx->tree, node);
+        return NULL;
+    } else if(node == NULL) {
+        if(ctx->kind == SETOP_UNION || ctx->kind == SETOP_MERGE)
+            return other;
+
+        _ctreenode_freeall(ctx->other, other);
+        return NULL;
+    }
+
+    ctree_node* left;
+    ctree_node* right;
+    ctree_node* other_left  = other->left;
+    ctree_node* other_right = other->right;
+    ctree_node* match       = _ctreenode_split(ctx->tree, node, other->key, _CTREENODE_PREFIX(other), &left, &right);
+    uint        next        = (depth > 0) ? depth - 1 : 0;
+
+    other->left  = NULL;
+    other->right = NULL;
+
+    _ctree_setop_task task = {
+        .ctx     = ctx,
+        .node    = left,
+        .other   = other_left,
+        .result  = NULL,
+        .depth   = next,
+        .matches = 0,
+    };
+
+    pthread_t thread;
+    bool      forked = false;
+
+    if(depth > 0
+       && (_ctreenode_height(left) >= COL_CTREE_PAR_HEIGHT || _ctreenode_height(other_left) >= COL_CTREE_PAR_HEIGHT)
+       && (_ctreenode_height(right) >= COL_CTREE_PAR_HEIGHT || _ctreenode_height(other_right) >= COL_CTREE_PAR_HEIGHT))
+        forked = pthread_create(&thread, NULL, _ctree_setop_run, &task) == 0;
+
+    if(!forked)
+        _ctree_setop_run(&task);
+
+    right = _ctree_setop(ctx, right, other_right, next, matches);
+
+    if(forked)
+        pthread_join(thread, NULL);
+
+    *matches += task.matches;
+
+    if((node = _ctree_setop_pivot(ctx, match, other, matches)) != NULL)
+        return _ctreenode_join(task.result, node, right);
+
+    return _ctreenode_join2(task.result, right);
+}
+
+/*
+ * How many times the set operation (or parallel traversal) recursion
+ * is allowed to fork, enough to keep all the online processors busy.
+ */
+static uint
+_ctree_fork_depth(void)
+{
+    long cpus  = sysconf(_SC_NPROCESSORS_ONLN);
+    uint depth = 0;
+
+    while(depth < 16 && (1L << depth) < cpus)
+        depth++;
+
+    return depth;
+}
+
+/*
+ * Runs the set operation of the 'kind' on the 'tree' and the tree
+ * 'otherp' points to, 'other' tree gets consumed.
+ */
+static bool
+_ctree_setop_apply(ctree* tree, ctree** otherp, byte kind, CMergeValueFn merge_fn)
+{
+    ctree* other;
+    return_val_if_fail(tree != NULL && otherp != NULL && (other = *otherp) != NULL && other != tree, false);
+
+    if((tree->mode | other->mode) & _CTREE_COW) {
+        COL_ERROR("set operations require parent links");
+        return false;
+    }
+
+    if(tree->policy != CTREE_AVL || other->policy != CTREE_AVL) {
+        COL_ERROR("set operations require avl ctree");
+        return false;
+    }
+
+    // Nodes of the other tree get handed over
+    if(!_ctree_same_layout(tree, other) || !_ctree_evacuate(other))
+        return false;
+
+    tree->finger = NULL;
+    _ctree_edges_reset(tree);
+
+    _ctree_setop_ctx ctx = {
+        .tree     = tree,
+        .other    = other,
+        .merge_fn = merge_fn,
+        .kind     = kind,
+    };
+
+    // Compaction blocks of the 'tree' are freed into from this thread only
+    ulong       matches    = 0;
+    uint        size       = ctree_size(tree);
+    uint        other_size = ctree_size(other);
+    uint        depth      = (tree->arena == NULL) ? _ctree_fork_depth() : 0;
+    ctree_node* root       = _ctree_setop(&ctx, tree->root, other->root, depth, &matches);
+
+    if(root != NULL)
+        root->parent = NULL;
+
+    switch(kind) {
+        case SETOP_UNION:
+        case SETOP_MERGE:
+            tree->size = size + other_size - matches;
+            break;
+        case SETOP_INTERSECTION:
+            tree->size = matches;
+            break;
+        case SETOP_DIFFERENCE:
+            tree->size = size - matches;
+            break;
+    }
+
+    tree->root = root;
+
+#ifdef COL_CTREE_THREADED
+    ctree_node* prev = NULL;
+    _ctreenode_rethread(root, &prev);
+#endif
+
+    ctree_drop(otherp, true);
+
+    return true;
+}
+
+/*
+ * Moves all the key/value pairs of 'other' into the 'tree', on duplicate
+ * keys the pair already inside the 'tree' is kept.
+ */
+bool
+ctree_union(ctree* tree, ctree** otherp)
+{
+    return _ctree_setop_apply(tree, otherp, SETOP_UNION, NULL);
+}
+
+/*
+ * Same as 'ctree_union' except the values of the duplicate keys
+ * get combined with the 'merge_fn'.
+ */
+bool
+ctree_merge_with(ctree* tree, ctree** otherp, CMergeValueFn merge_fn)
+{
+    return_val_if_fail(merge_fn != NULL, false);
+    return _ctree_setop_apply(tree, otherp, SETOP_MERGE, merge_fn);
+}
+
+/*
+ * Keeps only the key/value pairs of the 'tree' whose keys are also in 'other'.
+ */
+bool
+ctree_intersection(ctree* tree, ctree** otherp)
+{
+    return _ctree_setop_apply(tree, otherp, SETOP_INTERSECTION, NULL);
+}
+
+/*
+ * Removes the key/value pairs of the 'tree' whose keys are in 'other'.
+ */
+bool
+ctree_difference(ctree* tree, ctree** otherp)
+{
+    return _ctree_setop_apply(tree, otherp, SETOP_DIFFERENCE, NULL);
+}
+
+/*
+ * Allocates the empty tree with the same functions and mode as the 'tree'.
+ */
+static ctree*
+_ctree_new_like(const ctree* tree)
+{
+    ctree* like = memc_malloc(ctree);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(like == NULL, 0)) {
+#else
+    if(like == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    *like         = *tree;
+    like->root    = NULL;
+    like->size    = 0;
+    like->flags   = COL_BYTE;
+    like->finger  = NULL;
+    like->min     = NULL;
+    like->max     = NULL;
+    like->pool    = NULL;
+    like->arena   = NULL;
+    like->compact = NULL;
+    like->cache   = NULL;
+
+    return like;
+}
+
+#ifdef COL_CTREE_THREADED
+/*
+ * Threads the largest node of the 'left' subtree with the smallest
+ * node of the 'right' subtree, either one can be NULL.
+ */
+static void
+_ctreenode_thread_between(ctree_node* left, ctree_node* right)
+{
+    ctree_node* pred = (left != NULL) ? _ctree_max(left) : NULL;
+    ctree_node* succ = (right != NULL) ? _ctree_min(right) : NULL;
+
+    if(pred != NULL)
+        pred->next = succ;
+    if(succ != NULL)
+        succ->prev = pred;
+}
+#endif
+
+/*
+ * Splits the tree rooted at 'node' into the tree of keys smaller than
+ * 'key' ('left') and the tree of keys larger or equal to 'key' ('right').
+ */
+static void
+_ctreenode_split_at(const ctree* tree, ctree_node* node, cconstptr_t key, ctree_node** left, ctree_node** right)
+{
+    ctree_node* mid = _ctreenode_split(tree, node, key, _ctree_prefix(tree, key), left, right);
+
+    if(mid != NULL)
+        *right = _ctreenode_join(NULL, mid, *right);
+
+    if(*left != NULL)
+        (*left)->parent = NULL;
+    if(*right != NULL)
+        (*right)->parent = NULL;
+
+#ifdef COL_CTREE_THREADED
+    _ctreenode_thread_between(*left, NULL);
+    _ctreenode_thread_between(NULL, *right);
+#endif
+}
+
+/*
+ * Returns true if the 'tree' can be split/joined, that is
+ * the AVL tree with the parent links (not copy-on-write).
+ */
+static bool
+_ctree_joinable(const ctree* tree)
+{
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("split/join require parent links");
+        return false;
+    }
+
+    if(tree->policy != CTREE_AVL) {
+        COL_ERROR("split/join require avl ctree");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Splits the tree 'treep' points to into the tree of keys smaller than
+ * the 'key' ('left') and the tree of keys larger or equal to the 'key' ('right').
+ * Tree gets consumed, its pointer is nulled.
+ * Returns false if the trees could not be allocated, the tree is left as is.
+ */
+bool
+ctree_split(ctree** treep, cconstptr_t key, ctree** left, ctree** right)
+{
+    ctree* tree;
+    return_val_if_fail(treep != NULL && (tree = *treep) != NULL && left != NULL && right != NULL, false);
+
+    if(!_ctree_joinable(tree) || !_ctree_evacuate(tree))
+        return false;
+
+    ctree* rtree = _ctree_new_like(tree);
+
+    if(rtree == NULL)
+        return false;
+
+    _ctreenode_split_at(tree, tree->root, key, &tree->root, &rtree->root);
+    tree->finger = NULL;
+    _ctree_edges_reset(tree);
+
+    // Sizes of the halves are recounted once asked for
+    tree->flags  |= SIZE_STALE;
+    rtree->flags |= SIZE_STALE;
+
+    *treep = NULL;
+    *left  = tree;
+    *right = rtree;
+
+    return true;
+}
+
+/*
+ * Joins the tree 'otherp' points to into the 'tree', all the keys of the
+ * other tree must be either smaller or larger than all the keys of the 'tree'.
+ * Other tree gets consumed, its pointer is nulled.
+ * Returns false if the key ranges of the trees overlap.
+ */
+bool
+ctree_join(ctree* tree, ctree** otherp)
+{
+    ctree* other;
+    return_val_if_fail(tree != NULL && otherp != NULL && (other = *otherp) != NULL && other != tree, false);
+
+    if(!_ctree_joinable(tree) || !_ctree_joinable(other) || !_ctree_same_layout(tree, other)
+       || !_ctree_evacuate(other))
+        return false;
+
+    ctree_node* left  = tree->root;
+    ctree_node* right = other->root;
+
+    if(left != NULL && right != NULL
+       && tree->compare_key_fn(_ctree_max(left)->key, _ctree_min(right)->key) >= 0) {
+        left  = other->root;
+        right = tree->root;
+
+        if(tree->compare_key_fn(_ctree_max(left)->key, _ctree_min(right)->key) >= 0) {
+            COL_ERROR("joined ctrees overlap");
+            return false;
+        }
+    }
+
+#ifdef COL_CTREE_THREADED
+    if(left != NULL && right != NULL)
+        _ctreenode_thread_between(left, right);
+#endif
+
+    if((tree->root = _ctreenode_join2(left, right)) != NULL)
+        tree->root->parent = NULL;
+
+    _ctree_edges_reset(tree);
+
+    tree->size  += other->size;
+    tree->flags |= other->flags & SIZE_STALE;
+
+    ctree_drop(otherp, true);
+
+    return true;
+}
+
+/*
+ * Removes all the keys in the range ['lo', 'hi') in O(log n), range is
+ * detached from the tree as a whole and then freed (using the free functions)
+ * in one pass, on the background thread if 'async' is true.
+ * Returns true if any key got removed.
+ */
+bool
+ctree_remove_range(ctree* tree, cconstptr_t lo, cconstptr_t hi, bool async)
+{
+    return_val_if_fail(tree != NULL && lo != NULL && hi != NULL, false);
+
+    if(!_ctree_joinable(tree) || tree->compare_key_fn(lo, hi) >= 0)
+        return false;
+
+    ctree_node* left;
+    ctree_node* range;
+    ctree_node* right;
+
+    _ctreenode_split_at(tree, tree->root, lo, &left, &right);
+    _ctreenode_split_at(tree, right, hi, &range, &right);
+    tree->finger = NULL;
+    _ctree_edges_reset(tree);
+
+#ifdef COL_CTREE_THREADED
+    _ctreenode_thread_between(left, right);
+#endif
+
+    if((tree->root = _ctreenode_join2(left, right)) != NULL)
+        tree->root->parent = NULL;
+
+    if(range == NULL)
+        return false;
+
+    // Compaction blocks are not shared with the reclaimer
+    if(async && tree->arena == NULL && _ctree_reclaim_start(tree, range, false, true) != NULL) {
+        tree->flags |= SIZE_STALE;
+    } else {
+        tree->size -= _ctreenode_count(range);
+        _ctreenode_freeall(tree, range);
+    }
+
+    return true;
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                           PARALLEL TRAVERSAL                             */
+/****************************************************************************/
+
+/*
+ * Top levels of the tree are split into the left subtree (forked onto
+ * the other thread), the node and the right subtree (kept on the current
+ * one), the same way the set operations fork.
+ * Subtree is forked only while it is expected to hold at least
+ * '2^COL_CTREE_PAR_HEIGHT' nodes (tree size halves each level down),
+ * below that it is walked sequentially in order.
+ * Partial results are combined left to right, so the reduction only
+ * has to be associative.
+ */
+typedef struct {
+    CVisitFn   visit_fn;
+    CMapFn     map_fn;
+    CCombineFn combine_fn;
+    cptr_t     ctx;
+    ulong      size;
+    bool       cow;
+} _ctree_par_ctx;
+
+typedef struct {
+    const _ctree_par_ctx* ctx;
+    ctree_node*           node;
+    uint                  level;
+    uint                  depth;
+    cptr_t                result;
+    bool                  found;
+} _ctree_par_task;
+
+/*
+ * Folds the single 'node' into the 'task' result.
+ */
+static inline void
+_ctree_par_fold_node(_ctree_par_task* task, ctree_node* node)
+{
+    const _ctree_par_ctx* ctx = task->ctx;
+
+    if(ctx->visit_fn != NULL) {
+        ctx->visit_fn(node->key, node->value, ctx->ctx);
+    } else if(task->found) {
+        task->result = ctx->combine_fn(task->result, ctx->map_fn(node->key, node->value, ctx->ctx), ctx->ctx);
+    } else {
+        task->result = ctx->map_fn(node->key, node->value, ctx->ctx);
+        task->found  = true;
+    }
+}
+
+/*
+ * Folds the copy-on-write subtree in order into the 'task' result.
+ * Shared nodes have no parent links, so the fold recurses, copy-on-write
+ * trees are AVL only and their depth stays O(log n).
+ */
+static void
+_ctree_par_fold_cow(_ctree_par_task* task, ctree_node* node)
+{
+    for(; node != NULL; node = node->right) {
+        _ctree_par_fold_cow(task, node->left);
+        _ctree_par_fold_node(task, node);
+    }
+}
+
+/*
+ * Folds the subtree in order into the 'task' result.
+ */
+static void
+_ctree_par_fold(_ctree_par_task* task, ctree_node* root)
+{
+    if(task->ctx->cow) {
+        _ctree_par_fold_cow(task, root);
+        return;
+    }
+
+    for(ctree_node* node = _ctree_min(root); node != NULL; node = _ctreenode_next_in(node, root))
+        _ctree_par_fold_node(task, node);
+}
+
+static void*
+_ctree_par_run(void* arg);
+
+/*
+ * Combines the 'right' result into the 'task' result.
+ */
+static inline void
+_ctree_par_combine(_ctree_par_task* task, cptr_t right, bool found)
+{
+    if(!found)
+        return;
+
+    task->result = task->found ? task->ctx->combine_fn(task->result, right, task->ctx->ctx) : right;
+    task->found  = true;
+}
+
+static void*
+_ctree_par_run(void* arg)
+{
+    _ctree_par_task*      task = arg;
+    const _ctree_par_ctx* ctx  = task->ctx;
+    ctree_node*           node = task->node;
+
+    task->result = NULL;
+    task->found  = false;
+
+    if(node == NULL)
+        return NULL;
+
+    if(task->depth == 0 || (ctx->size >> (task->level + 1)) < (1UL << COL_CTREE_PAR_HEIGHT)) {
+        _ctree_par_fold(task, node);
+        return NULL;
+    }
+
+    _ctree_par_task left = {
+        .ctx   = ctx,
+        .node  = node->left,
+        .level = task->level + 1,
+        .depth = task->depth - 1,
+    };
+
+    _ctree_par_task right = left;
+    right.node            = node->right;
+
+    pthread_t thread;
+    bool      forked = pthread_create(&thread, NULL, _ctree_par_run, &left) == 0;
+
+    if(!forked)
+        _ctree_par_run(&left);
+
+    _ctree_par_run(&right);
+
+    if(forked)
+        pthread_join(thread, NULL);
+
+    task->result = left.result;
+    task->found  = left.found;
+
+    if(ctx->visit_fn != NULL)
+        ctx->visit_fn(node->key, node->value, ctx->ctx);
+    else
+        _ctree_par_combine(task, ctx->map_fn(node->key, node->value, ctx->ctx), true);
+
+    _ctree_par_combine(task, right.result, right.found);
+
+    return NULL;
+}
+
+/*
+ * Walks the 'ctx' over the whole 'tree', returns false if the tree
+ * can't be walked from the other threads.
+ */
+static bool
+_ctree_par_walk(ctree* tree, _ctree_par_ctx* ctx, _ctree_par_task* task)
+{
+    if(tree->mode & CTREE_CONCURRENT) {
+        COL_ERROR("concurrent ctree can't be traversed in parallel");
+        return false;
+    }
+
+    ctx->size = ctree_size(tree);
+    ctx->cow  = (tree->mode & _CTREE_COW) != 0;
+
+    task->ctx   = ctx;
+    task->node  = _ctree_root(tree);
+    task->level = 0;
+    task->depth = _ctree_fork_depth();
+
+    _ctree_par_run(task);
+
+    return true;
+}
+
+/*
+ * Calls the 'visit_fn' on every key/value pair of the 'tree', subtrees
+ * are visited in parallel (in no particular order between them).
+ * Tree must not be modified meanwhile.
+ */
+void
+ctree_par_for_each(ctree* tree, CVisitFn visit_fn, cptr_t ctx)
+{
+    if(tree == NULL || visit_fn == NULL)
+        return;
+
+    _ctree_par_ctx  par = { .visit_fn = visit_fn, .ctx = ctx };
+    _ctree_par_task task;
+
+    _ctree_par_walk(tree, &par, &task);
+}
+
+/*
+ * Maps every key/value pair of the 'tree' with the 'map_fn' and combines
+ * the mapped results with the 'combine_fn' in the key order, subtrees
+ * are reduced in parallel.
+ * Returns the reduced result, NULL if the tree is empty.
+ */
+cptr_t
+ctree_par_reduce(ctree* tree, CMapFn map_fn, CCombineFn combine_fn, cptr_t ctx)
+{
+    return_val_if_fail(tree != NULL && map_fn != NULL && combine_fn != NULL, NULL);
+
+    _ctree_par_ctx  par = { .map_fn = map_fn, .combine_fn = combine_fn, .ctx = ctx };
+    _ctree_par_task task;
+
+    if(!_ctree_par_walk(tree, &par, &task))
+        return NULL;
+
+    return task.result;
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                            BATCHED INSERTION                             */
+/****************************************************************************/
+
+#ifndef COL_CTREE_BATCH_REBUILD
+/*
+ * Whole tree gets rebuilt by the batch insert once the batch holds
+ * at least 1/COL_CTREE_BATCH_REBUILD of the keys the tree holds.
+ */
+#define COL_CTREE_BATCH_REBUILD 4
+#endif
+
+typedef struct {
+    cptr_t key;
+    cptr_t value;
+    ulong  prefix;
+} _ctree_pair;
+
+static inline int
+_ctree_pair_cmp(const ctree* tree, const _ctree_pair* left, const _ctree_pair* right)
+{
+    if(left->prefix != right->prefix)
+        return (left->prefix > right->prefix) ? 1 : -1;
+
+    return tree->compare_key_fn(left->key, right->key);
+}
+
+/*
+ * Stable bottom-up merge sort of the 'pairs' by their keys,
+ * 'tmp' is the scratch buffer of the same size.
+ */
+static void
+_ctree_pairs_sort(const ctree* tree, _ctree_pair* pairs, _ctree_pair* tmp, size_t n)
+{
+    _ctree_pair* src = pairs;
+    _ctree_pair* dst = tmp;
+    _ctree_pair* swap;
+    size_t       width, lo, mid, hi, i, j, k;
+
+    for(width = 1; width < n; width *= 2) {
+        for(lo = 0; lo < n; lo += 2 * width) {
+            mid = (lo + width < n) ? lo + width : n;
+            hi  = (mid + width < n) ? mid + width : n;
+
+            for(i = lo, j = mid, k = lo; k < hi; k++) {
+                if(i < mid && (j >= hi || _ctree_pair_cmp(tree, &src[i], &src[j]) <= 0))
+                    dst[k] = src[i++];
+                else
+                    dst[k] = src[j++];
+            }
+        }
+
+        swap = src;
+        src  = dst;
+        dst  = swap;
+    }
+
+    if(src != pairs)
+        memcpy(pairs, src, n * sizeof(_ctree_pair));
+}
+
+/*
+ * Collapses the runs of equal keys of the sorted 'pairs' the way
+ * consecutive inserts would, first key is kept together with the
+ * last value, overwritten values are freed.
+ * Returns the number of unique pairs left.
+ */
+static size_t
+_ctree_pairs_unique(const ctree* tree, _ctree_pair* pairs, size_t n, ulong* updated)
+{
+    size_t i, out = 0;
+
+    for(i = 0; i < n; i++) {
+        if(out > 0 && _ctree_pair_cmp(tree, &pairs[out - 1], &pairs[i]) == 0) {
+            if(tree->free_value_fn)
+                tree->free_value_fn(pairs[out - 1].value);
+
+            pairs[out - 1].value = pairs[i].value;
+            (*updated)++;
+        } else {
+            pairs[out++] = pairs[i];
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Builds the balanced subtree out of 'n' sorted nodes.
+ */
+static ctree_node*
+_ctreenode_build(ctree_node** nodes, size_t n)
+{
+    if(n == 0)
+        return NULL;
+
+    size_t      mid  = n / 2;
+    ctree_node* node = nodes[mid];
+
+    node->parent = NULL;
+
+    return _ctreenode_link(_ctreenode_build(nodes, mid), node, _ctreenode_build(nodes + mid + 1, n - mid - 1));
+}
+
+/*
+ * Builds the balanced subtree out of 'n' sorted unique pairs, the subtree
+ * takes place of the empty slot in between the node 'prev' points to and
+ * the 'succ' (either one can be NULL).
+ * In threaded builds new nodes are threaded in between the two,
+ * 'prev' then points to the last new node.
+ * Pairs whose node could not be allocated are skipped.
+ */
+static ctree_node*
+_ctreenode_build_pairs(const ctree*       tree,
+                       const _ctree_pair* pairs,
+                       size_t             n,
+                       ctree_node**       prev,
+                       ctree_node*        succ,
+                       ulong*             inserted)
+{
+    if(n == 0)
+        return NULL;
+
+    size_t      mid  = n / 2;
+    ctree_node* left = _ctreenode_build_pairs(tree, pairs, mid, prev, succ, inserted);
+    ctree_node* node = _ctreenode_new(tree, pairs[mid].key, pairs[mid].value, NULL);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(node != NULL, 1)) {
+#else
+    if(node != NULL) {
+#endif
+#ifdef COL_CTREE_THREADED
+        node->prev = *prev;
+        node->next = succ;
+
+        if(*prev != NULL)
+            (*prev)->next = node;
+        if(succ != NULL)
+            succ->prev = node;
+#else
+        (void) succ;
+#endif
+        *prev = node;
+        (*inserted)++;
+    }
+
+    ctree_node* right = _ctreenode_build_pairs(tree, pairs + mid + 1, n - mid - 1, prev, succ, inserted);
+
+    if(node == NULL)
+        return _ctreenode_join2(left, right);
+
+    return _ctreenode_link(left, node, right);
+}
+
+/*
+ * Merges 'n' sorted unique pairs into the subtree rooted at 'node', 'pred' and
+ * 'succ' are the in-order neighbours of the subtree (NULL if none).
+ * Pairs are partitioned around each visited node and every partition that falls
+ * into an empty slot is built as a balanced subtree, subtrees are then
+ * rebalanced once per visited node by joining them back, this costs
+ * O(m log(n/m + 1)) instead of O(m log n) for the 'm' pairs.
+ */
+static ctree_node*
+_ctreenode_insert_batch(const ctree*       tree,
+                        ctree_node*        node,
+                        const _ctree_pair* pairs,
+                        size_t             n,
+                        ctree_node*        pred,
+                        ctree_node*        succ,
+                        ulong*             inserted,
+                        ulong*             updated)
+{
+    if(n == 0)
+        return node;
+
+    if(node == NULL)
+        return _ctreenode_build_pairs(tree, pairs, n, &pred, succ, inserted);
+
+    size_t lo = 0, hi = n, mid;
+    int    cmp;
+
+    // First pair not smaller than the node
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if(_ctreenode_cmp(tree, node, pairs[mid].key, pairs[mid].prefix) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    cmp = (lo < n) ? _ctreenode_cmp(tree, node, pairs[lo].key, pairs[lo].prefix) : -1;
+
+    if(cmp == 0) {
+        if(tree->free_value_fn)
+            tree->free_value_fn(node->value);
+
+        _ctreenode_put_value(tree, node, pairs[lo].value);
+        (*updated)++;
+    }
+
+    size_t      skip  = lo + (cmp == 0);
+    ctree_node* left  = _ctreenode_insert_batch(tree, node->left, pairs, lo, pred, node, inserted, updated);
+    ctree_node* right = _ctreenode_insert_batch(tree, node->right, pairs + skip, n - skip, node, succ, inserted, updated);
+
+    return _ctreenode_join(left, node, right);
+}
+
+/*
+ * Collects the nodes of the subtree in order.
+ */
+static void
+_ctreenode_flatten(ctree_node* node, ctree_node** nodes, size_t* count)
+{
+    for(ctree_node* next = (node != NULL) ? _ctree_min(node) : NULL; next != NULL; next = _ctreenode_next_in(next, node))
+        nodes[(*count)++] = next;
+}
+
+/*
+ * Merges 'n' sorted unique pairs with the 'tree' and rebuilds
+ * the whole tree balanced in O(n + size).
+ * Returns false if the scratch buffer could not be allocated.
+ */
+static bool
+_ctree_rebuild_batch(ctree* tree, const _ctree_pair* pairs, size_t n, ulong* inserted, ulong* updated)
+{
+    size_t       size  = tree->size;
+    ctree_node** nodes = malloc((size + n) * sizeof(ctree_node*));
+    ctree_node*  node;
+    size_t       count = 0, i = n, j = 0;
+    int          cmp;
+
+    if(nodes == NULL)
+        return false;
+
+    // Tree nodes go after the room for the pairs, merged output
+    // never overtakes them
+    _ctreenode_flatten(tree->root, nodes + n, &count);
+
+    for(count = 0; i < n + size || j < n;) {
+        cmp = (i == n + size) ? 1 : (j == n) ? -1 : _ctreenode_cmp(tree, nodes[i], pairs[j].key, pairs[j].prefix);
+
+        if(cmp < 0) {
+            nodes[count++] = nodes[i++];
+        } else if(cmp == 0) {
+            node = nodes[i++];
+
+            if(tree->free_value_fn)
+                tree->free_value_fn(node->value);
+
+            _ctreenode_put_value(tree, node, pairs[j++].value);
+            nodes[count++] = node;
+            (*updated)++;
+        } else {
+#ifndef COL_MEMORY_CONSTRAINED
+            if(__builtin_expect((node = _ctreenode_new(tree, pairs[j].key, pairs[j].value, NULL)) != NULL, 1)) {
+#else
+            if((node = _ctreenode_new(tree, pairs[j].key, pairs[j].value, NULL)) != NULL) {
+#endif
+                nodes[count++] = node;
+                (*inserted)++;
+            }
+            j++;
+        }
+    }
+
+    if((tree->root = _ctreenode_build(nodes, count)) != NULL)
+        tree->root->parent = NULL;
+
+#ifdef COL_CTREE_THREADED
+    ctree_node* prev = NULL;
+    _ctreenode_rethread(tree->root, &prev);
+#endif
+
+    free(nodes);
+    return true;
+}
+
+/*
+ * Inserts 'n' key-value pairs in one pass, pairs are sorted first and then
+ * merged into the tree, the tree is rebuilt wholesale if the batch is large
+ * relative to the tree.
+ * Existing keys get their value updated as with 'ctree_insert'.
+ * Returns the number of inserted keys, number of updated ones is
+ * stored in 'updated' (if not NULL).
+ */
+ulong
+ctree_insert_batch(ctree* tree, cptr_t* keys, cptr_t* values, size_t n, ulong* updated)
+{
+    ulong  ins = 0, upd = 0;
+    size_t i;
+    bool   inserted;
+
+    if(updated != NULL)
+        *updated = 0;
+
+    return_val_if_fail(tree != NULL && keys != NULL, 0);
+
+    for(i = 0; i < n; i++)
+        if(keys[i] == NULL) {
+            COL_INVALID_KEY_ERROR;
+            return 0;
+        }
+
+    if((tree->mode & _CTREE_COW) || tree->policy != CTREE_AVL) {
+        // Copy-on-write trees publish every insert on its own,
+        // joins of the batch merge work on the AVL heights only.
+        // Failed inserts count as neither inserted nor updated
+        for(i = 0; i < n; i++) {
+            cptr_t value = (values != NULL) ? values[i] : NULL;
+
+            if(tree->mode & _CTREE_COW) {
+                byte flags = _ctree_cow_insert(tree, keys[i], value, false);
+
+                ins += (flags & INSERTED) != 0;
+                upd += (flags & UPDATED) != 0;
+            } else if(_ctree_insert_at(tree, tree->finger, keys[i], value, &inserted) != NULL) {
+                ins += inserted;
+                upd += !inserted;
+            }
+        }
+
+        if(updated != NULL)
+            *updated = upd;
+
+        return ins;
+    }
+
+    _ctree_pair* pairs = malloc(2 * n * sizeof(_ctree_pair));
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(pairs == NULL, 0)) {
+#else
+    if(pairs == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return 0;
+    }
+
+    for(i = 0; i < n; i++) {
+        pairs[i].key    = keys[i];
+        pairs[i].value  = (values != NULL) ? values[i] : NULL;
+        pairs[i].prefix = _ctree_prefix(tree, keys[i]);
+    }
+
+    _ctree_pairs_sort(tree, pairs, pairs + n, n);
+    n = _ctree_pairs_unique(tree, pairs, n, &upd);
+
+    if(n * COL_CTREE_BATCH_REBUILD < ctree_size(tree) || !_ctree_rebuild_batch(tree, pairs, n, &ins, &upd)) {
+        if((tree->root = _ctreenode_insert_batch(tree, tree->root, pairs, n, NULL, NULL, &ins, &upd)) != NULL)
+            tree->root->parent = NULL;
+    }
+
+    _ctree_edges_reset(tree);
+
+    tree->size += ins;
+    free(pairs);
+
+    if(updated != NULL)
+        *updated = upd;
+
+    return ins;
+}
+
+/*
+ * Colors the balanced subtree built by '_ctreenode_build' as the red-black
+ * tree, nodes on its deepest level ('depth' 0 there) are red unless the
+ * node is the root, all the others are black. Every path then passes the
+ * same number of the black nodes since the levels above the deepest one
+ * are full.
+ */
+static void
+_ctreenode_paint(ctree_node* node, uint depth)
+{
+    for(; node != NULL; node = node->right, depth--) {
+        _ctreenode_paint(node->left, depth - 1);
+
+        node->balance = (depth == 0 && node->parent != NULL) ? _CTREENODE_RED : _CTREENODE_BLACK;
+        node->height  = 0;
+    }
+}
+
+/*
+ * Removes the keys of the 'tree' the 'pred' returns false for one by one,
+ * used if there is no memory for the rebuild.
+ * Returns the number of removed keys.
+ */
+static ulong
+_ctree_retain_each(ctree* tree, CPredicateFn pred, cptr_t ctx)
+{
+    ctree_node* node = _ctree_first(tree);
+    ctree_node* next;
+    ulong       removed = 0;
+
+    for(; node != NULL; node = next) {
+        next = _ctreenode_next_in(node, tree->root);
+
+        if(!pred(node->key, node->value, ctx)) {
+            _ctree_unlink_node(tree, node);
+            _ctreenode_destroy(tree, node);
+            removed++;
+        }
+    }
+
+    return removed;
+}
+
+/*
+ * Removes all the keys the 'pred' returns false for (called with the key,
+ * value and 'ctx' in order, it must not modify the tree), their key/value
+ * get freed with 'CFreeKeyFn'/'CFreeValueFn'.
+ * Tree is walked once and then rebuilt perfectly balanced out of the
+ * remaining nodes in O(n), instead of O(log n) rebalancing per removed key.
+ * Pointers to the removed nodes (iterators, hints) are invalidated.
+ *
+ * Returns the number of removed keys, 0 if the tree is 'CTREE_CONCURRENT'
+ * or 'CTREE_PERSISTENT'.
+ */
+ulong
+ctree_retain(ctree* tree, CPredicateFn pred, cptr_t ctx)
+{
+    return_val_if_fail(tree != NULL && pred != NULL, 0);
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't be retained in place");
+        return 0;
+    }
+
+    size_t       size  = ctree_size(tree);
+    ctree_node** nodes = malloc((size + 1) * sizeof(ctree_node*));
+    size_t       count = 0, kept = 0;
+
+    if(nodes == NULL)
+        return _ctree_retain_each(tree, pred, ctx);
+
+    _ctreenode_flatten(tree->root, nodes, &count);
+    _ctree_edges_reset(tree);
+    tree->finger = NULL;
+
+    for(size_t i = 0; i < count; i++) {
+        if(pred(nodes[i]->key, nodes[i]->value, ctx))
+            nodes[kept++] = nodes[i];
+        else
+            _ctreenode_destroy(tree, nodes[i]);
+    }
+
+    // Shape (hot keys of the splay tree) is kept if nothing got removed
+    if(kept != count) {
+        if((tree->root = _ctreenode_build(nodes, kept)) != NULL)
+            tree->root->parent = NULL;
+
+        if(tree->root != NULL && tree->policy == CTREE_RB)
+            _ctreenode_paint(tree->root, tree->root->height);
+
+#ifdef COL_CTREE_THREADED
+        for(size_t i = 0; i < kept; i++) {
+            nodes[i]->prev = (i > 0) ? nodes[i - 1] : NULL;
+            nodes[i]->next = (i + 1 < kept) ? nodes[i + 1] : NULL;
+        }
+#endif
+    }
+
+    tree->size = kept;
+    free(nodes);
+
+    return count - kept;
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                              SNAPSHOT FILES                              */
+/****************************************************************************/
+
+/*
+ * File written by 'ctree_save' (native byte order):
+ *
+ *   header | records (one per key, in order) | data
+ *
+ * Record holds the offsets of the key/value bytes inside the data,
+ * both 8-byte aligned so the mapped keys/values can be used in place.
+ * Records sorted by the keys are the implicit balanced tree,
+ * middle record of any range being the root of that range.
+ */
+#define _CTREE_FILE_MAGIC "ctreev01"
+
+typedef struct {
+    char     magic[8];
+    uint64_t count;
+    uint64_t data_size;
+} _ctree_file_hdr;
+
+typedef struct {
+    uint64_t key_off;
+    uint64_t value_off;
+    uint32_t key_size;
+    uint32_t value_size;
+} _ctree_file_rec;
+
+struct ctree_mapped {
+    const byte*            base;
+    size_t                 length;
+    const _ctree_file_rec* recs;
+    const byte*            data;
+    ulong                  count;
+    CCompareKeyFn          compare_key_fn;
+};
+
+#define _CTREE_FILE_ALIGN(size) (((size) + 7) & ~(uint64_t) 7)
+
+#ifndef COL_CTREE_FILE_BUFFER
+#define COL_CTREE_FILE_BUFFER (64 * 1024)
+#endif
+
+typedef struct {
+    int    fd;
+    size_t used;
+    byte   buf[COL_CTREE_FILE_BUFFER];
+} _ctree_writer;
+
+static bool
+_ctree_writer_flush(_ctree_writer* writer)
+{
+    size_t  done = 0;
+    ssize_t written;
+
+    while(done < writer->used) {
+        if((written = write(writer->fd, writer->buf + done, writer->used - done)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            COL_ERROR("ctree file write failed");
+            return false;
+        }
+
+        done += (size_t) written;
+    }
+
+    writer->used = 0;
+    return true;
+}
+
+/*
+ * Buffers 'size' bytes of the 'data' (zeros if NULL).
+ */
+static bool
+_ctree_writer_put(_ctree_writer* writer, const void* data, size_t size)
+{
+    size_t chunk;
+
+    while(size > 0) {
+        if(writer->used == sizeof(writer->buf) && !_ctree_writer_flush(writer))
+            return false;
+
+        chunk = sizeof(writer->buf) - writer->used;
+        chunk = (chunk < size) ? chunk : size;
+
+        if(data != NULL) {
+            memcpy(writer->buf + writer->used, data, chunk);
+            data = (const byte*) data + chunk;
+        } else
+            memset(writer->buf + writer->used, 0, chunk);
+
+        writer->used += chunk;
+        size         -= chunk;
+    }
+
+    return true;
+}
+
+/*
+ * Serializes the 'element', NULL serializer (or element) stores no bytes.
+ */
+static const void*
+_ctree_serialize(CSerializeFn serializer, cconstptr_t element, uint32_t* size)
+{
+    size_t      length = 0;
+    const void* bytes  = (serializer != NULL && element != NULL) ? serializer(element, &length) : NULL;
+
+    if(bytes == NULL)
+        length = 0;
+
+    if(length > UINT32_MAX) {
+        COL_ERROR("ctree file element too large");
+        *size = 0;
+        return NULL;
+    }
+
+    *size = (uint32_t) length;
+    return bytes;
+}
+
+/*
+ * Writes the records (first pass) or the data (second pass) of the
+ * keys the 'iter' walks over.
+ */
+static bool
+_ctree_save_pass(_ctree_writer* writer, ctree_iter iter, CSerializeFn kser, CSerializeFn vser, bool data)
+{
+    _ctree_file_rec rec;
+    ctree_node*     node;
+    uint64_t        offset = 0;
+    const void*     key;
+    const void*     value;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        if((key = _ctree_serialize(kser, node->key, &rec.key_size)) == NULL) {
+            COL_ERROR("ctree key could not be serialized");
+            return false;
+        }
+
+        value = _ctree_serialize(vser, node->value, &rec.value_size);
+
+        rec.key_off   = offset;
+        rec.value_off = offset + _CTREE_FILE_ALIGN(rec.key_size);
+        offset        = rec.value_off + _CTREE_FILE_ALIGN(rec.value_size);
+
+        if(!data) {
+            if(!_ctree_writer_put(writer, &rec, sizeof(rec)))
+                return false;
+        } else if(!_ctree_writer_put(writer, key, rec.key_size)
+                  || !_ctree_writer_put(writer, NULL, _CTREE_FILE_ALIGN(rec.key_size) - rec.key_size)
+                  || !_ctree_writer_put(writer, value, rec.value_size)
+                  || !_ctree_writer_put(writer, NULL, _CTREE_FILE_ALIGN(rec.value_size) - rec.value_size))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Writes the 'tree' into the file 'fd' in order, keys/values are turned
+ * into bytes by the serializers.
+ * Returns false if the key could not be serialized or the write failed.
+ */
+bool
+ctree_save(ctree* tree, int fd, CSerializeFn key_serializer, CSerializeFn value_serializer)
+{
+    return_val_if_fail(tree != NULL && fd >= 0 && key_serializer != NULL, false);
+
+    _ctree_writer*  writer = malloc(sizeof(_ctree_writer));
+    _ctree_file_hdr hdr    = { .magic = _CTREE_FILE_MAGIC };
+    ctree_iter      iter;
+    ctree_node*     node;
+    uint32_t        key_size, value_size;
+    bool            saved;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(writer == NULL, 0)) {
+#else
+    if(writer == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return false;
+    }
+
+    writer->fd   = fd;
+    writer->used = 0;
+
+    // Both passes walk the same version of the tree
+    ctree_read_enter(tree);
+    iter = ctree_iter_new(tree);
+
+    for(ctree_iter sizes = iter; (node = ctree_iter_next(&sizes)) != NULL; hdr.count++) {
+        _ctree_serialize(key_serializer, node->key, &key_size);
+        _ctree_serialize(value_serializer, node->value, &value_size);
+        hdr.data_size += _CTREE_FILE_ALIGN(key_size) + _CTREE_FILE_ALIGN(value_size);
+    }
+
+    saved = _ctree_writer_put(writer, &hdr, sizeof(hdr))
+            && _ctree_save_pass(writer, iter, key_serializer, value_serializer, false)
+            && _ctree_save_pass(writer, iter, key_serializer, value_serializer, true)
+            && _ctree_writer_flush(writer);
+
+    ctree_read_exit(tree);
+    free(writer);
+
+    return saved;
+}
+
+/*
+ * Maps the file written by 'ctree_save', keys are compared
+ * in place using the 'compare_key_fn'.
+ * Returns NULL if the file could not be mapped or is malformed.
+ */
+ctree_mapped*
+ctree_load_mmap(const char* path, CCompareKeyFn compare_key_fn)
+{
+    return_val_if_fail(path != NULL, NULL);
+
+    struct stat            st;
+    const _ctree_file_hdr* hdr;
+    ctree_mapped*          map;
+    void*                  base;
+    int                    fd;
+
+    if(compare_key_fn == NULL) {
+        COL_INVALID_CMPFN_ERROR;
+        return NULL;
+    }
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        COL_ERROR("ctree file could not be opened");
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    base = ((size_t) st.st_size >= sizeof(_ctree_file_hdr))
+               ? mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+               : MAP_FAILED;
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        COL_ERROR("ctree file could not be mapped");
+        return NULL;
+    }
+
+    hdr = base;
+
+    if(memcmp(hdr->magic, _CTREE_FILE_MAGIC, sizeof(hdr->magic)) != 0
+       || hdr->count > ((size_t) st.st_size - sizeof(*hdr)) / sizeof(_ctree_file_rec)
+       || hdr->data_size != (size_t) st.st_size - sizeof(*hdr) - hdr->count * sizeof(_ctree_file_rec)) {
+        COL_ERROR("ctree file malformed");
+        munmap(base, (size_t) st.st_size);
+        return NULL;
+    }
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect((map = memc_malloc(ctree_mapped)) == NULL, 0)) {
+#else
+    if((map = memc_malloc(ctree_mapped)) == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        munmap(base, (size_t) st.st_size);
+        return NULL;
+    }
+
+    map->base           = base;
+    map->length         = (size_t) st.st_size;
+    map->count          = hdr->count;
+    map->recs           = (const _ctree_file_rec*) (hdr + 1);
+    map->data           = (const byte*) (map->recs + map->count);
+    map->compare_key_fn = compare_key_fn;
+
+    // Records are checked once so the lookups can trust them
+    for(ulong i = 0; i < map->count; i++) {
+        const _ctree_file_rec* rec = &map->recs[i];
+
+        if(rec->key_off > hdr->data_size || rec->key_size > hdr->data_size - rec->key_off
+           || rec->value_off > hdr->data_size || rec->value_size > hdr->data_size - rec->value_off
+           || rec->key_off != _CTREE_FILE_ALIGN(rec->key_off) || rec->value_off != _CTREE_FILE_ALIGN(rec->value_off)) {
+            COL_ERROR("ctree file malformed");
+            ctree_mapped_free(map);
+            return NULL;
+        }
+    }
+
+    // Binary search and the build rely on the strictly ascending keys
+    for(ulong i = 1; i < map->count; i++) {
+        if(compare_key_fn(map->data + map->recs[i - 1].key_off, map->data + map->recs[i].key_off) >= 0) {
+            COL_ERROR("ctree file keys out of order");
+            ctree_mapped_free(map);
+            return NULL;
+        }
+    }
+
+    return map;
+}
+
+/*
+ * Binary search over the records (the implicit balanced tree).
+ */
+static const _ctree_file_rec*
+_ctree_mapped_find(const ctree_mapped* map, cconstptr_t key)
+{
+    ulong lo = 0, hi = map->count, mid;
+    int   cmp;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if((cmp = map->compare_key_fn(map->data + map->recs[mid].key_off, key)) == 0)
+            return &map->recs[mid];
+        else if(cmp > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns pointer to the mapped value of the key, NULL if not found.
+ */
+cconstptr_t
+ctree_mapped_entry(const ctree_mapped* map, cconstptr_t key)
+{
+    return_val_if_fail(map != NULL, NULL);
+
+    const _ctree_file_rec* rec = _ctree_mapped_find(map, key);
+
+    return (rec != NULL) ? map->data + rec->value_off : NULL;
+}
+
+/*
+ * Returns pointer to the mapped key, NULL if not found.
+ */
+cconstptr_t
+ctree_mapped_key(const ctree_mapped* map, cconstptr_t key)
+{
+    return_val_if_fail(map != NULL, NULL);
+
+    const _ctree_file_rec* rec = _ctree_mapped_find(map, key);
+
+    return (rec != NULL) ? map->data + rec->key_off : NULL;
+}
+
+ulong
+ctree_mapped_size(const ctree_mapped* map)
+{
+    return_val_if_fail(map != NULL, 0);
+    return map->count;
+}
+
+/*
+ * Stores the 'index'-th (in order) mapped key/value pair into
+ * 'key'/'value' (either one can be NULL).
+ * Returns false if the index is out of bounds.
+ */
+bool
+ctree_mapped_at(const ctree_mapped* map, ulong index, cconstptr_t* key, cconstptr_t* value)
+{
+    return_val_if_fail(map != NULL, false);
+
+    if(index >= map->count) {
+        COL_INDEX_OUT_OF_BOUNDS_ERROR;
+        return false;
+    }
+
+    if(key != NULL)
+        *key = map->data + map->recs[index].key_off;
+    if(value != NULL)
+        *value = map->data + map->recs[index].value_off;
+
+    return true;
+}
+
+/*
+ * Deserializes the mapped element, without the deserializer
+ * the element points into the mapping, empty element is NULL.
+ */
+static cptr_t
+_ctree_deserialize(CDeserializeFn deserializer, const byte* bytes, uint32_t size)
+{
+    if(size == 0)
+        return NULL;
+
+    return (deserializer != NULL) ? deserializer(bytes, size) : (cptr_t) bytes;
+}
+
+/*
+ * Builds the live 'CTREE_DEFAULT' tree out of the mapped records in O(n),
+ * records are already sorted so no key is ever compared.
+ * Returns NULL if the allocation failed.
+ */
+ctree*
+ctree_mapped_build(const ctree_mapped* map,
+                   CDeserializeFn      key_deserializer,
+                   CDeserializeFn      value_deserializer,
+                   CFreeKeyFn          free_key_fn,
+                   CFreeValueFn        free_value_fn)
+{
+    return_val_if_fail(map != NULL, NULL);
+
+    ctree*       tree  = ctree_new(map->compare_key_fn, free_key_fn, free_value_fn, NULL, NULL);
+    ctree_node** nodes = (map->count > 0) ? malloc(map->count * sizeof(ctree_node*)) : NULL;
+    ulong        count = 0;
+
+    if(tree == NULL || (map->count > 0 && nodes == NULL)) {
+        if(tree != NULL)
+            COL_ALLOC_ERROR;
+        free(nodes);
+        free(tree);
+        return NULL;
+    }
+
+    madvise((void*) map->base, map->length, MADV_SEQUENTIAL);
+
+    for(; count < map->count; count++) {
+        const _ctree_file_rec* rec   = &map->recs[count];
+        cptr_t                 key   = _ctree_deserialize(key_deserializer, map->data + rec->key_off, rec->key_size);
+        cptr_t                 value = _ctree_deserialize(value_deserializer, map->data + rec->value_off, rec->value_size);
+
+        if((nodes[count] = _ctreenode_new(tree, key, value, NULL)) == NULL) {
+            if(key != NULL && key_deserializer != NULL && free_key_fn)
+                free_key_fn(key);
+            if(value != NULL && value_deserializer != NULL && free_value_fn)
+                free_value_fn(value);
+
+            while(count > 0)
+                _ctreenode_destroy(tree, nodes[--count]);
+
+            free(nodes);
+            free(tree);
+            return NULL;
+        }
+    }
+
+    if((tree->root = _ctreenode_build(nodes, count)) != NULL)
+        tree->root->parent = NULL;
+
+#ifdef COL_CTREE_THREADED
+    ctree_node* prev = NULL;
+    _ctreenode_rethread(tree->root, &prev);
+#endif
+
+    tree->size = count;
+    free(nodes);
+
+    return tree;
+}
+
+/*
+ * Unmaps the file and frees the 'map'.
+ */
+void
+ctree_mapped_free(ctree_mapped* map)
+{
+    if(map != NULL) {
+        munmap((void*) map->base, map->length);
+        free(map);
     }
-    return node;
 }
 
+//
+//
+//
+//
+/****************************************************************************/
+/*                               FROZEN INDEX                               */
+/****************************************************************************/
+
+/*
+ * Frozen tree keeps its keys in the static B-tree laid out in one array.
+ * Each block holds 'fanout' keys filling a cache line, children of the
+ * block 'k' are the blocks 'k * (fanout + 1) + 1 + i', so the index has
+ * no pointers at all and the search touches one block per level,
+ * log_(fanout + 1) n cache lines instead of log_2 n tree nodes.
+ *
+ * Index holds the key bytes themselves for the inline trees (comparator
+ * never leaves the block), key pointers otherwise, together with the
+ * parallel blocks of the cached key prefixes if the tree has the prefix
+ * function, so most of the comparisons never dereference the key.
+ * Slots past the last key repeat the largest key, 'ranks' map the slots
+ * to the in-order positions of their keys.
+ */
+#define _CFROZEN_LINE 64
+
+struct cfrozen {
+    CCompareKeyFn compare_key_fn;
+    CPrefixKeyFn  prefix_key_fn;
+    CFreeKeyFn    free_key_fn;
+    CFreeValueFn  free_value_fn;
+
+    ulong  size;
+    size_t blocks;
+    size_t stride;
+    uint   fanout;
+    uint   key_size;
+    uint   value_size;
+
+    byte*   index;
+    ulong*  prefixes;
+    uint*   ranks;
+    cptr_t* keys;
+    cptr_t* values;
+    byte*   data;
+};
+
+/*
+ * Returns the key stored in the index 'slot'.
+ */
+static inline cconstptr_t
+_cfrozen_slot_key(const cfrozen* frozen, size_t slot)
+{
+    const byte* record = frozen->index + slot * frozen->stride;
+
+    return (frozen->key_size != 0) ? (cconstptr_t) record : *(cconstptr_t const*) record;
+}
+
+/*
+ * Compares the key in the index 'slot' with the 'key' (its 'prefix').
+ */
+static inline int
+_cfrozen_cmp(const cfrozen* frozen, size_t slot, cconstptr_t key, ulong prefix)
+{
+    if(frozen->prefixes != NULL && frozen->prefixes[slot] != prefix)
+        return (frozen->prefixes[slot] > prefix) ? 1 : -1;
+
+    return frozen->compare_key_fn(_cfrozen_slot_key(frozen, slot), key);
+}
+
+/*
+ * Stores the next key of the in-order 'nodes' into the index 'slot',
+ * once the keys run out the largest key gets repeated.
+ */
+static void
+_cfrozen_place(cfrozen* frozen, size_t slot, ctree_node** nodes, ulong* next)
+{
+    bool        padding = *next == frozen->size;
+    ulong       rank    = padding ? frozen->size - 1 : (*next)++;
+    ctree_node* node    = nodes[rank];
+    byte*       record  = frozen->index + slot * frozen->stride;
+
+    if(frozen->key_size != 0)
+        memcpy(record, node->key, frozen->key_size);
+    else
+        memcpy(record, &node->key, sizeof(cptr_t));
+
+    if(frozen->prefixes != NULL)
+        frozen->prefixes[slot] = _CTREENODE_PREFIX(node);
+
+    frozen->ranks[slot] = (uint) rank;
+
+    if(padding)
+        return;
+
+    frozen->keys[rank] = (frozen->key_size != 0) ? record : node->key;
+
+    if(frozen->key_size == 0) {
+        frozen->values[rank] = node->value;
+    } else if(frozen->value_size != 0) {
+        frozen->values[rank] = frozen->data + rank * _CTREE_INLINE_ALIGN(frozen->value_size);
+        memcpy(frozen->values[rank], node->value, frozen->value_size);
+    } else {
+        frozen->values[rank] = NULL;
+    }
+}
+
+/*
+ * Fills the index in order, block 'block' and its subtrees.
+ */
+static void
+_cfrozen_build(cfrozen* frozen, size_t block, ctree_node** nodes, ulong* next)
+{
+    size_t fanout = frozen->fanout;
+
+    if(block >= frozen->blocks)
+        return;
+
+    for(size_t i = 0; i <= fanout; i++) {
+        _cfrozen_build(frozen, block * (fanout + 1) + 1 + i, nodes, next);
+
+        if(i < fanout)
+            _cfrozen_place(frozen, block * fanout + i, nodes, next);
+    }
+}
+
+/*
+ * Searches for the first key not smaller than the 'key', 'found' tells
+ * if it is equal to the 'key'.
+ * Returns its in-order position, size of the index if there is none.
+ */
+static ulong
+_cfrozen_search(const cfrozen* frozen, cconstptr_t key, bool* found)
+{
+    size_t fanout = frozen->fanout;
+    ulong  prefix = (frozen->prefixes != NULL) ? frozen->prefix_key_fn(key) : 0;
+    size_t slot   = SIZE_MAX;
+    size_t block  = 0;
+    size_t i;
+    int    cmp    = 1;
+
+    *found = false;
+
+    while(block < frozen->blocks) {
+        size_t first = block * fanout;
+
+        for(i = 0; i < fanout && (cmp = _cfrozen_cmp(frozen, first + i, key, prefix)) < 0; i++)
+            ;
+
+        if(i < fanout) {
+            slot = first + i;
+
+            if(cmp == 0) {
+                *found = true;
+                break;
+            }
+        }
+
+        block = block * (fanout + 1) + 1 + i;
+    }
+
+    return (slot != SIZE_MAX) ? frozen->ranks[slot] : frozen->size;
+}
+
+/*
+ * Frees the frozen index, keys/values are left to the caller.
+ */
+static void
+_cfrozen_release(cfrozen* frozen)
+{
+    free(frozen->index);
+    free(frozen->prefixes);
+    free(frozen->ranks);
+    free(frozen->keys);
+    free(frozen->values);
+    free(frozen->data);
+    free(frozen);
+}
+
+/*
+ * Allocates the zeroed 'size' bytes aligned to the cache line.
+ */
+static void*
+_cfrozen_alloc_lines(size_t size)
+{
+    size_t lines = (size + _CFROZEN_LINE - 1) / _CFROZEN_LINE;
+    void*  mem   = (lines != 0) ? aligned_alloc(_CFROZEN_LINE, lines * _CFROZEN_LINE) : NULL;
+
+    if(mem != NULL)
+        memset(mem, 0, lines * _CFROZEN_LINE);
+
+    return mem;
+}
+
+/*
+ * Allocates the frozen index for the 'size' keys of the 'tree',
+ * picking the layout of the index blocks.
+ * Returns NULL if the allocation failed.
+ */
+static cfrozen*
+_cfrozen_new(const ctree* tree, ulong size)
+{
+    cfrozen* frozen = calloc(1, sizeof(cfrozen));
+
+    if(frozen == NULL)
+        return NULL;
+
+    frozen->compare_key_fn = tree->compare_key_fn;
+    frozen->free_key_fn    = tree->free_key_fn;
+    frozen->free_value_fn  = tree->free_value_fn;
+    frozen->size           = size;
+    frozen->key_size       = tree->key_size;
+    frozen->value_size     = tree->value_size;
+    frozen->stride         = sizeof(cptr_t);
+
+    // Inline keys are spaced at their natural alignment
+    if(tree->key_size > 8) {
+        frozen->stride = _CTREE_INLINE_ALIGN(tree->key_size);
+    } else if(tree->key_size != 0) {
+        frozen->stride = 1;
+
+        while(frozen->stride < tree->key_size)
+            frozen->stride <<= 1;
+    }
+
+    frozen->fanout = (frozen->stride < _CFROZEN_LINE) ? (uint) (_CFROZEN_LINE / frozen->stride) : 1;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(tree->prefix_key_fn != NULL) {
+        frozen->prefix_key_fn = tree->prefix_key_fn;
+
+        // Prefix block must fit the cache line as well
+        if(frozen->fanout > _CFROZEN_LINE / sizeof(ulong))
+            frozen->fanout = _CFROZEN_LINE / sizeof(ulong);
+    }
+#endif
+
+    frozen->blocks = (size + frozen->fanout - 1) / frozen->fanout;
+
+    size_t slots = frozen->blocks * frozen->fanout;
+
+    if(size != 0
+       && ((frozen->index = _cfrozen_alloc_lines(slots * frozen->stride)) == NULL
+           || (frozen->prefix_key_fn != NULL && (frozen->prefixes = _cfrozen_alloc_lines(slots * sizeof(ulong))) == NULL)
+           || (frozen->ranks = malloc(slots * sizeof(uint))) == NULL
+           || (frozen->keys = malloc(size * sizeof(cptr_t))) == NULL
+           || (frozen->values = malloc(size * sizeof(cptr_t))) == NULL
+           || (frozen->key_size != 0 && frozen->value_size != 0
+               && (frozen->data = malloc(size * _CTREE_INLINE_ALIGN(frozen->value_size))) == NULL))) {
+        _cfrozen_release(frozen);
+        return NULL;
+    }
+
+    return frozen;
+}
+
+/*
+ * Converts the tree 'treep' points to into the read-only index in O(n),
+ * keys/values (and the free functions) are moved into the index, nodes
+ * are freed. Tree gets consumed, its pointer is nulled.
+ *
+ * Returns NULL if the index could not be allocated (the tree is left
+ * as is) or if the tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+cfrozen*
+ctree_freeze(ctree** treep)
+{
+    ctree* tree;
+    return_val_if_fail(treep != NULL && (tree = *treep) != NULL, NULL);
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't be frozen");
+        return NULL;
+    }
+
+    ulong        size   = ctree_size(tree);
+    ctree_node** nodes  = malloc((size + 1) * sizeof(ctree_node*));
+    cfrozen*     frozen = (nodes != NULL) ? _cfrozen_new(tree, size) : NULL;
+    ulong        next   = 0;
+    size_t       count  = 0;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(frozen == NULL, 0)) {
+#else
+    if(frozen == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        free(nodes);
+        return NULL;
+    }
+
+    _ctreenode_flatten(tree->root, nodes, &count);
+    _cfrozen_build(frozen, 0, nodes, &next);
+
+    // Pairs now belong to the index
+    for(size_t i = 0; i < count; i++)
+        _ctreenode_free(tree, nodes[i]);
+
+    free(nodes);
+    ctree_drop(treep, true);
+
+    return frozen;
+}
+
+/*
+ * Returns pointer to the value of the key, NULL if the key
+ * is not inside the index.
+ */
+cptr_t
+cfrozen_get(const cfrozen* frozen, cconstptr_t key)
+{
+    return_val_if_fail(frozen != NULL && key != NULL, NULL);
+
+    bool  found;
+    ulong rank = _cfrozen_search(frozen, key, &found);
+
+    return found ? frozen->values[rank] : NULL;
+}
+
+/*
+ * Returns the in-order position of the first key not smaller
+ * than the 'key', size of the index if there is none.
+ */
+ulong
+cfrozen_lower_bound(const cfrozen* frozen, cconstptr_t key)
+{
+    return_val_if_fail(frozen != NULL && key != NULL, 0);
+
+    bool found;
+
+    return _cfrozen_search(frozen, key, &found);
+}
+
+ulong
+cfrozen_size(const cfrozen* frozen)
+{
+    return_val_if_fail(frozen != NULL, 0);
+    return frozen->size;
+}
+
+/*
+ * Stores the 'index'-th (in order) key/value into 'key'/'value'
+ * (either one can be NULL).
+ * Returns false if the index is out of bounds.
+ */
+bool
+cfrozen_at(const cfrozen* frozen, ulong index, cconstptr_t* key, cptr_t* value)
+{
+    return_val_if_fail(frozen != NULL && index < frozen->size, false);
+
+    if(key != NULL)
+        *key = frozen->keys[index];
+
+    if(value != NULL)
+        *value = frozen->values[index];
+
+    return true;
+}
+
+/*
+ * Frees the index together with the keys/values
+ * (using the free functions of the frozen tree).
+ */
+void
+cfrozen_free(cfrozen* frozen)
+{
+    if(frozen == NULL)
+        return;
+
+    if(frozen->key_size == 0) {
+        for(ulong i = 0; i < frozen->size; i++) {
+            if(frozen->free_key_fn)
+                frozen->free_key_fn(frozen->keys[i]);
+
+            if(frozen->free_value_fn)
+                frozen->free_value_fn(frozen->values[i]);
+        }
+    }
+
+    _cfrozen_release(frozen);
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                               COMPACTION                                 */
+/****************************************************************************/
+
+/*
+ * Compaction relocates the nodes into one cache line aligned block
+ * ('_ctree_arena') so the nodes visited together are close in memory.
+ * Node is moved one at a time in O(1), its neighbours (parent, children,
+ * threads) get relinked to the new address and the old node is released.
+ *
+ * 'ctree_compact' lays the whole tree out in the van Emde Boas order,
+ * top half of the levels first and then each of the subtrees hanging
+ * below it the same way, so every path from the root touches O(log_B n)
+ * blocks of B nodes for any block size.
+ * Incremental 'ctree_compact_step' can't keep the vEB order while the
+ * tree changes between the steps, instead it walks the tree in pre-order
+ * from the cursor ('compact'), which keeps every node next to its left
+ * subtree. Nodes the walk misses because of the rotations in between are
+ * simply left where they are.
+ *
+ * Nodes in the block can't be handed over to the other tree, operations
+ * that do so (split, join, set operations, consuming iterator) move them
+ * back into their own allocations first ('_ctree_evacuate').
+ */
+
+/*
+ * Returns the bytes taken by the node of the 'tree' (with the inline key/value).
+ */
+static inline size_t
+_ctreenode_bytes(const ctree* tree)
+{
+    size_t size = sizeof(ctree_node);
+
+    if(_CTREE_INLINE(tree))
+        size += _CTREE_INLINE_ALIGN(tree->key_size) + tree->value_size;
+
+    return size;
+}
+
+/*
+ * Moves the 'node' into the 'dest' relinking its neighbours,
+ * old node is released.
+ * Returns the node at its new address.
+ */
+static ctree_node*
+_ctreenode_move(ctree* tree, ctree_node* node, ctree_node* dest)
+{
+    memcpy(dest, node, _ctreenode_bytes(tree));
+
+    if(_CTREE_INLINE(tree)) {
+        dest->key = (byte*) dest + ((byte*) node->key - (byte*) node);
+
+        if(node->value != NULL)
+            dest->value = (byte*) dest + ((byte*) node->value - (byte*) node);
+    }
+
+    if(tree->cache != NULL)
+        _ctree_cache_forget(tree, dest->key, node);
+
+    *_ctreenode_slot(tree, node) = dest;
+
+    if(dest->left != NULL)
+        dest->left->parent = dest;
+    if(dest->right != NULL)
+        dest->right->parent = dest;
+
+#ifdef COL_CTREE_THREADED
+    if(dest->prev != NULL)
+        dest->prev->next = dest;
+    if(dest->next != NULL)
+        dest->next->prev = dest;
+#endif
+
+    if(tree->finger == node)
+        tree->finger = dest;
+    if(tree->min == node)
+        tree->min = dest;
+    if(tree->max == node)
+        tree->max = dest;
+
+    _ctreenode_free(tree, node);
+
+    return dest;
+}
+
+/*
+ * Starts the new block for 'capacity' nodes of the 'tree'.
+ * Returns NULL if the block could not be allocated.
+ */
+static _ctree_arena*
+_ctree_arena_new(ctree* tree, size_t capacity)
+{
+    _ctree_arena* arena  = memc_malloc(_ctree_arena);
+    size_t        stride = _CTREE_INLINE_ALIGN(_ctreenode_bytes(tree));
+    size_t        bytes  = (capacity * stride + 63) & ~(size_t) 63;
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(arena == NULL || (arena->base = aligned_alloc(64, bytes)) == NULL, 0)) {
+#else
+    if(arena == NULL || (arena->base = aligned_alloc(64, bytes)) == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        free(arena);
+        return NULL;
+    }
+
+    arena->stride   = stride;
+    arena->capacity = capacity;
+    arena->used     = 0;
+    arena->live     = 0;
+    arena->next     = tree->arena;
+    tree->arena     = arena;
+
+    return arena;
+}
+
+/*
+ * Takes the next free slot of the block.
+ */
+static inline ctree_node*
+_ctree_arena_take(_ctree_arena* arena)
+{
+    arena->live++;
+    return (ctree_node*) (arena->base + arena->used++ * arena->stride);
+}
+
+/*
+ * Returns the pre-order successor of the 'node'.
+ */
+static ctree_node*
+_ctreenode_preorder_next(ctree_node* node)
+{
+    if(node->left != NULL)
+        return node->left;
+
+    if(node->right != NULL)
+        return node->right;
+
+    for(; node->parent != NULL; node = node->parent)
+        if(node->parent->left == node && node->parent->right != NULL)
+            return node->parent->right;
+
+    return NULL;
+}
+
+/*
+ * Moves all the nodes of the 'tree' back into their own allocations,
+ * so they can be handed over to the other tree.
+ * Returns false if some node could not be allocated.
+ */
+static bool
+_ctree_evacuate(ctree* tree)
+{
+    ctree_node* dest;
+
+    if(tree->arena == NULL)
+        return true;
+
+    tree->compact = NULL;
+
+    for(ctree_node* node = tree->root; node != NULL; node = _ctreenode_preorder_next(node)) {
+        for(_ctree_arena* arena = tree->arena; arena != NULL; arena = arena->next) {
+            if(_ctree_arena_holds(arena, node)) {
+                if((dest = _ctreenode_alloc(tree)) == NULL) {
+                    COL_ALLOC_ERROR;
+                    return false;
+                }
+
+                node = _ctreenode_move(tree, node, dest);
+                break;
+            }
+        }
+    }
+
+    _ctree_arena_prune(tree, true);
+
+    return true;
+}
+
+/*
+ * Returns the depth (number of the levels) of the subtree.
+ */
+static uint
+_ctreenode_depth(const ctree_node* node)
+{
+    if(node == NULL)
+        return 0;
+
+    uint left  = _ctreenode_depth(node->left);
+    uint right = _ctreenode_depth(node->right);
+
+    return ((left > right) ? left : right) + 1;
+}
+
+static void
+_ctreenode_veb_layout(ctree_node* node, uint levels, ctree_node** nodes, size_t* count);
+
 /*
- * Finds the max key value in the left subtree
- * of the passed in 'CTreeNode'
+ * Lays out the subtrees hanging 'down' levels below the 'node',
+ * each one 'levels' levels deep, left to right.
  */
-static ctree_node*
-_ctreenode_find_right(ctree_node* node)
+static void
+_ctreenode_veb_bottoms(ctree_node* node, uint down, uint levels, ctree_node** nodes, size_t* count)
 {
-    while(node->left != NULL)
-        node = node->left;
+    if(node == NULL)
+        return;
 
-    return node;
+    if(down == 0) {
+        _ctreenode_veb_layout(node, levels, nodes, count);
+    } else {
+        _ctreenode_veb_bottoms(node->left, down - 1, levels, nodes, count);
+        _ctreenode_veb_bottoms(node->right, down - 1, levels, nodes, count);
+    }
 }
 
 /*
- * Finds the min key value in the right subtree
- * of the passed in 'CTreeNode'
+ * Appends the top 'levels' levels of the subtree to the 'nodes'
+ * in the van Emde Boas order.
  */
-static ctree_node*
-_ctreenode_find_left(ctree_node* node)
+static void
+_ctreenode_veb_layout(ctree_node* node, uint levels, ctree_node** nodes, size_t* count)
 {
-    while(node->right != NULL)
-        node = node->right;
+    if(node == NULL || levels == 0)
+        return;
 
-    return node;
+    if(levels == 1) {
+        nodes[(*count)++] = node;
+        return;
+    }
+
+    uint top = levels / 2;
+
+    _ctreenode_veb_layout(node, top, nodes, count);
+    _ctreenode_veb_bottoms(node, top, levels - top, nodes, count);
 }
 
 /*
- * Internal recursive BST insertion function.
- * It updates the node parameters and does the
- * recursive tree rebalancing.
+ * Relocates all the nodes of the 'tree' into one contiguous block laid
+ * out in the van Emde Boas order, lookups and in-order walks then touch
+ * about as few cache lines (and pages) as in the freshly built tree.
+ * Pointers to the nodes (iterators, hints) are invalidated.
+ *
+ * Returns false if the block could not be allocated (tree is left as is)
+ * or if the tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
  */
-static ctree_node*
-_ctreenode_insert(ctree*      tree,
-                  ctree_node* parent,
-                  ctree_node* node,
-                  cptr_t      key,
-                  cptr_t      value,
-                  bool        replace)
+bool
+ctree_compact(ctree* tree)
 {
-    int cmp;
+    return_val_if_fail(tree != NULL, false);
 
-#ifndef COL_MEMORY_CONSTRAINED
-    if(node == NULL && __builtin_expect((node = _ctreenode_new(key, value, parent)) != NULL, 1)) {
-#else
-    if(node == NULL && (node = ctreenode_new(key, value)) != NULL) {
-#endif
-        tree->size++;
-        tree->flags |= INSERTED;
-    } else if((cmp = tree->compare_key_fn(node->key, key)) > 0) {
-        node->left = _ctreenode_insert(tree, node, node->left, key, value, replace);
-    } else if(cmp < 0) {
-        node->right = _ctreenode_insert(tree, node, node->right, key, value, replace);
-    } else {
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't be compacted");
+        return false;
+    }
 
-        if(tree->free_value_fn)
-            tree->free_value_fn(node->value);
+    tree->compact = NULL;
+    _ctree_arena_prune(tree, false);
 
-        node->value = value;
+    if(tree->root == NULL)
+        return true;
 
-        if(replace) {
-            tree->flags |= REPLACED;
+    size_t        size  = ctree_size(tree);
+    ctree_node**  nodes = malloc(size * sizeof(ctree_node*));
+    _ctree_arena* arena = (nodes != NULL) ? _ctree_arena_new(tree, size) : NULL;
+    size_t        count = 0;
 
-            if(tree->free_key_fn)
-                tree->free_key_fn(node->key);
+    if(arena == NULL) {
+        if(nodes == NULL)
+            COL_ALLOC_ERROR;
 
-            node->key = key;
-        }
+        free(nodes);
+        return false;
     }
 
-    if(tree->flags & INSERTED) {
-        _ctreenode_update(node);
-        return _ctreenode_rebalance(node);
+    // Splay tree can be too deep for the recursive layout
+    if(tree->policy == CTREE_SPLAY) {
+        for(ctree_node* node = tree->root; node != NULL; node = _ctreenode_preorder_next(node))
+            nodes[count++] = node;
+    } else {
+        _ctreenode_veb_layout(tree->root, _ctreenode_depth(tree->root), nodes, &count);
     }
 
-    return node;
+    for(size_t i = 0; i < count; i++)
+        _ctreenode_move(tree, nodes[i], _ctree_arena_take(arena));
+
+    free(nodes);
+
+    return true;
 }
 
 /*
- * Recursively searches for the key, if the key is found
- * remove it, check if the 'CFreeKeyFn' is present, if
- * it is call the function on the key, freeing it.
- * If the 'CFreeValueFn' is present call it on the value,
- * freeing it.
- * If either one or both of the functions are not present,
- * then the user is responsible for freeing the value and/or key.
+ * Incremental 'ctree_compact', relocates at most 'budget' nodes per call
+ * so the compaction can run in bounded time slices in between the other
+ * operations on the tree. Pass starts with the new block sized for the
+ * whole tree and walks the tree in pre-order, nodes inserted meanwhile
+ * may be left out.
+ * Pointers to the nodes (iterators, hints) are invalidated by each call.
+ *
+ * Returns true if the pass is not done yet, false once it is done
+ * (next call starts the new pass) or if it could not be started.
  */
-static ctree_node*
-_ctreenode_remove(ctree* tree, ctree_node* node, cptr_t key, bool return_ele)
+bool
+ctree_compact_step(ctree* tree, ulong budget)
 {
-    if(node == NULL)
-        return NULL;
+    return_val_if_fail(tree != NULL, false);
 
-    int cmp = tree->compare_key_fn(node->key, key);
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't be compacted");
+        return false;
+    }
 
-    if(cmp > 0) {
-        node->left = _ctreenode_remove(tree, node->left, key, return_ele);
-    } else if(cmp < 0) {
-        node->right = _ctreenode_remove(tree, node->right, key, return_ele);
-    } else {
-        ctree_node* temp;
+    _ctree_arena* arena = tree->arena;
+    ctree_node*   node;
 
-        if(node->right == NULL || node->left == NULL) {
-            temp = (node->right != NULL) ? node->right : node->left;
+    if(tree->compact == NULL) {
+        _ctree_arena_prune(tree, false);
 
-            // If we freed the value in some recursion call
-            // before this one, then don't try to free again!
-            if(!(tree->flags & REMOVED)) {
-                (tree->free_key_fn) ? tree->free_key_fn(node->key) : 0;
-                (tree->free_value_fn) ? tree->free_value_fn(node->value) : 0;
-                tree->flags |= REMOVED;
-            }
+        if(tree->root == NULL || (arena = _ctree_arena_new(tree, ctree_size(tree))) == NULL)
+            return false;
 
-            ctree_node_drop(&node);
+        tree->compact = tree->root;
+    }
 
-            tree->size--;
+    for(; budget > 0 && (node = tree->compact) != NULL; budget--) {
+        if(arena->used == arena->capacity) {
+            tree->compact = NULL;
+            break;
+        }
 
-            if(temp == NULL)
-                return NULL;
-            else
-                return temp;
+        if(!_ctree_arena_holds(arena, node))
+            node = _ctreenode_move(tree, node, _ctree_arena_take(arena));
 
-        } else {
-            if(tree->free_key_fn)
-                tree->free_key_fn(node->key);
+        tree->compact = _ctreenode_preorder_next(node);
+    }
 
-            if(tree->free_value_fn)
-                tree->free_value_fn(node->value);
+    if(tree->compact != NULL)
+        return true;
 
-            // Set the flag so we can check in the upper case
-            // if the flag is set, so we don't free the value
-            // that will get assigned to this current node
-            tree->flags |= REMOVED;
-
-            if(node->left->height > node->right->height) {
-                temp        = _ctreenode_find_left(node->left);
-                node->key   = temp->key;
-                node->value = temp->value;
-                node->left  = _ctreenode_remove(tree, node->left, node->key, return_ele);
-            } else {
-                temp        = _ctreenode_find_right(node->right);
-                node->key   = temp->key;
-                node->value = temp->value;
-                node->right = _ctreenode_remove(tree, node->right, node->key, return_ele);
-            }
+    // Block is not being filled anymore
+    _ctree_arena_prune(tree, false);
+
+    return false;
+}
+
+//
+//
+//
+//
+/****************************************************************************/
+/*                              LOOKUP CACHE                                */
+/****************************************************************************/
+
+/*
+ * Enables the cache of the hot keys with room for 'slots' nodes (rounded
+ * up to the power of two), the nodes found by 'ctree_entry'/'ctree_key'
+ * are remembered by the 'hash_fn' of their key, so the repeated lookup
+ * of the cached key costs a single 'CCompareKeyFn' call instead of
+ * the whole descent. Removal (or replacement) of the key drops its node
+ * from the cache, bulk operations clear the whole cache.
+ * Existing cache (and its counters) is replaced, 0 'slots' disables it.
+ *
+ * Lookups update the cache, readers running concurrently must use
+ * 'ctree_peek' instead.
+ * Returns false if the cache could not be allocated or if the tree
+ * is 'CTREE_CONCURRENT' or 'CTREE_PERSISTENT'.
+ */
+bool
+ctree_cache_enable(ctree* tree, CHashKeyFn hash_fn, uint slots)
+{
+    return_val_if_fail(tree != NULL && (slots == 0 || hash_fn != NULL), false);
+
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't cache the lookups");
+        return false;
+    }
+
+    _ctree_cache* cache = NULL;
+    ulong         sets  = 1;
+
+    if(slots != 0) {
+        while(2 * sets < slots)
+            sets <<= 1;
+
+        cache = memc_malloc(_ctree_cache);
+
+#ifndef COL_MEMORY_CONSTRAINED
+        if(__builtin_expect(cache == NULL || (cache->ways = calloc(2 * sets, sizeof(_ctree_cache_way))) == NULL, 0)) {
+#else
+        if(cache == NULL || (cache->ways = calloc(2 * sets, sizeof(_ctree_cache_way))) == NULL) {
+#endif
+            COL_ALLOC_ERROR;
+            free(cache);
+            return false;
         }
+
+        cache->hash_fn = hash_fn;
+        cache->mask    = sets - 1;
+        cache->hits    = 0;
+        cache->misses  = 0;
     }
 
-    // During traceback only update if we removed the node
-    if(tree->flags & REMOVED) {
-        _ctreenode_update(node);
-        return _ctreenode_rebalance(node);
+    if(tree->cache != NULL) {
+        free(tree->cache->ways);
+        free(tree->cache);
     }
 
-    return node;
+    tree->cache = cache;
+
+    return true;
 }
 
 /*
- * CTree recursive BST insertion function
- * Returns false if no insertion occured,
- * meaning either tree is NULL or the same key
- * was already in the tree, and only the value got
- * updated, but the key was not inserted.
- *
- * together with the value, returning true.
- * If the key was not found then the key is inserted
+ * Stores the number of the lookups answered by the cache into 'hits' and
+ * the number of the lookups that had to descend into 'misses' (either
+ * one can be NULL), both are 0 if the cache is not enabled.
  */
-bool
-ctree_insert(ctree* tree, cptr_t key, cptr_t value)
+void
+ctree_cache_stats(const ctree* tree, ulong* hits, ulong* misses)
 {
-    return_val_if_fail(tree != NULL, false);
+    const _ctree_cache* cache = (tree != NULL) ? tree->cache : NULL;
 
-    tree->root = _ctreenode_insert(tree, NULL, tree->root, key, value, false);
+    if(hits != NULL)
+        *hits = (cache != NULL) ? cache->hits : 0;
+    if(misses != NULL)
+        *misses = (cache != NULL) ? cache->misses : 0;
+}
 
-    if(tree->flags & INSERTED) {
-        tree->flags &= ~(COL_BYTE | INSERTED);
-        return true;
+//
+//
+//
+//
+/****************************************************************************/
+/*                              SHARDED TREE                                */
+/****************************************************************************/
+
+/*
+ * Keys of the 'ctree_sharded' are partitioned by their hash across the
+ * independent 'CTREE_DEFAULT' trees (shards), each one guarded by its own
+ * lock, writers of the different shards never contend.
+ * Shards recycle the removed nodes through their own pool and publish
+ * their size into the relaxed counter read by 'ctree_sharded_size'.
+ * Shard is cache line aligned so the locks of the neighbours don't share
+ * the line.
+ */
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    ctree*                       tree;
+    _ctree_pool                  pool;
+    atomic_ulong                 size;
+} _ctree_shard;
+
+struct ctree_sharded {
+    CCompareKeyFn compare_key_fn;
+    CHashKeyFn    hash_key_fn;
+    uint          count;
+    _ctree_shard* shards;
+};
+
+/*
+ * Merge iterator keeps the current node of every shard, shards are kept
+ * in the min-heap ordered by the key of their current node.
+ */
+struct ctree_sharded_iter {
+    const ctree_sharded* map;
+    uint                 count;
+    uint*                heap;
+    ctree_node**         heads;
+    ctree_iter*          iters;
+};
+
+/*
+ * Returns the shard of the 'key', hash gets mixed first so the
+ * weak hash functions still spread the keys evenly.
+ */
+static inline _ctree_shard*
+_ctree_shard_of(const ctree_sharded* map, cconstptr_t key)
+{
+    ulong hash = map->hash_key_fn(key);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+
+    return &map->shards[hash % map->count];
+}
+
+/*
+ * Releases the shards '[0, count)' of the 'map', nodes go through
+ * the free functions of the shard trees.
+ */
+static void
+_ctree_sharded_release(ctree_sharded* map, uint count)
+{
+    ctree_node*   node;
+    _ctree_shard* shard;
+
+    for(uint i = 0; i < count; i++) {
+        shard = &map->shards[i];
+
+        shard->tree->pool = NULL;
+        ctree_free(shard->tree);
+
+        while((node = shard->pool.head) != NULL) {
+            shard->pool.head = node->right;
+            free(node);
+        }
+
+        pthread_mutex_destroy(&shard->lock);
     }
 
-    return false;
+    free(map->shards);
+    free(map);
 }
 
 /*
- * Replaces the key in the tree with the provided key.
- * Returns false if no insertion occured,
- * meaning either tree is NULL or the key was not found.
- * If the key was found then the value gets updated and
- * old one gets freed if the 'CFreeValueFn' is present.
- * Old key gets replaced with the new key and freed if the
- * 'CFreeKeyFn' is present.
+ * Constructs the ordered map partitioned across 'shards' trees
+ * (number of the online processors if 0).
+ * 'compare_key_fn' and 'hash_key_fn' are required.
  */
-bool
-ctree_replace(ctree* tree, cptr_t key, cptr_t value)
+ctree_sharded*
+ctree_sharded_new(CCompareKeyFn compare_key_fn,
+                  CFreeKeyFn    free_key_fn,
+                  CFreeValueFn  free_value_fn,
+                  CHashKeyFn    hash_key_fn,
+                  uint          shards)
 {
-    return_val_if_fail(tree != NULL, false);
+    ctree_sharded* map;
+    uint           i;
 
-    tree->root = _ctreenode_insert(tree, NULL, tree->root, key, value, true);
+    if(compare_key_fn == NULL || hash_key_fn == NULL) {
+        COL_INVALID_CMPFN_ERROR;
+        return NULL;
+    }
 
-    if(tree->flags & REPLACED) {
-        tree->flags &= ~(COL_BYTE | REPLACED);
-        return true;
+    if(shards == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shards    = (cpus > 0) ? (uint) cpus : 1;
     }
 
-    return false;
+    map = memc_malloc(ctree_sharded);
+
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(map == NULL || (map->shards = aligned_alloc(64, shards * sizeof(_ctree_shard))) == NULL, 0)) {
+#else
+    if(map == NULL || (map->shards = aligned_alloc(64, shards * sizeof(_ctree_shard))) == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        free(map);
+        return NULL;
+    }
+
+    map->compare_key_fn = compare_key_fn;
+    map->hash_key_fn    = hash_key_fn;
+    map->count          = shards;
+
+    for(i = 0; i < shards; i++) {
+        _ctree_shard* shard = &map->shards[i];
+
+        if((shard->tree = ctree_new(compare_key_fn, free_key_fn, free_value_fn, NULL, NULL)) == NULL) {
+            _ctree_sharded_release(map, i);
+            return NULL;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->pool.head  = NULL;
+        shard->pool.size  = 0;
+        shard->tree->pool = &shard->pool;
+        atomic_init(&shard->size, 0);
+    }
+
+    return map;
 }
 
 /*
- * Removes the given key from the tree.
- * If the key was found and removed it returns true.
- * If no matching key was found and no removal occured
- * returns false.
- * Additionally if tree or key are invalid (NULL) it
- * returns false.
+ * Inserts the key/value pair into the shard of the 'key', same as
+ * 'ctree_insert' safe to call from any number of threads at once.
+ * Returns true if the key got inserted.
  */
 bool
-ctree_remove(ctree* tree, cptr_t key, bool return_ele)
+ctree_sharded_insert(ctree_sharded* map, cptr_t key, cptr_t value)
 {
-    return_val_if_fail((tree != NULL && key != NULL), false);
+    return_val_if_fail(map != NULL && key != NULL, false);
 
-    tree->root = _ctreenode_remove(tree, tree->root, key, return_ele);
+    _ctree_shard* shard = _ctree_shard_of(map, key);
+    bool          inserted;
 
-    if(tree->flags & REMOVED) {
-        tree->flags &= ~(COL_BYTE | REMOVED);
-        return true;
-    } else
-        return false;
+    pthread_mutex_lock(&shard->lock);
+    inserted = ctree_insert(shard->tree, key, value);
+    atomic_store_explicit(&shard->size, shard->tree->size, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
+
+    return inserted;
 }
 
 /*
- * Internal function, tries to find the key in tree.
- * Returns NULL if key was not found or the pointer
- * to the key if it was found.
+ * Removes the 'key' from its shard, same as 'ctree_remove'.
+ * Returns true if the key got removed.
  */
-cptr_t
-_ctreenode_find(ctree* tree, cptr_t key)
+bool
+ctree_sharded_remove(ctree_sharded* map, cptr_t key)
 {
-    return_val_if_fail(tree != NULL, NULL);
+    return_val_if_fail(map != NULL && key != NULL, false);
 
-    int         cmp;
-    ctree_node* current = tree->root;
+    _ctree_shard* shard = _ctree_shard_of(map, key);
+    bool          removed;
 
-    while(current != NULL) {
-        if((cmp = tree->compare_key_fn(current->key, key)) == 0) {
-            return current;
-        } else if(cmp > 0)
-            current = current->left;
-        else
-            current = current->right;
-    }
+    pthread_mutex_lock(&shard->lock);
+    removed = ctree_remove(shard->tree, key, false);
+    atomic_store_explicit(&shard->size, shard->tree->size, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
 
-    return NULL;
+    return removed;
 }
 
 /*
- * Returns pointer to the value of the key/value pair.
- * Returns NULL if key is not inside the tree.
+ * Returns the value of the 'key', NULL if it is not inside the map.
+ * Value stays valid only until the key gets removed.
  */
 cptr_t
-ctree_entry(ctree* tree, cptr_t key)
+ctree_sharded_entry(ctree_sharded* map, cptr_t key)
 {
-    return_val_if_fail(tree != NULL, NULL);
+    return_val_if_fail(map != NULL && key != NULL, NULL);
 
-    ctree_node* entry;
+    _ctree_shard* shard = _ctree_shard_of(map, key);
+    cptr_t        value;
 
-    if((entry = _ctreenode_find(tree, key)) != NULL)
-        return entry->value;
+    pthread_mutex_lock(&shard->lock);
+    value = ctree_entry(shard->tree, key);
+    pthread_mutex_unlock(&shard->lock);
 
-    return NULL;
+    return value;
 }
 
-/*
- * Returns pointer to the key of the key/value pair.
- * Returns NULL if key is not inside the tree.
+/*
+ * Returns the number of the keys, sum of the shard counters read without
+ * synchronization, exact only once the writers are done.
  */
-cptr_t
-ctree_key(ctree* tree, cptr_t key)
+ulong
+ctree_sharded_size(const ctree_sharded* map)
 {
-    return_val_if_fail(tree != NULL, NULL);
+    return_val_if_fail(map != NULL, 0);
 
-    ctree_node* entry;
+    ulong size = 0;
 
-    if((entry = _ctreenode_find(tree, key)) != NULL)
-        return entry->key;
+    for(uint i = 0; i < map->count; i++)
+        size += atomic_load_explicit(&map->shards[i].size, memory_order_relaxed);
 
-    return NULL;
+    return size;
 }
 
 /*
- * Returns the total node count in the CTree.
+ * Frees all the shards, no other thread can access the 'map' anymore.
  */
-uint
-ctree_size(ctree* tree)
+void
+ctree_sharded_free(ctree_sharded* map)
 {
-    return tree->size;
+    if(map != NULL)
+        _ctree_sharded_release(map, map->count);
 }
 
 /*
- * Returns the total size of the CTree (size of all nodes) in bytes.
- * This represents only the size of nodes not the actual allocation size of
- * key and value pairs (if they are malloc'ed).
+ * Returns true if the current node of the shard 'a' orders before the one of the shard 'b'.
  */
-size_t
-ctree_size_bytes(ctree* tree)
+static inline bool
+_ctree_sharded_iter_less(const ctree_sharded_iter* iter, uint a, uint b)
 {
-    return tree->size * sizeof(ctree_node);
+    return iter->map->compare_key_fn(iter->heads[a]->key, iter->heads[b]->key) < 0;
 }
 
 /*
- * Drops the 'ctree' freeing the wrapper, but the nodes are not freed.
- * Pointer to the wrapper also gets nulled.
+ * Restores the heap order moving the shard at the 'at' down.
  */
-void
-ctree_drop(ctree** treep, bool free_tree)
+static void
+_ctree_sharded_iter_sift(ctree_sharded_iter* iter, uint at)
 {
-    ctree* tree;
-    if(treep != NULL && (tree = *treep) != NULL) {
-        tree->root  = NULL;
-        tree->size  = 0;
-        tree->flags = COL_BYTE;
-        *treep      = NULL;
-        if(free_tree)
-            free(tree);
+    uint child;
+    uint shard = iter->heap[at];
+
+    while((child = 2 * at + 1) < iter->count) {
+        if(child + 1 < iter->count && _ctree_sharded_iter_less(iter, iter->heap[child + 1], iter->heap[child]))
+            child++;
+
+        if(!_ctree_sharded_iter_less(iter, iter->heap[child], shard))
+            break;
+
+        iter->heap[at] = iter->heap[child];
+        at             = child;
     }
+
+    iter->heap[at] = shard;
 }
 
 /*
- * Finds the smallest node given the root 'node'.
+ * Creates the iterator merging the shards of the 'map' in order,
+ * each step costs O(log shards) comparisons.
+ * Map must not be modified while it is being iterated.
  */
-static ctree_node*
-_ctree_min(const ctree_node* node)
+ctree_sharded_iter*
+ctree_sharded_iter_new(ctree_sharded* map)
 {
-    return_val_if_fail(node != NULL, NULL);
+    return_val_if_fail(map != NULL, NULL);
 
-    while(node->left != NULL)
-        node = node->left;
+    uint                count = map->count;
+    ctree_sharded_iter* iter  = malloc(sizeof(ctree_sharded_iter)
+                                      + count * (sizeof(uint) + sizeof(ctree_node*) + sizeof(ctree_iter)));
 
-    return (ctree_node*) node;
+#ifndef COL_MEMORY_CONSTRAINED
+    if(__builtin_expect(iter == NULL, 0)) {
+#else
+    if(iter == NULL) {
+#endif
+        COL_ALLOC_ERROR;
+        return NULL;
+    }
+
+    iter->map   = map;
+    iter->count = 0;
+    iter->iters = (ctree_iter*) (iter + 1);
+    iter->heads = (ctree_node**) (iter->iters + count);
+    iter->heap  = (uint*) (iter->heads + count);
+
+    for(uint i = 0; i < count; i++) {
+        iter->iters[i] = ctree_iter_new(map->shards[i].tree);
+
+        if((iter->heads[i] = ctree_iter_next(&iter->iters[i])) != NULL)
+            iter->heap[iter->count++] = i;
+    }
+
+    for(uint i = iter->count / 2; i-- > 0;)
+        _ctree_sharded_iter_sift(iter, i);
+
+    return iter;
 }
 
 /*
- * Finds the largest node given the root 'node'.
+ * Returns the next node in order, NULL once all the shards are exhausted.
  */
-static ctree_node*
-_ctree_max(const ctree_node* node)
+ctree_node*
+ctree_sharded_iter_next(ctree_sharded_iter* iter)
 {
-    return_val_if_fail(node != NULL, NULL);
+    return_val_if_fail(iter != NULL && iter->count > 0, NULL);
 
-    while(node->right != NULL)
-        node = node->right;
+    uint        shard = iter->heap[0];
+    ctree_node* node  = iter->heads[shard];
 
-    return (ctree_node*) node;
+    if((iter->heads[shard] = ctree_iter_next(&iter->iters[shard])) == NULL)
+        iter->heap[0] = iter->heap[--iter->count];
+
+    _ctree_sharded_iter_sift(iter, 0);
+
+    return node;
+}
+
+void
+ctree_sharded_iter_free(ctree_sharded_iter* iter)
+{
+    free(iter);
 }
 
 //
@@ -698,75 +6837,64 @@ _ctree_max(const ctree_node* node)
 /****************************************************************************/
 
 /*
- * Private enum used in simple algorithm for traversing the tree.
- *
- * 'UP' is set each time if starting from 'start' (front) when 'node' is part
- * of the right subtree and the next successor is its 'parent' node.
- * 'UP' is also set each time when starting from 'end' (back) when 'node' is
- * part of the left subtree and the next successor is its 'parent' node.
- * This prevents cycles.
+ * Finds the next node in order.
  *
- * 'RESET' is set in every other case, for example if we are iterating from
- * start (front) and the node was part of the left subtree and its successor
- * is its parent.
- */
-typedef enum _ctree_iter_state {
-    UP,
-    RESET,
-} _ctree_iter_state;
-
-/*
- * Check function definition below for info.
+ * In threaded builds this is just the 'next' link.
+ * Otherwise it returns minimum of the right subtree, if right child
+ * node is NULL then it climbs through the 'parent' links for as long
+ * as the 'node' is the right child of its parent, the first parent
+ * reached from the left side is the successor.
+ * Whether the 'node' is the right child is answered by comparing the
+ * pointers, keys are never compared.
  */
 static ctree_node*
-_ctree_node_next(const ctree_node* node, _ctree_iter_state* state, CCompareKeyFn key_cmp_fn);
+_ctree_node_next(const ctree_node* node)
+{
+    return_val_if_fail(node != NULL, NULL);
 
-/*
- * Check function definition below for info.
- */
-static ctree_node*
-_ctree_node_prev(const ctree_node* node, _ctree_iter_state* state, CCompareKeyFn key_cmp_fn);
+#ifdef COL_CTREE_THREADED
+    return node->next;
+#else
+    if(node->right != NULL)
+        return _ctree_min(node->right);
 
-/*
- * This private struct holds iteration state for both the 'start' and 'end'.
- * Meaning that calling 'ctree_iter_next' and 'ctree_iter_next_back' won't mix
- * their states together instead they each have their own state.
- */
-typedef struct {
-    _ctree_iter_state start;
-    _ctree_iter_state end;
-} _ctree_iter_states;
+    ctree_node* parent = node->parent;
 
-/*
- * Default initializator of '_ctree_iter_states' struct.
- * Both states are set to 'RESET' for obvious reasons.
- */
-_ctree_iter_states
-_ctree_iter_states_default(void)
-{
-    return (_ctree_iter_states) {
-        .start = RESET,
-        .end   = RESET,
-    };
+    while(parent != NULL && parent->right == node) {
+        node   = parent;
+        parent = parent->parent;
+    }
+
+    return parent;
+#endif
 }
 
 /*
- * Bi-directional Non-consuming iterator.
- * Nodes having 'parent' member is what allows this iterator to have O(1) space
- * complexity and O(1) time complexity when fetching next node.
+ * Finds the previous node in order.
  *
- * Note:
- * 'CCompareKeyFn' is also part of the algorithm for traversing our iterator,
- * it is used in case where we compare our nodes key with the parents right node key,
- * to determine if our node is right child of a parent node (in case we are traversing from
- * start) so that the 'UP' state can be set (or not).
- */
-struct ctree_iter {
-    _c_iter            iter;
-    ulong              size;
-    CCompareKeyFn      key_cmp_fn;
-    _ctree_iter_states states;
-};
+ * Exactly same as the '_ctree_node_next' except opposite side.
+ */
+static ctree_node*
+_ctree_node_prev(const ctree_node* node)
+{
+    return_val_if_fail(node != NULL, NULL);
+
+#ifdef COL_CTREE_THREADED
+    return node->prev;
+#else
+    if(node->left != NULL)
+        return _ctree_max(node->left);
+
+    ctree_node* parent = node->parent;
+
+    while(parent != NULL && parent->left == node) {
+        node   = parent;
+        parent = parent->parent;
+    }
+
+    return parent;
+#endif
+}
 
 /*
  * 'ctree_iter' constructor, the returned iterator is stack allocated as are all of
@@ -776,17 +6904,29 @@ struct ctree_iter {
  * underlying node.
  * This iterator is usefull for reading the node key/value pairs and/or mutating them.
  *
+ * Iterator over the 'CTREE_CONCURRENT' tree walks the version of the tree that
+ * was current when the iterator got constructed, construction and the whole
+ * iteration must happen inside of the 'ctree_read_enter'/'ctree_read_exit' section.
+ * Such iterator must not be used for mutating the key/value pairs, same goes
+ * for the iterator over the 'CTREE_PERSISTENT' tree (pairs are shared with
+ * the snapshots).
+ *
  * Warning:
  * Freeing the returned node is Undefined Behaviour.
  */
 ctree_iter
 ctree_iter_new(ctree* tree)
 {
+    ctree_node* root  = _ctree_root(tree);
+    bool        cow   = (tree->mode & _CTREE_COW) != 0;
+    ctree_node* first = cow ? _ctree_min(root) : _ctree_first(tree);
+    ctree_node* last  = cow ? _ctree_max(root) : _ctree_last(tree);
+
     return (ctree_iter) {
-        .states     = _ctree_iter_states_default(),
-        .size       = tree->size,
-        .key_cmp_fn = tree->compare_key_fn,
-        .iter       = _c_iter_new(_ctree_min(tree->root), _ctree_max(tree->root)),
+        .size = ctree_size(tree),
+        .iter = _c_iter_new(first, last),
+        .tree = tree,
+        .root = root,
     };
 }
 
@@ -797,12 +6937,18 @@ ctree_iter_new(ctree* tree)
 ctree_node*
 ctree_iter_next(ctree_iter* iter)
 {
-    return_val_if_fail(iter != NULL, NULL);
+    return_val_if_fail(iter != NULL && iter->iter.vals.start != NULL, NULL);
 
-    ctree_node* retval
-        = _ctree_node_next(iter->iter.vals.start, &iter->states.start, iter->key_cmp_fn);
+    ctree_node* retval = iter->iter.vals.start;
 
-    if(retval != NULL)
+    if(retval == iter->iter.vals.end)
+        iter->iter = _c_iter_default();
+    else if(iter->tree->mode & _CTREE_COW)
+        iter->iter.vals.start = _ctreenode_cow_next(iter->tree, iter->root, retval);
+    else
+        iter->iter.vals.start = _ctree_node_next(retval);
+
+    if(iter->size > 0)
         iter->size--;
 
     return retval;
@@ -815,78 +6961,23 @@ ctree_iter_next(ctree_iter* iter)
 ctree_node*
 ctree_iter_next_back(ctree_iter* iter)
 {
-    return_val_if_fail(iter != NULL, NULL);
+    return_val_if_fail(iter != NULL && iter->iter.vals.end != NULL, NULL);
+
+    ctree_node* retval = iter->iter.vals.end;
 
-    ctree_node* retval = _ctree_node_prev(iter->iter.vals.end, &iter->states.end, iter->key_cmp_fn);
+    if(retval == iter->iter.vals.start)
+        iter->iter = _c_iter_default();
+    else if(iter->tree->mode & _CTREE_COW)
+        iter->iter.vals.end = _ctreenode_cow_prev(iter->tree, iter->root, retval);
+    else
+        iter->iter.vals.end = _ctree_node_prev(retval);
 
-    if(retval != NULL)
+    if(iter->size > 0)
         iter->size--;
 
     return retval;
 }
 
-/*
- * Finds the next node in order.
- *
- * Uses the mentioned algorithm described above under the state enum.
- * Ignoring the algorithm and explaining it roughly, it returns minimum value
- * of the right subtree, if right child node is NULL then it returns parent node
- * (there are edge cases which algorithm take care of).
- */
-ctree_node*
-_ctree_node_next(const ctree_node* node, _ctree_iter_state* state, CCompareKeyFn key_cmp_fn)
-{
-    return_val_if_fail(node != NULL, NULL);
-
-    if(node->right == NULL || *state == UP) {
-
-        ctree_node* parent;
-
-        if((parent = node->parent) && parent->right
-           && key_cmp_fn(parent->right->key, node->key) == 0)
-        {
-            *state = UP;
-        } else {
-            *state = RESET;
-        }
-
-        return node->parent;
-
-    } else {
-        *state = RESET;
-        return _ctree_min(node->right);
-    }
-}
-
-/*
- * Finds the previous node in order.
- *
- * Exactly same as the '_ctree_node_next' except opposite side.
- */
-ctree_node*
-_ctree_node_prev(const ctree_node* node, _ctree_iter_state* state, CCompareKeyFn key_cmp_fn)
-{
-    return_val_if_fail(node != NULL, NULL);
-
-    if(node->left == NULL || *state == UP) {
-
-        ctree_node* parent;
-
-        if((parent = node->parent) && parent->left && key_cmp_fn(parent->left->key, node->key) == 0)
-        {
-            *state = UP;
-        } else {
-            *state = RESET;
-        }
-
-        return node->parent;
-
-    } else {
-        *state = RESET;
-        return _ctree_max(node->left);
-    }
-}
-
 /*
  * 'Drains' the 'size' of nodes from the front of the 'iterator'.
  * This basically advances the iterator 'size' amount forward.
@@ -904,12 +6995,8 @@ ctree_iter_drain_front(ctree_iter* iterator, ulong size)
         return;
     }
 
-    while(size--) {
-        iterator->iter.vals.start = _ctree_node_next(iterator->iter.vals.start,
-                                                     &iterator->states.start,
-                                                     iterator->key_cmp_fn);
-        iterator->size--;
-    }
+    while(size--)
+        ctree_iter_next(iterator);
 }
 
 /*
@@ -929,12 +7016,8 @@ ctree_iter_drain_back(ctree_iter* iterator, ulong amount)
         return;
     }
 
-    while(amount--) {
-        iterator->iter.vals.end = _ctree_node_prev(iterator->iter.vals.end,
-                                                   &iterator->states.end,
-                                                   iterator->key_cmp_fn);
-        iterator->size--;
-    }
+    while(amount--)
+        ctree_iter_next_back(iterator);
 }
 
 /*
@@ -962,17 +7045,19 @@ ctree_iter_drain_back(ctree_iter* iterator, ulong amount)
  *
  * This iterator along with the non-consuming one can be iterated from any direction
  * at the same time, iterator will make sure to stop when both ends meet.
+ *
+ * Consumed node is always spliced out of the remaining nodes before it is dropped,
+ * (smallest node has no left child, largest has no right child) so the remaining
+ * nodes stay a valid tree and walking to the next node never touches dropped memory.
  */
 struct ctree_iterator {
-    ulong              size;
-    _c_iter            _iter;
-    _ctree_iter_states states;
+    ulong   size;
+    _c_iter _iter;
 
-    CClone        clone_key_fn;
-    CClone        clone_val_fn;
-    CFreeKeyFn    free_key_fn;
-    CFreeValueFn  free_val_fn;
-    CCompareKeyFn cmp_key_fn;
+    CClone       clone_key_fn;
+    CClone       clone_val_fn;
+    CFreeKeyFn   free_key_fn;
+    CFreeValueFn free_val_fn;
 };
 
 /*
@@ -982,6 +7067,10 @@ struct ctree_iterator {
  *
  * As explained above the double pointer to 'ctree' is provided in order to
  * drop the 'ctree' and null the underlying pointer to it.
+ *
+ * 'CTREE_CONCURRENT' and 'CTREE_PERSISTENT' trees can't be consumed (their
+ * nodes have no parent links), neither can the inline trees (keys/values
+ * live inside the nodes), NULL is returned for them.
  */
 ctree_iterator*
 ctree_iterator_new(ctree** treep)
@@ -989,6 +7078,19 @@ ctree_iterator_new(ctree** treep)
     ctree* tree;
     return_val_if_fail(treep != NULL && (tree = *treep) != NULL, NULL);
 
+    if(tree->mode & _CTREE_COW) {
+        COL_ERROR("copy-on-write ctree can't be consumed");
+        return NULL;
+    }
+
+    if(_CTREE_INLINE(tree)) {
+        COL_ERROR("inline ctree can't be consumed");
+        return NULL;
+    }
+
+    if(!_ctree_evacuate(tree))
+        return NULL;
+
     ctree_iterator* iterator = memc_malloc(ctree_iterator);
 
 #ifndef COL_MEMORY_CONSTRAINED
@@ -1000,16 +7102,12 @@ ctree_iterator_new(ctree** treep)
         return NULL;
     }
 
-    ctree_node* root = tree->root;
-
-    iterator->size         = tree->size;
-    iterator->states       = _ctree_iter_states_default();
-    iterator->_iter        = _c_iter_new(_ctree_min(root), _ctree_max(root));
+    iterator->size         = ctree_size(tree);
+    iterator->_iter        = _c_iter_new(_ctree_first(tree), _ctree_last(tree));
     iterator->clone_key_fn = tree->clone_key_fn;
     iterator->clone_val_fn = tree->clone_value_fn;
     iterator->free_key_fn  = tree->free_key_fn;
     iterator->free_val_fn  = tree->free_value_fn;
-    iterator->cmp_key_fn   = tree->compare_key_fn;
 
     ctree_drop(treep, true);
 
@@ -1062,6 +7160,58 @@ _ctree_iterator_clone_current_and_free(ctree_iterator* iterator, cptr_t current)
     return retval;
 }
 
+/*
+ * Splices the smallest remaining node out of the iterator and
+ * moves the 'start' to the next node in order.
+ * Smallest node is either the root or the left child of its parent
+ * and it has no left child, so its right subtree takes its place.
+ */
+static ctree_node*
+_ctree_iterator_unlink_front(ctree_iterator* iterator)
+{
+    ctree_node* node   = iterator->_iter.vals.start;
+    ctree_node* parent = node->parent;
+    ctree_node* right  = node->right;
+
+    if(right != NULL)
+        right->parent = parent;
+
+    if(parent != NULL)
+        parent->left = right;
+
+    if(--iterator->size == 0)
+        iterator->_iter = _c_iter_default();
+    else
+        iterator->_iter.vals.start = (right != NULL) ? _ctree_min(right) : parent;
+
+    return node;
+}
+
+/*
+ * Splices the largest remaining node out of the iterator and
+ * moves the 'end' to the previous node in order.
+ */
+static ctree_node*
+_ctree_iterator_unlink_back(ctree_iterator* iterator)
+{
+    ctree_node* node   = iterator->_iter.vals.end;
+    ctree_node* parent = node->parent;
+    ctree_node* left   = node->left;
+
+    if(left != NULL)
+        left->parent = parent;
+
+    if(parent != NULL)
+        parent->right = left;
+
+    if(--iterator->size == 0)
+        iterator->_iter = _c_iter_default();
+    else
+        iterator->_iter.vals.end = (left != NULL) ? _ctree_max(left) : parent;
+
+    return node;
+}
+
 /*
  * Traverses the iterator from the 'start' (front) fetching the next node.
  * This performs the deep copy of node and the dropping of the original one.
@@ -1070,19 +7220,10 @@ _ctree_iterator_clone_current_and_free(ctree_iterator* iterator, cptr_t current)
 ctree_node*
 ctree_iterator_next(ctree_iterator* iterator)
 {
-    return_val_if_fail(iterator != NULL && iterator->_iter.vals.start != NULL, NULL);
+    return_val_if_fail(iterator != NULL && iterator->size > 0, NULL);
 
-    ctree_node* retval
-        = _ctree_iterator_clone_current_and_free(iterator, iterator->_iter.vals.start);
-
-    ctree_node* temp = iterator->_iter.vals.start;
-
-    if(temp == iterator->_iter.vals.end) {
-        iterator->_iter.vals.start = NULL;
-        iterator->_iter.vals.end   = NULL;
-    } else
-        iterator->_iter.vals.start
-            = _ctree_node_next(temp, &iterator->states.start, iterator->cmp_key_fn);
+    ctree_node* temp   = _ctree_iterator_unlink_front(iterator);
+    ctree_node* retval = _ctree_iterator_clone_current_and_free(iterator, temp);
 
     ctree_node_drop(&temp);
 
@@ -1097,23 +7238,66 @@ ctree_iterator_next(ctree_iterator* iterator)
 ctree_node*
 ctree_iterator_next_back(ctree_iterator* iterator)
 {
-    return_val_if_fail(iterator != NULL && iterator->_iter.vals.end != NULL, NULL);
-
-    ctree_node* retval = _ctree_iterator_clone_current_and_free(iterator, iterator->_iter.vals.end);
-    ctree_node* temp   = iterator->_iter.vals.end;
+    return_val_if_fail(iterator != NULL && iterator->size > 0, NULL);
 
-    if(temp == iterator->_iter.vals.start) {
-        iterator->_iter.vals.end   = NULL;
-        iterator->_iter.vals.start = NULL;
-    } else
-        iterator->_iter.vals.end
-            = _ctree_node_prev(temp, &iterator->states.end, iterator->cmp_key_fn);
+    ctree_node* temp   = _ctree_iterator_unlink_back(iterator);
+    ctree_node* retval = _ctree_iterator_clone_current_and_free(iterator, temp);
 
     ctree_node_drop(&temp);
 
     return retval;
 }
 
+/*
+ * Frees the remaining nodes of the subtree post-order, without
+ * walking from one node to its in-order successor.
+ */
+static void
+_ctree_iterator_freeall(ctree_iterator* iterator, ctree_node* node)
+{
+    ctree_node* right;
+
+    for(; node != NULL; node = right) {
+        _ctree_iterator_freeall(iterator, node->left);
+        right = node->right;
+
+        if(iterator->free_key_fn)
+            iterator->free_key_fn(node->key);
+
+        if(iterator->free_val_fn)
+            iterator->free_val_fn(node->value);
+
+        free(node);
+    }
+}
+
+/*
+ * Frees all the remaining nodes at once, remaining nodes still form
+ * the tree whose root is found by climbing from the 'start'.
+ */
+static void
+_ctree_iterator_teardown(ctree_iterator* iterator)
+{
+    ctree_node* root = iterator->_iter.vals.start;
+
+    if(root == NULL)
+        return;
+
+    while(root->parent != NULL)
+        root = root->parent;
+
+    _ctree_iterator_freeall(iterator, root);
+
+    iterator->size  = 0;
+    iterator->_iter = _c_iter_default();
+}
+
+/*
+ * 'Drains' from the front the 'iterator' for 'amount' of nodes.
+ * All the drained nodes are also dropped.
+ * Does nothing if 'iterator' is NULL or if the amount is greater than iterator size,
+ * additionally it prints the error msg to stderr.
+ */
 void
 ctree_iterator_drain_front(ctree_iterator* iterator, ulong amount)
 {
@@ -1125,11 +7309,13 @@ ctree_iterator_drain_front(ctree_iterator* iterator, ulong amount)
         return;
     }
 
-    while(amount--) {
-        ctree_node* current = iterator->_iter.vals.start;
+    if(amount == iterator->size) {
+        _ctree_iterator_teardown(iterator);
+        return;
+    }
 
-        iterator->_iter.vals.start
-            = _ctree_node_next(current, &iterator->states.start, iterator->cmp_key_fn);
+    while(amount--) {
+        ctree_node* current = _ctree_iterator_unlink_front(iterator);
 
         if(iterator->free_key_fn)
             iterator->free_key_fn(current->key);
@@ -1139,8 +7325,6 @@ ctree_iterator_drain_front(ctree_iterator* iterator, ulong amount)
 
         ctree_node_drop(&current);
     }
-
-    iterator->size -= amount;
 }
 
 /*
@@ -1160,11 +7344,13 @@ ctree_iterator_drain_back(ctree_iterator* iterator, ulong amount)
         return;
     }
 
-    while(amount--) {
-        ctree_node* current = iterator->_iter.vals.end;
+    if(amount == iterator->size) {
+        _ctree_iterator_teardown(iterator);
+        return;
+    }
 
-        iterator->_iter.vals.end
-            = _ctree_node_next(current, &iterator->states.end, iterator->cmp_key_fn);
+    while(amount--) {
+        ctree_node* current = _ctree_iterator_unlink_back(iterator);
 
         if(iterator->free_key_fn)
             iterator->free_key_fn(current->key);
@@ -1174,8 +7360,80 @@ ctree_iterator_drain_back(ctree_iterator* iterator, ulong amount)
 
         ctree_node_drop(&current);
     }
+}
+
+/*
+ * Moves up to 'capacity' key-value pairs from the front of the 'iterator'
+ * into 'keys'/'values' in order, ownership is transferred without cloning.
+ * Keys/values are freed instead if 'keys'/'values' is NULL.
+ * Returns the number of drained pairs.
+ */
+ulong
+ctree_iterator_drain_into(ctree_iterator* iterator, cptr_t* keys, cptr_t* values, ulong capacity)
+{
+    return_val_if_fail(iterator != NULL, 0);
+
+    ulong count = 0;
+
+    for(; count < capacity && iterator->size > 0; count++) {
+        ctree_node* node = _ctree_iterator_unlink_front(iterator);
+
+        if(keys != NULL)
+            keys[count] = node->key;
+        else if(iterator->free_key_fn)
+            iterator->free_key_fn(node->key);
+
+        if(values != NULL)
+            values[count] = node->value;
+        else if(iterator->free_val_fn)
+            iterator->free_val_fn(node->value);
+
+        free(node);
+    }
+
+    return count;
+}
+
+/*
+ * Moves all the remaining key-value pairs of the 'iterator' into the
+ * 'keys'/'values' vectors of 'cptr_t' in order, same as
+ * 'ctree_iterator_drain_into'.
+ * Stops if a vector could not grow, the pair that didn't fit is left in
+ * the iterator and both vectors grow by the same number of elements.
+ * Returns the number of drained pairs.
+ */
+ulong
+ctree_iterator_drain_into_vec(ctree_iterator* iterator, cvec* keys, cvec* values)
+{
+    return_val_if_fail(iterator != NULL, 0);
+
+    ulong count = 0;
+
+    while(iterator->size > 0) {
+        ctree_node* node = iterator->_iter.vals.start;
+
+        // Pair stays in the iterator unless both of its halves fit
+        if(keys != NULL && cvec_push(keys, &node->key) != 0)
+            break;
+
+        if(values != NULL && cvec_push(values, &node->value) != 0) {
+            if(keys != NULL)
+                cvec_truncate(keys, cvec_len(keys) - 1);
+            break;
+        }
+
+        _ctree_iterator_unlink_front(iterator);
+
+        if(keys == NULL && iterator->free_key_fn)
+            iterator->free_key_fn(node->key);
+        if(values == NULL && iterator->free_val_fn)
+            iterator->free_val_fn(node->value);
+
+        free(node);
+        count++;
+    }
 
-    iterator->size -= amount;
+    return count;
 }
 
 /*
@@ -1200,13 +7458,11 @@ ctree_iterator_drop(ctree_iterator** iteratorp)
         // Sanity check
         assert(iterator->size == 0);
         iterator->size         = 0;
-        iterator->states       = _ctree_iter_states_default();
         iterator->_iter        = _c_iter_default();
         iterator->free_key_fn  = NULL;
         iterator->free_val_fn  = NULL;
         iterator->clone_key_fn = NULL;
         iterator->clone_val_fn = NULL;
-        iterator->cmp_key_fn   = NULL;
         *iteratorp             = NULL;
         free(iterator);
     }
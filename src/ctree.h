@@ -8,6 +8,7 @@
 
 #define __COL_H_FILE__
 #include "ccore.h"
+#include "citer.h"
 #undef __COL_H_FILE__
 
 #include <stdbool.h>
@@ -22,6 +23,174 @@ typedef struct ctree_iterator ctree_iterator;
 
 typedef struct ctree_iter ctree_iter;
 
+typedef struct ctree_mapped ctree_mapped;
+
+typedef struct _cvec cvec;
+
+typedef struct ctree_sharded ctree_sharded;
+
+typedef struct ctree_sharded_iter ctree_sharded_iter;
+
+typedef struct ctree_reclaim ctree_reclaim;
+
+typedef struct cfrozen cfrozen;
+
+/*
+ * 'CMergeValueFn' combines the values of the key found in both trees
+ * merged by 'ctree_merge_with', 'value' being the one from the tree
+ * and 'other_value' the one from the consumed tree.
+ * Returned value is stored, the one not returned is freed.
+ * Might be called from multiple threads at once.
+ */
+typedef cptr_t (*CMergeValueFn)(cconstptr_t key, cptr_t value,
+                                cptr_t other_value);
+
+/*
+ * 'CPrefixKeyFn' extracts the normalized prefix of the key, unsigned
+ * integer ordered the same way as the keys ('CCompareKeyFn'), e.g. first
+ * 8 bytes of the string packed big-endian. Keys with the smaller prefix
+ * must compare smaller, keys with equal prefixes are told apart by
+ * 'CCompareKeyFn'.
+ */
+typedef ulong (*CPrefixKeyFn)(cconstptr_t key);
+
+/*
+ * 'CMakeValueFn' makes the value of the key inserted by
+ * 'ctree_entry_or_insert', 'ctx' is passed through.
+ */
+typedef cptr_t (*CMakeValueFn)(cconstptr_t key, cptr_t ctx);
+
+/*
+ * 'CUpdateValueFn' returns the new value of the key updated by
+ * 'ctree_update_with' given its current 'value' (NULL if the key
+ * was just inserted), 'ctx' is passed through.
+ */
+typedef cptr_t (*CUpdateValueFn)(cconstptr_t key, cptr_t value, cptr_t ctx);
+
+/*
+ * 'CSerializeFn' returns the bytes the 'element' is saved as by
+ * 'ctree_save' and stores their count into 'size', it must return
+ * the same bytes each time it gets called for the same element.
+ * Elements that are plain memory (integers, strings, flat structs)
+ * can return themselves, mapped file can then be searched in place.
+ */
+typedef const void *(*CSerializeFn)(cconstptr_t element, size_t *size);
+
+/*
+ * 'CDeserializeFn' makes the element out of the 'size' bytes
+ * (8-byte aligned) saved by 'CSerializeFn'.
+ */
+typedef cptr_t (*CDeserializeFn)(const void *bytes, size_t size);
+
+/*
+ * 'CHashKeyFn' hashes the key, equal keys ('CCompareKeyFn')
+ * must have the same hash.
+ */
+typedef ulong (*CHashKeyFn)(cconstptr_t key);
+
+/*
+ * 'CVisitFn' is called by 'ctree_par_for_each' on every key-value pair,
+ * 'ctx' is passed through.
+ */
+typedef void (*CVisitFn)(cconstptr_t key, cptr_t value, cptr_t ctx);
+
+/*
+ * 'CMapFn' maps the key-value pair into the partial result
+ * reduced by 'ctree_par_reduce', 'ctx' is passed through.
+ */
+typedef cptr_t (*CMapFn)(cconstptr_t key, cptr_t value, cptr_t ctx);
+
+/*
+ * 'CCombineFn' combines the partial results of the smaller ('left') and
+ * larger ('right') keys into one, it must be associative but it doesn't
+ * have to be commutative. 'ctx' is passed through.
+ */
+typedef cptr_t (*CCombineFn)(cptr_t left, cptr_t right, cptr_t ctx);
+
+/*
+ * 'CPredicateFn' tells whether the key-value pair is kept by
+ * 'ctree_retain', 'ctx' is passed through.
+ */
+typedef bool (*CPredicateFn)(cconstptr_t key, cptr_t value, cptr_t ctx);
+
+/*
+ * Bi-directional Non-consuming iterator.
+ * Nodes having 'parent' member is what allows this iterator to have O(1) space
+ * complexity and amortized O(1) time complexity when fetching next node
+ * (O(1) worst case in 'COL_CTREE_THREADED' builds).
+ * Walking the iterator never calls 'CCompareKeyFn'.
+ *
+ * 'CTREE_CONCURRENT'/'CTREE_PERSISTENT' nodes are shared between the
+ * versions and have no parent links, their iterator finds each next
+ * node by descending from the root of its version, that is O(log n)
+ * time and 'CCompareKeyFn' calls per step.
+ */
+struct ctree_iter {
+  _c_iter iter;
+  ulong size;
+  const ctree *tree;
+  ctree_node *root;
+};
+
+/*
+ * Mode the 'CTree' is constructed in.
+ *
+ * 'CTREE_DEFAULT' tree is not thread safe and does not pay anything
+ * for being thread safe.
+ *
+ * 'CTREE_CONCURRENT' tree can be read from any number of threads
+ * ('ctree_entry', 'ctree_key', 'ctree_size', 'ctree_iter') without
+ * locking while writers ('ctree_insert', 'ctree_replace', 'ctree_remove')
+ * serialize on the tree lock and never block the readers.
+ * Memory removed by the writers is freed once no reader can
+ * reference it anymore.
+ *
+ * 'CTREE_PERSISTENT' tree keeps the older versions intact, insertion
+ * and removal copy only the nodes on the path they touch, which lets
+ * 'ctree_snapshot' return the point-in-time version in O(1).
+ * Can't be combined with 'CTREE_CONCURRENT'.
+ *
+ * 'CTREE_FINGER' tree remembers the last inserted node (the finger),
+ * insertions and lookups start from the finger and climb through the
+ * parent links only as far as needed, so the nearly sorted insertions
+ * cost amortized O(1) comparisons (random access pays up to twice as
+ * many). Can't be combined with 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+typedef enum {
+  CTREE_DEFAULT = 0,
+  CTREE_CONCURRENT = 1 << 0,
+  CTREE_PERSISTENT = 1 << 1,
+  CTREE_FINGER = 1 << 2,
+} ctree_mode;
+
+/*
+ * Balancing policy of the tree.
+ *
+ * 'CTREE_AVL' keeps the tree strictly balanced (fastest lookups) and is
+ * the only policy supporting the set operations, split and join.
+ *
+ * 'CTREE_RB' (red-black) and 'CTREE_WAVL' (weak AVL, rank balanced)
+ * rebalance bottom-up and stop early, both do O(1) amortized rotations
+ * per update, which pays off for the insert/remove heavy trees.
+ * WAVL tree is as balanced as the AVL tree as long as there are no
+ * removals and never worse than the red-black tree.
+ * Neither can be combined with 'CTREE_CONCURRENT'/'CTREE_PERSISTENT',
+ * batched insertion inserts the keys one by one.
+ *
+ * 'CTREE_SPLAY' (self-adjusting) tree moves every key it inserts or
+ * finds ('ctree_entry', 'ctree_key') up towards the root, frequently
+ * accessed keys then sit a few levels deep. Keys already within
+ * 'COL_CTREE_SPLAY_DEPTH' levels of the root are not moved. Operations
+ * are amortized O(log n) but the tree itself can get unbalanced, and
+ * since the lookups modify it, readers must use 'ctree_peek' to run
+ * concurrently. Same restrictions as for 'CTREE_RB' apply.
+ */
+typedef enum {
+  CTREE_AVL = 0,
+  CTREE_RB,
+  CTREE_WAVL,
+  CTREE_SPLAY,
+} ctree_policy;
 
 /*
  * 'CTree' constructor.
@@ -45,6 +214,360 @@ typedef struct ctree_iter ctree_iter;
  */
 ctree *ctree_new(CCompareKeyFn, CFreeKeyFn, CFreeValueFn, CClone, CClone);
 
+/*
+ * Same as 'ctree_new' except the 'CTree' is constructed
+ * in the given 'ctree_mode'.
+ */
+ctree *ctree_new_with_mode(CCompareKeyFn, CFreeKeyFn, CFreeValueFn, CClone,
+                           CClone, ctree_mode);
+
+/*
+ * Same as 'ctree_new_with_mode' except the 'CTree' is balanced
+ * according to the given 'ctree_policy'.
+ */
+ctree *ctree_new_with_policy(CCompareKeyFn, CFreeKeyFn, CFreeValueFn, CClone,
+                             CClone, ctree_mode, ctree_policy);
+
+/*
+ * Constructs the 'CTree' storing the keys of 'key_size' bytes and the
+ * values of 'value_size' bytes (0 for the set without values) inside
+ * the nodes, each entry is a single allocation.
+ * 'ctree_insert' copies the key/value the arguments point to (NULL value
+ * is stored zeroed), 'ctree_entry'/'ctree_key' return the pointers into
+ * the node valid until the key gets removed.
+ * Only 'CTREE_DEFAULT' and 'CTREE_FINGER' modes are supported, inline
+ * tree can't be consumed ('ctree_iterator') and has no value slots
+ * ('ctree_entry_or_insert', 'ctree_get_or_insert', 'ctree_update_with').
+ */
+ctree *ctree_new_inline(size_t key_size, size_t value_size, CCompareKeyFn,
+                        ctree_mode);
+
+/*
+ * Sets the 'CPrefixKeyFn' of the empty tree, each node then caches
+ * the prefix of its key and the lookups/insertions/removals compare
+ * the prefixes first, 'CCompareKeyFn' (and the key allocation) is only
+ * touched when the prefixes are equal.
+ * Builds with 'COL_MEMORY_CONSTRAINED' don't cache the prefixes
+ * (nodes keep their original size), the extractor is then never called.
+ *
+ * Returns false if the tree is not empty.
+ */
+bool ctree_set_prefix_fn(ctree *tree, CPrefixKeyFn prefix_key_fn);
+
+/*
+ * 'CPrefixKeyFn' for the null terminated string keys compared
+ * with 'strcmp'.
+ */
+ulong ctree_prefix_str(cconstptr_t key);
+
+/*
+ * Enters/leaves the read section of the 'CTREE_CONCURRENT' tree.
+ *
+ * Keys, values and nodes returned by the lookups and iterators stay
+ * valid until the calling thread leaves the read section, even if
+ * some other thread removes them in the meantime.
+ * Read sections can be nested, for the trees in other modes
+ * these functions do nothing.
+ */
+void ctree_read_enter(ctree *tree);
+void ctree_read_exit(ctree *tree);
+
+/*
+ * Returns the immutable snapshot of the 'CTREE_PERSISTENT' tree in O(1).
+ *
+ * Snapshot is the read only 'CTree' that shares the nodes with
+ * the tree and keeps seeing the tree as it was at the time of the
+ * call, no matter what gets inserted/removed afterwards.
+ * Snapshot must be freed with 'ctree_free', which frees only the
+ * nodes (keys/values) no other version references.
+ *
+ * Snapshot can be read and freed from another thread while the
+ * tree is being modified, snapshots of the same tree must be taken
+ * from the thread that modifies it.
+ *
+ * Returns NULL if the tree is not persistent or allocation failed.
+ */
+ctree *ctree_snapshot(ctree *tree);
+
+/*
+ * Set operations, all of them consume the tree 'otherp' points to
+ * (nulling the pointer) and store the result into the 'tree'.
+ *
+ * 'ctree_union' moves all the pairs of the other tree into the 'tree',
+ * for the keys present in both trees the pair of the 'tree' is kept.
+ * 'ctree_merge_with' does the same but combines the values of the keys
+ * present in both trees with the 'CMergeValueFn'.
+ * 'ctree_intersection' keeps only the pairs whose keys are in both trees.
+ * 'ctree_difference' keeps only the pairs whose keys are not in the other tree.
+ *
+ * Pairs that don't make it into the result are freed with the free
+ * functions of the tree they came from.
+ * Work is O(m * log(n / m + 1)) where m is the size of the smaller tree,
+ * large operations are split across threads, so free functions (and
+ * the 'CMergeValueFn') must be thread safe.
+ *
+ * Neither tree can be 'CTREE_CONCURRENT'/'CTREE_PERSISTENT' and both
+ * must have the same ordering and prefix fn, returns false otherwise
+ * (nothing is consumed).
+ */
+bool ctree_union(ctree *tree, ctree **otherp);
+bool ctree_merge_with(ctree *tree, ctree **otherp, CMergeValueFn merge_fn);
+bool ctree_intersection(ctree *tree, ctree **otherp);
+bool ctree_difference(ctree *tree, ctree **otherp);
+
+/*
+ * Splits the tree 'treep' points to in O(log n) into the tree of keys
+ * smaller than the 'key' ('left') and the tree of keys larger or
+ * equal to the 'key' ('right').
+ * Tree gets consumed and its pointer nulled.
+ *
+ * Sizes of the halves are recounted in O(n) the first time
+ * 'ctree_size' gets called.
+ *
+ * Returns false if the tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'
+ * or if the allocation failed.
+ */
+bool ctree_split(ctree **treep, cconstptr_t key, ctree **left, ctree **right);
+
+/*
+ * Joins the tree 'otherp' points to into the 'tree' in O(log n),
+ * keys of the other tree must all be either smaller or larger than
+ * the keys of the 'tree'.
+ * Other tree gets consumed and its pointer nulled.
+ *
+ * Returns false if the key ranges overlap, if the prefix fns differ
+ * or if either tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+bool ctree_join(ctree *tree, ctree **otherp);
+
+/*
+ * Removes all the keys in the range ['lo', 'hi'), the range is detached
+ * from the tree in O(log n) and then its keys/values are freed with
+ * 'CFreeKeyFn'/'CFreeValueFn' in one pass.
+ *
+ * If 'async' is true the range is freed on the background thread
+ * (free functions must be thread safe), size of the tree is then
+ * recounted the first time 'ctree_size' gets called.
+ *
+ * Returns true if any key got removed.
+ */
+bool ctree_remove_range(ctree *tree, cconstptr_t lo, cconstptr_t hi,
+                        bool async);
+
+/*
+ * Inserts 'n' key-value pairs ('values' can be NULL) in one pass.
+ * Batch is sorted and merged into the tree, each path gets
+ * rebalanced once instead of once per key. If the batch holds at
+ * least quarter as many keys as the tree then the whole tree is
+ * rebuilt balanced in O(n + size) instead.
+ *
+ * Keys that already exist only get their value updated (old value
+ * is freed with 'CFreeValueFn'), as with 'ctree_insert' such keys are
+ * not taken by the tree ('ctree_key' tells which key the tree holds).
+ * Repeated keys in the batch act the same as consecutive inserts,
+ * first key is taken and last value wins.
+ *
+ * Returns the number of inserted keys, number of updated keys is
+ * stored in 'updated' if it is not NULL.
+ * Returns 0 and inserts nothing if any of the keys is NULL.
+ */
+ulong ctree_insert_batch(ctree *tree, cptr_t *keys, cptr_t *values, size_t n,
+                         ulong *updated);
+
+/*
+ * Removes all the keys 'pred' returns false for (called in order, it must
+ * not modify the tree), freeing them with 'CFreeKeyFn'/'CFreeValueFn'.
+ * Tree is walked once and rebuilt perfectly balanced out of the remaining
+ * keys in O(n).
+ * Returns the number of removed keys, 0 if the tree is 'CTREE_CONCURRENT'
+ * or 'CTREE_PERSISTENT'.
+ */
+ulong ctree_retain(ctree *tree, CPredicateFn pred, cptr_t ctx);
+
+/*
+ * Calls 'visit_fn' on every key-value pair, top levels of the tree are
+ * split into subtrees that are visited in parallel (large enough subtrees
+ * only), so the pairs are visited in no particular order and 'visit_fn'
+ * must be safe to call from multiple threads.
+ * Tree must not be modified meanwhile, 'CTREE_CONCURRENT' trees are not
+ * supported.
+ */
+void ctree_par_for_each(ctree *tree, CVisitFn visit_fn, cptr_t ctx);
+
+/*
+ * Maps every key-value pair with 'map_fn' and reduces the results with
+ * 'combine_fn', subtrees are reduced in parallel the same way as in
+ * 'ctree_par_for_each'. Partial results are always combined in the key
+ * order, so 'combine_fn' doesn't have to be commutative.
+ * Partial results are owned by the caller, 'combine_fn' may reuse or free
+ * its arguments.
+ *
+ * Returns the reduced result, NULL if the tree is empty.
+ */
+cptr_t ctree_par_reduce(ctree *tree, CMapFn map_fn, CCombineFn combine_fn,
+                        cptr_t ctx);
+
+/*
+ * Saves the tree into the file 'fd' in the compact format, keys and
+ * values are written in order (8-byte aligned) together with the
+ * sorted index which is the implicit balanced tree.
+ * Values are not saved if 'value_serializer' is NULL.
+ * File uses the native byte order.
+ *
+ * Returns false if any key could not be serialized or the write failed.
+ */
+bool ctree_save(ctree *tree, int fd, CSerializeFn key_serializer,
+                CSerializeFn value_serializer);
+
+/*
+ * Maps the file written by 'ctree_save' at 'path', lookups are served
+ * straight from the mapping (binary search over the index) comparing
+ * the saved key bytes with 'compare_key_fn', no tree is built.
+ * Loading checks every record in O(n), offsets must be in bounds and
+ * 8-byte aligned and the keys strictly ascending by 'compare_key_fn'.
+ *
+ * Returns NULL if the file could not be mapped or is malformed.
+ */
+ctree_mapped *ctree_load_mmap(const char *path, CCompareKeyFn compare_key_fn);
+
+/*
+ * Returns pointer to the mapped value/key of the key, NULL if the key
+ * is not inside the file. Pointers stay valid until the 'map' is freed.
+ */
+cconstptr_t ctree_mapped_entry(const ctree_mapped *map, cconstptr_t key);
+
+cconstptr_t ctree_mapped_key(const ctree_mapped *map, cconstptr_t key);
+
+ulong ctree_mapped_size(const ctree_mapped *map);
+
+/*
+ * Stores the 'index'-th (in order) mapped key/value into 'key'/'value'
+ * (either one can be NULL).
+ * Returns false if the index is out of bounds.
+ */
+bool ctree_mapped_at(const ctree_mapped *map, ulong index, cconstptr_t *key,
+                     cconstptr_t *value);
+
+/*
+ * Builds the live 'CTREE_DEFAULT' tree out of the mapping in O(n),
+ * index is already sorted so 'CCompareKeyFn' is never called.
+ *
+ * Keys/values are made by the deserializers, without them they point
+ * into the mapping (which then must outlive the tree and the free
+ * functions must be NULL). Empty values are NULL.
+ *
+ * Returns NULL if the allocation failed.
+ */
+ctree *ctree_mapped_build(const ctree_mapped *map,
+                          CDeserializeFn key_deserializer,
+                          CDeserializeFn value_deserializer,
+                          CFreeKeyFn free_key_fn, CFreeValueFn free_value_fn);
+
+/*
+ * Unmaps the file and frees the 'map'.
+ */
+void ctree_mapped_free(ctree_mapped *map);
+
+/*
+ * Converts the tree into the read-only index in O(n), keys are laid out
+ * in the static B-tree of cache line sized blocks without any pointers,
+ * so the lookup touches O(log_B n) cache lines. Inline trees keep the
+ * key bytes in the index, trees with the prefix function keep the key
+ * prefixes next to the keys.
+ * Keys/values (together with the free functions) move into the index,
+ * tree gets consumed and its pointer is nulled.
+ *
+ * Returns NULL if the index could not be allocated (tree is left as is)
+ * or if the tree is 'CTREE_CONCURRENT' or 'CTREE_PERSISTENT'.
+ */
+cfrozen *ctree_freeze(ctree **treep);
+
+/*
+ * Returns pointer to the value of the key, NULL if the key is not inside
+ * the index.
+ */
+cptr_t cfrozen_get(const cfrozen *frozen, cconstptr_t key);
+
+/*
+ * Returns the in-order position of the first key not smaller than the
+ * 'key', 'cfrozen_size' if there is none.
+ */
+ulong cfrozen_lower_bound(const cfrozen *frozen, cconstptr_t key);
+
+ulong cfrozen_size(const cfrozen *frozen);
+
+/*
+ * Stores the 'index'-th (in order) key/value into 'key'/'value'
+ * (either one can be NULL), walking the indices from 0 up to the size
+ * iterates the keys in order.
+ * Returns false if the index is out of bounds.
+ */
+bool cfrozen_at(const cfrozen *frozen, ulong index, cconstptr_t *key,
+                cptr_t *value);
+
+/*
+ * Frees the index together with the keys/values.
+ */
+void cfrozen_free(cfrozen *frozen);
+
+/*
+ * Relocates the nodes into one contiguous block in the van Emde Boas
+ * order, so the lookups and the in-order walks touch fewer cache lines
+ * and pages. Tree stays fully usable, its block is released once all
+ * the nodes in it are removed.
+ * Pointers to the nodes (iterators, 'ctree_first'/'ctree_last') get
+ * invalidated.
+ *
+ * Returns false if the block could not be allocated (tree is left as is)
+ * or if the tree is 'CTREE_CONCURRENT' or 'CTREE_PERSISTENT'.
+ */
+bool ctree_compact(ctree *tree);
+
+/*
+ * Incremental 'ctree_compact' relocating at most 'budget' nodes per call
+ * (in pre-order), the tree can be modified in between the calls.
+ * Pointers to the nodes get invalidated by each call.
+ *
+ * Returns true while the pass is not done, false once it is done (next
+ * call starts the new pass) or if it could not be started.
+ */
+bool ctree_compact_step(ctree *tree, ulong budget);
+
+/*
+ * Ordered map partitioned by the key hash across 'shards' trees
+ * (number of the online processors if 0), every shard has its own lock
+ * and node pool so the writers of the different shards run in parallel.
+ * 'CCompareKeyFn' and 'CHashKeyFn' are required.
+ *
+ * Insert/remove/entry are safe to call from any number of threads,
+ * value returned by 'ctree_sharded_entry' is valid until its key gets
+ * removed.
+ * 'ctree_sharded_size' sums the shard counters without synchronization,
+ * it is exact once the writers are done.
+ */
+ctree_sharded *ctree_sharded_new(CCompareKeyFn, CFreeKeyFn, CFreeValueFn,
+                                 CHashKeyFn, uint shards);
+
+bool ctree_sharded_insert(ctree_sharded *map, cptr_t key, cptr_t value);
+
+bool ctree_sharded_remove(ctree_sharded *map, cptr_t key);
+
+cptr_t ctree_sharded_entry(ctree_sharded *map, cptr_t key);
+
+ulong ctree_sharded_size(const ctree_sharded *map);
+
+void ctree_sharded_free(ctree_sharded *map);
+
+/*
+ * Iterator merging the shards lazily in the key order, O(log shards)
+ * comparisons per step. Map must not be modified during the iteration.
+ */
+ctree_sharded_iter *ctree_sharded_iter_new(ctree_sharded *map);
+
+ctree_node *ctree_sharded_iter_next(ctree_sharded_iter *iter);
+
+void ctree_sharded_iter_free(ctree_sharded_iter *iter);
+
 /*
  * Free's up the tree and additionally all
  * key value pairs inside of it only and only if the user
@@ -58,6 +581,25 @@ ctree *ctree_new(CCompareKeyFn, CFreeKeyFn, CFreeValueFn, CClone, CClone);
  */
 void ctree_free(ctree *tree);
 
+/*
+ * Frees up the tree the same as 'ctree_free' but on the background
+ * thread, the calling thread only pays for handing the tree over.
+ * Nodes are freed in bounded batches, reclaimer yields in between.
+ * Tree must not be accessed after the call.
+ *
+ * If 'reclaim' is not NULL it receives the handle to wait on with
+ * 'ctree_reclaim_wait', otherwise the reclaimer runs detached.
+ * Returns false if the reclaimer could not be started, in which case
+ * the tree is freed right away and '*reclaim' is NULL.
+ */
+bool ctree_free_async(ctree *tree, ctree_reclaim **reclaim);
+
+/*
+ * Waits until the tree handed to 'ctree_free_async' is freed,
+ * then frees the 'reclaim' handle. Does nothing if it is NULL.
+ */
+void ctree_reclaim_wait(ctree_reclaim *reclaim);
+
 /*
  * Inserts key-value pair in the tree.
  *
@@ -108,4 +650,177 @@ cptr_t ctree_entry(ctree *tree, cptr_t key);
  */
 cptr_t ctree_key(ctree *tree, cptr_t key);
 
+/*
+ * Same as 'ctree_entry' except the tree is never restructured
+ * ('CTREE_SPLAY'), so the readers can use it concurrently.
+ */
+cptr_t ctree_peek(const ctree *tree, cconstptr_t key);
+
+/*
+ * Enables the cache of the hot keys in front of the tree with room for
+ * 'slots' nodes ('hash_fn' hashes the keys), repeated 'ctree_entry'/
+ * 'ctree_key' of the cached key costs a single 'CCompareKeyFn' call.
+ * 0 'slots' disables the cache.
+ * Lookups then update the cache, concurrent readers must use 'ctree_peek'.
+ * Returns false if the cache could not be allocated or if the tree is
+ * 'CTREE_CONCURRENT' or 'CTREE_PERSISTENT'.
+ */
+bool ctree_cache_enable(ctree *tree, CHashKeyFn hash_fn, uint slots);
+
+/*
+ * Stores the number of the cache hits/misses of the lookups into
+ * 'hits'/'misses' (either one can be NULL).
+ */
+void ctree_cache_stats(const ctree *tree, ulong *hits, ulong *misses);
+
+/*
+ * Returns the node holding the smallest (largest) key in O(1),
+ * NULL if the tree is empty.
+ */
+ctree_node *ctree_first(ctree *tree);
+ctree_node *ctree_last(ctree *tree);
+
+/*
+ * Removes the smallest (largest) key without searching for it, key/value
+ * are stored into 'key'/'value' and the caller owns them from then on.
+ * If either one is NULL it gets freed with 'CFreeKeyFn'/'CFreeValueFn'.
+ * Inline trees only accept NULL 'key'/'value', copy-on-write trees are
+ * not supported.
+ * Returns false if the tree is empty.
+ */
+bool ctree_pop_first(ctree *tree, cptr_t *key, cptr_t *value);
+bool ctree_pop_last(ctree *tree, cptr_t *key, cptr_t *value);
+
+/*
+ * Looks up the 'n' keys at once, value of each key is stored into
+ * 'out_values' at the key's position (NULL if the key is not inside
+ * the tree). Descents of the keys are interleaved and their next
+ * nodes prefetched, so the cache misses of the different keys overlap.
+ * Returns the number of keys found.
+ */
+ulong ctree_entry_batch(ctree *tree, cptr_t *keys, size_t n,
+                        cptr_t *out_values);
+
+/*
+ * Entry API, each function makes only one descent into the tree and
+ * returns the slot holding the value of the 'key', slot stays valid
+ * until the key gets removed (the value can be read and written
+ * through it). Missing key gets inserted and then it is taken by
+ * the tree, otherwise the key is left to the user.
+ *
+ * 'ctree_entry_or_insert' inserts the missing key with the value
+ * made by 'make_value_fn' (NULL value if it is not provided),
+ * 'make_value_fn' is only called if the key got inserted.
+ *
+ * 'ctree_get_or_insert' inserts the missing key with the 'value',
+ * the 'value' got stored if the slot holds it.
+ *
+ * 'ctree_update_with' stores whatever 'update_fn' returns given the
+ * current value (NULL for the inserted key), previous value is freed
+ * with 'CFreeValueFn' if it got replaced.
+ *
+ * Returns NULL if the tree or key is NULL, the key could not be
+ * inserted or the tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+cptr_t *ctree_entry_or_insert(ctree *tree, cptr_t key,
+                              CMakeValueFn make_value_fn, cptr_t ctx);
+
+cptr_t *ctree_get_or_insert(ctree *tree, cptr_t key, cptr_t value);
+
+cptr_t *ctree_update_with(ctree *tree, cptr_t key, CUpdateValueFn update_fn,
+                          cptr_t ctx);
+
+/*
+ * Inserts the key-value pair searching from the 'hint' node (root if
+ * NULL) and climbing through the parent links only as far as needed,
+ * inserting next to the hint costs amortized O(1) comparisons.
+ * Existing key only gets its value updated as with 'ctree_insert'
+ * (the key is then left to the user).
+ *
+ * Returns the node holding the key (the next hint), NULL if the key
+ * could not be inserted or the tree is
+ * 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+ctree_node *ctree_insert_hint(ctree *tree, ctree_node *hint, cptr_t key,
+                              cptr_t value);
+
+/*
+ * Searches for the key starting from the 'hint' node (root if NULL).
+ * Returns the node holding the key, NULL if the key is not inside
+ * the tree or the tree is 'CTREE_CONCURRENT'/'CTREE_PERSISTENT'.
+ */
+ctree_node *ctree_find_hint(ctree *tree, ctree_node *hint, cconstptr_t key);
+
+/*
+ * Returns the non-consuming iterator over the 'ctree'.
+ * Iterator is invalidated by any insertion/removal.
+ */
+ctree_iter ctree_iter_new(ctree *tree);
+
+/*
+ * Returns the next node in order from the front/back of the
+ * iterator or NULL if the iterator is exhausted.
+ */
+ctree_node *ctree_iter_next(ctree_iter *iter);
+
+ctree_node *ctree_iter_next_back(ctree_iter *iter);
+
+/*
+ * Advances the iterator 'amount' nodes from the front/back.
+ */
+void ctree_iter_drain_front(ctree_iter *iter, ulong amount);
+
+void ctree_iter_drain_back(ctree_iter *iter, ulong amount);
+
+/*
+ * Consumes the 'ctree' returning the consuming iterator
+ * over its nodes, pointer to the 'ctree' gets nulled.
+ */
+ctree_iterator *ctree_iterator_new(ctree **treep);
+
+/*
+ * Returns the clone of the next node from the front/back,
+ * original node gets dropped.
+ * Returned node must be freed with 'ctree_node_drop'.
+ */
+ctree_node *ctree_iterator_next(ctree_iterator *iterator);
+
+ctree_node *ctree_iterator_next_back(ctree_iterator *iterator);
+
+void ctree_iterator_drain_front(ctree_iterator *iterator, ulong amount);
+
+void ctree_iterator_drain_back(ctree_iterator *iterator, ulong amount);
+
+/*
+ * Moves up to 'capacity' key-value pairs from the front into 'keys'/'values'
+ * without cloning, caller takes the ownership.
+ * If 'keys'/'values' is NULL those elements are freed instead.
+ * Returns the number of drained pairs.
+ */
+ulong ctree_iterator_drain_into(ctree_iterator *iterator, cptr_t *keys,
+                                cptr_t *values, ulong capacity);
+
+/*
+ * Moves all the remaining key-value pairs into the vectors of 'cptr_t'
+ * ('cvec_new(sizeof(cptr_t), ...)'), either vector can be NULL.
+ * Returns the number of drained pairs, less than the iterator size
+ * only if a vector could not grow, the pair that didn't fit (and the
+ * rest) is then left in the iterator.
+ */
+ulong ctree_iterator_drain_into_vec(ctree_iterator *iterator, cvec *keys,
+                                    cvec *values);
+
+uint ctree_iterator_size(ctree_iterator *iterator);
+
+void ctree_iterator_drop(ctree_iterator **iteratorp);
+
+void ctree_node_drop(ctree_node **nodep);
+
+/*
+ * Returns the key/value stored inside the 'node'.
+ */
+cptr_t ctree_node_key(ctree_node *node);
+
+cptr_t ctree_node_value(ctree_node *node);
+
 #endif
@@ -0,0 +1,308 @@
+#ifndef __COL_TREE_INTKEY_H__
+#define __COL_TREE_INTKEY_H__
+
+#if !defined(__COL_LIB_INSIDE__) && !defined(__COL_TEST__)
+#error "Only <collib.h> can be included directly."
+#endif
+
+#define __COL_H_FILE__
+#include "ccore.h"
+#undef __COL_H_FILE__
+#ifndef __COL_C_FILE__
+#define __COL_C_FILE__
+#include "cerror.h"
+#undef __COL_C_FILE__
+#else
+#include "cerror.h"
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Generates the 'CTree' specialized for the integer keys of type 'key_t'
+ * mapping to the values of type 'val_t', named 'name'.
+ *
+ *   CTREE_DEFINE_INTKEY(u64map, uint64_t, double);
+ *
+ * Keys and values are stored inline in the nodes and keys are compared
+ * with '<', there is no 'CCompareKeyFn' call and no key allocation so the
+ * compiler can inline the whole search loop. 'key_t' can be any type
+ * ordered by '<'.
+ *
+ * API mirrors the 'CTree' one, all of the functions are 'static inline':
+ *
+ *   name *name_new(void);
+ *   void name_free(name *tree);
+ *
+ *   Returns true if the key was inserted, false if only its value got
+ *   updated (or the node could not be allocated).
+ *   bool name_insert(name *tree, key_t key, val_t value);
+ *
+ *   Returns true if the key was removed, its value is stored in 'value'
+ *   if it is not NULL.
+ *   bool name_remove(name *tree, key_t key, val_t *value);
+ *
+ *   Returns pointer to the value stored in the tree, NULL if the key
+ *   is not inside the tree.
+ *   val_t *name_entry(const name *tree, key_t key);
+ *
+ *   ulong name_size(const name *tree);
+ *
+ *   Non-consuming iterator, invalidated by any insertion/removal,
+ *   'key'/'value' of the returned 'name_node' can be read directly.
+ *   name_iter name_iter_new(const name *tree);
+ *   name_node *name_iter_next(name_iter *iter);
+ *   name_node *name_iter_next_back(name_iter *iter);
+ */
+#define CTREE_DEFINE_INTKEY(name, key_t, val_t)                                \
+  typedef struct name##_node name##_node;                                      \
+                                                                               \
+  struct name##_node {                                                         \
+    key_t key;                                                                 \
+    val_t value;                                                               \
+    int height;                                                                \
+    name##_node *left;                                                         \
+    name##_node *right;                                                        \
+    name##_node *parent;                                                       \
+  };                                                                           \
+                                                                               \
+  typedef struct name {                                                        \
+    name##_node *root;                                                         \
+    ulong size;                                                                \
+  } name;                                                                      \
+                                                                               \
+  typedef struct name##_iter {                                                 \
+    name##_node *front;                                                        \
+    name##_node *back;                                                         \
+    ulong size;                                                                \
+  } name##_iter;                                                               \
+                                                                               \
+  static inline name *name##_new(void) {                                       \
+    name *tree = (name *)calloc(1, sizeof(name));                              \
+    if (tree == NULL)                                                          \
+      COL_ALLOC_ERROR;                                                         \
+    return tree;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline void _##name##_freeall(name##_node *node) {                    \
+    name##_node *right;                                                        \
+    for (; node != NULL; node = right) {                                       \
+      _##name##_freeall(node->left);                                           \
+      right = node->right;                                                     \
+      free(node);                                                              \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline void name##_free(name *tree) {                                 \
+    if (tree != NULL) {                                                        \
+      _##name##_freeall(tree->root);                                           \
+      free(tree);                                                              \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline int _##name##_height(const name##_node *node) {                \
+    return (node != NULL) ? node->height : -1;                                 \
+  }                                                                            \
+                                                                               \
+  static inline void _##name##_update(name##_node *node) {                     \
+    int left = _##name##_height(node->left);                                   \
+    int right = _##name##_height(node->right);                                 \
+    node->height = ((left > right) ? left : right) + 1;                        \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *_##name##_rotate_left(name##_node *node) {        \
+    name##_node *pivot = node->right;                                          \
+    if ((node->right = pivot->left) != NULL)                                   \
+      node->right->parent = node;                                              \
+    pivot->left = node;                                                        \
+    pivot->parent = node->parent;                                              \
+    node->parent = pivot;                                                      \
+    _##name##_update(node);                                                    \
+    _##name##_update(pivot);                                                   \
+    return pivot;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *_##name##_rotate_right(name##_node *node) {       \
+    name##_node *pivot = node->left;                                           \
+    if ((node->left = pivot->right) != NULL)                                   \
+      node->left->parent = node;                                               \
+    pivot->right = node;                                                       \
+    pivot->parent = node->parent;                                              \
+    node->parent = pivot;                                                      \
+    _##name##_update(node);                                                    \
+    _##name##_update(pivot);                                                   \
+    return pivot;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *_##name##_rebalance(name##_node *node) {          \
+    int balance;                                                               \
+    _##name##_update(node);                                                    \
+    balance = _##name##_height(node->right) - _##name##_height(node->left);    \
+    if (balance > 1) {                                                         \
+      if (_##name##_height(node->right->right) <                               \
+          _##name##_height(node->right->left))                                 \
+        node->right = _##name##_rotate_right(node->right);                     \
+      return _##name##_rotate_left(node);                                      \
+    } else if (balance < -1) {                                                 \
+      if (_##name##_height(node->left->left) <                                 \
+          _##name##_height(node->left->right))                                 \
+        node->left = _##name##_rotate_left(node->left);                        \
+      return _##name##_rotate_right(node);                                     \
+    }                                                                          \
+    return node;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Rebalances the path from the 'node' up, stops once the height of */       \
+  /* the subtree stays the same. */                                            \
+  static inline void _##name##_retrace(name *tree, name##_node *node) {        \
+    name##_node *parent;                                                       \
+    name##_node **slot;                                                        \
+    name##_node *sub;                                                          \
+    int height;                                                                \
+    for (; node != NULL; node = parent) {                                      \
+      parent = node->parent;                                                   \
+      slot = (parent == NULL)         ? &tree->root                            \
+             : (parent->left == node) ? &parent->left                          \
+                                      : &parent->right;                        \
+      height = node->height;                                                   \
+      *slot = sub = _##name##_rebalance(node);                                 \
+      if (sub == node && sub->height == height)                                \
+        break;                                                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_insert(name *tree, key_t key, val_t value) {       \
+    name##_node **slot = &tree->root;                                          \
+    name##_node *parent = NULL;                                                \
+    name##_node *node;                                                         \
+    while ((node = *slot) != NULL) {                                           \
+      parent = node;                                                           \
+      if (key < node->key)                                                     \
+        slot = &node->left;                                                    \
+      else if (node->key < key)                                                \
+        slot = &node->right;                                                   \
+      else {                                                                   \
+        node->value = value;                                                   \
+        return false;                                                          \
+      }                                                                        \
+    }                                                                          \
+    if ((node = (name##_node *)malloc(sizeof(name##_node))) == NULL) {         \
+      COL_ALLOC_ERROR;                                                         \
+      return false;                                                            \
+    }                                                                          \
+    node->key = key;                                                           \
+    node->value = value;                                                       \
+    node->height = 0;                                                          \
+    node->left = NULL;                                                         \
+    node->right = NULL;                                                        \
+    node->parent = parent;                                                     \
+    *slot = node;                                                              \
+    tree->size++;                                                              \
+    _##name##_retrace(tree, parent);                                           \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *_##name##_find(const name *tree, key_t key) {     \
+    name##_node *node = tree->root;                                            \
+    while (node != NULL) {                                                     \
+      if (key < node->key)                                                     \
+        node = node->left;                                                     \
+      else if (node->key < key)                                                \
+        node = node->right;                                                    \
+      else                                                                     \
+        break;                                                                 \
+    }                                                                          \
+    return node;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline val_t *name##_entry(const name *tree, key_t key) {             \
+    name##_node *node = _##name##_find(tree, key);                             \
+    return (node != NULL) ? &node->value : NULL;                               \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_remove(name *tree, key_t key, val_t *value) {      \
+    name##_node *node = _##name##_find(tree, key);                             \
+    name##_node *child;                                                        \
+    name##_node *parent;                                                       \
+    if (node == NULL)                                                          \
+      return false;                                                            \
+    if (value != NULL)                                                         \
+      *value = node->value;                                                    \
+    if (node->left != NULL && node->right != NULL) {                           \
+      name##_node *succ = node->right;                                         \
+      while (succ->left != NULL)                                               \
+        succ = succ->left;                                                     \
+      node->key = succ->key;                                                   \
+      node->value = succ->value;                                               \
+      node = succ;                                                             \
+    }                                                                          \
+    child = (node->left != NULL) ? node->left : node->right;                   \
+    parent = node->parent;                                                     \
+    if (child != NULL)                                                         \
+      child->parent = parent;                                                  \
+    if (parent == NULL)                                                        \
+      tree->root = child;                                                      \
+    else if (parent->left == node)                                             \
+      parent->left = child;                                                    \
+    else                                                                       \
+      parent->right = child;                                                   \
+    free(node);                                                                \
+    tree->size--;                                                              \
+    _##name##_retrace(tree, parent);                                           \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline ulong name##_size(const name *tree) { return tree->size; }     \
+                                                                               \
+  static inline name##_iter name##_iter_new(const name *tree) {                \
+    name##_iter iter = {tree->root, tree->root, tree->size};                   \
+    if (iter.front != NULL) {                                                  \
+      while (iter.front->left != NULL)                                         \
+        iter.front = iter.front->left;                                         \
+      while (iter.back->right != NULL)                                         \
+        iter.back = iter.back->right;                                          \
+    }                                                                          \
+    return iter;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *name##_iter_next(name##_iter *iter) {             \
+    name##_node *node = iter->front;                                           \
+    name##_node *next = node;                                                  \
+    if (iter->size == 0)                                                       \
+      return NULL;                                                             \
+    if (--iter->size > 0) {                                                    \
+      if (next->right != NULL) {                                               \
+        for (next = next->right; next->left != NULL; next = next->left)        \
+          ;                                                                    \
+      } else {                                                                 \
+        while (next->parent->right == next)                                    \
+          next = next->parent;                                                 \
+        next = next->parent;                                                   \
+      }                                                                        \
+      iter->front = next;                                                      \
+    }                                                                          \
+    return node;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_node *name##_iter_next_back(name##_iter *iter) {        \
+    name##_node *node = iter->back;                                            \
+    name##_node *prev = node;                                                  \
+    if (iter->size == 0)                                                       \
+      return NULL;                                                             \
+    if (--iter->size > 0) {                                                    \
+      if (prev->left != NULL) {                                                \
+        for (prev = prev->left; prev->right != NULL; prev = prev->right)       \
+          ;                                                                    \
+      } else {                                                                 \
+        while (prev->parent->left == prev)                                     \
+          prev = prev->parent;                                                 \
+        prev = prev->parent;                                                   \
+      }                                                                        \
+      iter->back = prev;                                                       \
+    }                                                                          \
+    return node;                                                               \
+  }                                                                            \
+  struct name##_node
+
+#endif
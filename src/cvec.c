@@ -420,6 +420,19 @@ cvec_pop(cvec* vec)
     return ret_val;
 }
 
+/*
+ * Shortens the 'vec' to its first 'len' elements, elements past it are
+ * dropped without calling the 'clear_val_fn' and the 'buffer' is kept
+ * as is, so unlike 'cvec_pop' it never allocates.
+ * Does nothing if 'len' is not smaller than the 'vec' 'len'.
+ */
+void
+cvec_truncate(cvec* vec, uint len)
+{
+    if(vec != NULL && len < vec->len)
+        vec->len = len;
+}
+
 /*
  * Getter function, returns length of 'vec'.
  * If 'vec' is NULL function returns -1.
@@ -35,6 +35,8 @@ uint cvec_push(cvec *vec, cconstptr_t value);
 
 cptr_t cvec_pop(cvec *vec);
 
+void cvec_truncate(cvec *vec, uint len);
+
 void cvec_clear(cvec *vec);
 
 void cvec_clear_with_cap(cvec *vec);
@@ -0,0 +1,212 @@
+#define __COL_TEST__
+#include "../../../src/ctree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Compares the 'CTREE_AVL', 'CTREE_RB' and 'CTREE_WAVL' policies on the
+ * write-heavy workloads of the ingestion trees, every workload is timed
+ * on the fresh tree of each policy and the fastest one is marked.
+ *
+ * RB and WAVL pay fewer rotations (and height updates) per update, so
+ * they should win the ingest/delete heavy workloads. AVL keeps the tree
+ * the shallowest, which only pays off once the lookups dominate.
+ *
+ * Usage: ctree_policy_bench [keys]
+ */
+
+#define POLICIES 3
+
+typedef enum {
+    WL_SORTED_INGEST,
+    WL_RANDOM_INGEST,
+    WL_WINDOW_CHURN,
+    WL_RANDOM_CHURN,
+    WL_RANDOM_DELETE,
+    WL_LOOKUP,
+    WORKLOADS,
+} workload;
+
+static const char* workload_names[WORKLOADS] = {
+    "sorted ingest",
+    "random ingest",
+    "window churn (insert newest, remove oldest)",
+    "random churn (remove + insert)",
+    "random delete (drain)",
+    "random lookup",
+};
+
+static const ctree_policy policies[POLICIES]      = { CTREE_AVL, CTREE_RB, CTREE_WAVL };
+static const char*        policy_names[POLICIES] = { "avl", "rb", "wavl" };
+
+static int*   keys;
+static ulong* order;
+static ulong  n;
+
+static int
+int_cmp(const int* left, const int* right)
+{
+    return (*left > *right) - (*left < *right);
+}
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Fills the 'indices' with the shuffled 0..count-1 (xorshift, fixed
+ * 'seed' so every policy gets the same sequence).
+ */
+static void
+shuffle(ulong* indices, ulong count, ulong seed)
+{
+    ulong state = seed * 0x9E3779B97F4A7C15UL + 1;
+
+    for(ulong i = 0; i < count; i++)
+        indices[i] = i;
+
+    for(ulong i = count; i > 1; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        ulong j   = state % i;
+        ulong tmp = indices[i - 1];
+
+        indices[i - 1] = indices[j];
+        indices[j]     = tmp;
+    }
+}
+
+static ctree*
+tree_new(ctree_policy policy)
+{
+    // Keys live in the 'keys' array, tree owns nothing
+    return ctree_new_with_policy((CCompareKeyFn) int_cmp, NULL, NULL, NULL, NULL, CTREE_DEFAULT, policy);
+}
+
+static void
+ingest_random(ctree* tree)
+{
+    for(ulong i = 0; i < n; i++)
+        ctree_insert(tree, &keys[order[i]], NULL);
+}
+
+/*
+ * Runs the 'wl' on the fresh tree of the 'policy', only the workload
+ * itself is timed (setup isn't).
+ * Returns the elapsed milliseconds.
+ */
+static double
+run(workload wl, ctree_policy policy)
+{
+    ctree* tree = tree_new(policy);
+    double start, end;
+    ulong  found = 0;
+
+    if(tree == NULL) {
+        fprintf(stderr, "ctree could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(wl >= WL_WINDOW_CHURN)
+        ingest_random(tree);
+
+    start = now_ms();
+
+    switch(wl) {
+        case WL_SORTED_INGEST:
+            for(ulong i = 0; i < n; i++)
+                ctree_insert(tree, &keys[i], NULL);
+            break;
+        case WL_RANDOM_INGEST:
+            ingest_random(tree);
+            break;
+        case WL_WINDOW_CHURN:
+            // Keys n..2n-1 arrive in order as the oldest ones expire
+            for(ulong i = 0; i < n; i++) {
+                ctree_insert(tree, &keys[n + i], NULL);
+                ctree_remove(tree, &keys[i], false);
+            }
+            break;
+        case WL_RANDOM_CHURN:
+            for(ulong i = 0; i < n; i++) {
+                ctree_remove(tree, &keys[order[i]], false);
+                ctree_insert(tree, &keys[n + order[i]], NULL);
+            }
+            break;
+        case WL_RANDOM_DELETE:
+            for(ulong i = n; i > 0; i--)
+                ctree_remove(tree, &keys[order[i - 1]], false);
+            break;
+        case WL_LOOKUP:
+            for(ulong r = 0; r < 4; r++)
+                for(ulong i = 0; i < n; i++)
+                    found += ctree_key(tree, &keys[order[(i * 7 + r) % n]]) != NULL;
+            break;
+        default:
+            break;
+    }
+
+    end = now_ms();
+
+    // Every lookup must hit
+    if(wl == WL_LOOKUP && found != 4 * n) {
+        fprintf(stderr, "%s: lookups missed\n", policy_names[policy]);
+        exit(EXIT_FAILURE);
+    }
+
+    ctree_free(tree);
+
+    return end - start;
+}
+
+int
+main(int argc, char** argv)
+{
+    n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+
+    if(n == 0 || (keys = malloc(2 * n * sizeof(int))) == NULL || (order = malloc(n * sizeof(ulong))) == NULL) {
+        fprintf(stderr, "usage: %s [keys > 0]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(ulong i = 0; i < 2 * n; i++)
+        keys[i] = (int) i;
+
+    shuffle(order, n, 42);
+
+    printf("ctree policies, %lu keys, ms (best of 3)\n\n", n);
+    printf("%-44s %10s %10s %10s  winner\n", "workload", "avl", "rb", "wavl");
+
+    for(int wl = 0; wl < WORKLOADS; wl++) {
+        double best[POLICIES];
+        int    winner = 0;
+
+        for(int p = 0; p < POLICIES; p++) {
+            best[p] = run(wl, policies[p]);
+
+            for(int rep = 1; rep < 3; rep++) {
+                double ms = run(wl, policies[p]);
+                if(ms < best[p])
+                    best[p] = ms;
+            }
+
+            if(best[p] < best[winner])
+                winner = p;
+        }
+
+        printf("%-44s %10.1f %10.1f %10.1f  %s\n", workload_names[wl], best[0], best[1], best[2], policy_names[winner]);
+    }
+
+    free(keys);
+    free(order);
+
+    return EXIT_SUCCESS;
+}
@@ -1,8 +1,16 @@
 #include <assert.h>
 #define __COL_TEST__
 #include "../../../src/ctree.h"
+#include "../../../src/ctree_intkey.h"
+#include "../../../src/cvec.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stest.h>
 
 // ****************************************************************//
@@ -54,6 +62,23 @@ rank_new(unsigned int global, unsigned int local)
     return r;
 }
 
+int
+int_cmp(const int* left, const int* right)
+{
+    return (*left > *right) - (*left < *right);
+}
+
+int*
+int_new(int value)
+{
+    int* i = (int*) malloc(sizeof(int));
+
+    if(i != NULL)
+        *i = value;
+
+    return i;
+}
+
 // ****************************************************************//
 //                           MAIN RUNNER
 // ****************************************************************//
@@ -62,6 +87,30 @@ TEST(ctree_create_test);
 TEST(ctree_insert_test);
 TEST(ctree_remove_test);
 TEST(ctree_entry_test);
+TEST(ctree_iter_test);
+TEST(ctree_concurrent_test);
+TEST(ctree_snapshot_test);
+TEST(ctree_set_operations_test);
+TEST(ctree_split_join_test);
+TEST(ctree_insert_batch_test);
+TEST(ctree_intkey_test);
+TEST(ctree_prefix_test);
+TEST(ctree_entry_api_test);
+TEST(ctree_finger_test);
+TEST(ctree_save_load_test);
+TEST(ctree_iterator_drain_test);
+TEST(ctree_policy_test);
+TEST(ctree_inline_test);
+TEST(ctree_sharded_test);
+TEST(ctree_par_test);
+TEST(ctree_entry_batch_test);
+TEST(ctree_free_async_test);
+TEST(ctree_first_last_test);
+TEST(ctree_freeze_test);
+TEST(ctree_compact_test);
+TEST(ctree_splay_test);
+TEST(ctree_cache_test);
+TEST(ctree_retain_test);
 
 int
 main(void)
@@ -72,6 +121,30 @@ main(void)
     ssuite_add_test(suite, ctree_insert_test);
     ssuite_add_test(suite, ctree_remove_test);
     ssuite_add_test(suite, ctree_entry_test);
+    ssuite_add_test(suite, ctree_iter_test);
+    ssuite_add_test(suite, ctree_concurrent_test);
+    ssuite_add_test(suite, ctree_snapshot_test);
+    ssuite_add_test(suite, ctree_set_operations_test);
+    ssuite_add_test(suite, ctree_split_join_test);
+    ssuite_add_test(suite, ctree_insert_batch_test);
+    ssuite_add_test(suite, ctree_intkey_test);
+    ssuite_add_test(suite, ctree_prefix_test);
+    ssuite_add_test(suite, ctree_entry_api_test);
+    ssuite_add_test(suite, ctree_finger_test);
+    ssuite_add_test(suite, ctree_save_load_test);
+    ssuite_add_test(suite, ctree_iterator_drain_test);
+    ssuite_add_test(suite, ctree_policy_test);
+    ssuite_add_test(suite, ctree_inline_test);
+    ssuite_add_test(suite, ctree_sharded_test);
+    ssuite_add_test(suite, ctree_par_test);
+    ssuite_add_test(suite, ctree_entry_batch_test);
+    ssuite_add_test(suite, ctree_free_async_test);
+    ssuite_add_test(suite, ctree_first_last_test);
+    ssuite_add_test(suite, ctree_freeze_test);
+    ssuite_add_test(suite, ctree_compact_test);
+    ssuite_add_test(suite, ctree_splay_test);
+    ssuite_add_test(suite, ctree_cache_test);
+    ssuite_add_test(suite, ctree_retain_test);
 
     srunner* runner = srunner_new();
     srunner_add_suite(runner, suite);
@@ -86,7 +159,7 @@ main(void)
 // ****************************************************************//
 TEST(ctree_create_test)
 {
-    ctree* tree = ctree_new((CCompareKeyFn) strcmp, NULL, NULL);
+    ctree* tree = ctree_new((CCompareKeyFn) strcmp, NULL, NULL, NULL, NULL);
 
     ASSERT(tree != NULL);
 
@@ -99,7 +172,7 @@ TEST(ctree_create_test)
 
 TEST(ctree_insert_test)
 {
-    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free);
+    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free, NULL, NULL);
     ASSERT_EQ(ctree_size_bytes(tree), 0);
     ASSERT_EQ(ctree_size(tree), 0);
 
@@ -150,7 +223,7 @@ TEST(ctree_insert_test)
 TEST(ctree_remove_test)
 {
     // First we insert doing the same thing
-    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free);
+    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free, NULL, NULL);
     ASSERT_EQ(ctree_size_bytes(tree), 0);
     ASSERT_EQ(ctree_size(tree), 0);
 
@@ -186,13 +259,13 @@ TEST(ctree_remove_test)
     ASSERT_NEQ(ctree_size_bytes(tree), 0);
 
     // Now we remove
-    ASSERT(ctree_remove(tree, ath1));
+    ASSERT(ctree_remove(tree, ath1, false));
     ASSERT(ctree_size(tree) == 3);
-    ASSERT(ctree_remove(tree, ath3));
+    ASSERT(ctree_remove(tree, ath3, false));
     ASSERT(ctree_size(tree) == 2);
-    ASSERT(ctree_remove(tree, ath2));
+    ASSERT(ctree_remove(tree, ath2, false));
     ASSERT(ctree_size(tree) == 1);
-    ASSERT(ctree_remove(tree, ath4));
+    ASSERT(ctree_remove(tree, ath4, false));
     ASSERT(ctree_size(tree) == 0);
     ASSERT(ctree_size_bytes(tree) == 0);
 
@@ -201,7 +274,7 @@ TEST(ctree_remove_test)
 
 TEST(ctree_entry_test)
 {
-    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free);
+    ctree* tree = ctree_new((CCompareKeyFn) athlete_cmp, free, free, NULL, NULL);
     ASSERT_EQ(ctree_size_bytes(tree), 0);
     ASSERT_EQ(ctree_size(tree), 0);
 
@@ -251,3 +324,1414 @@ TEST(ctree_entry_test)
     free(ath5);
     ctree_free(tree);
 }
+
+TEST(ctree_iter_test)
+{
+    ctree* tree = ctree_new((CCompareKeyFn) int_cmp, free, NULL, NULL, NULL);
+
+    // Insert 0..999 out of order
+    for(int i = 0; i < 1000; i++)
+        ASSERT(ctree_insert(tree, int_new((i * 7) % 1000), NULL));
+
+    ASSERT_EQ(ctree_size(tree), 1000);
+
+    ctree_iter  iter = ctree_iter_new(tree);
+    ctree_node* node;
+    int         expected = 0;
+
+    while((node = ctree_iter_next(&iter)) != NULL)
+        ASSERT_EQ(*(int*) ctree_node_key(node), expected++);
+
+    ASSERT_EQ(expected, 1000);
+
+    // Remove every even key, iterate from the back
+    for(int i = 0; i < 1000; i += 2) {
+        int key = i;
+        ASSERT(ctree_remove(tree, &key, false));
+    }
+
+    iter     = ctree_iter_new(tree);
+    expected = 999;
+
+    while((node = ctree_iter_next_back(&iter)) != NULL) {
+        ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+        expected -= 2;
+    }
+
+    ASSERT_EQ(expected, -1);
+
+    // Both ends meet in the middle
+    iter        = ctree_iter_new(tree);
+    int visited = 0;
+
+    while(ctree_iter_next(&iter) != NULL) {
+        visited++;
+
+        if(ctree_iter_next_back(&iter) == NULL)
+            break;
+
+        visited++;
+    }
+
+    ASSERT_EQ(visited, 500);
+
+    ctree_free(tree);
+}
+
+static atomic_bool concurrent_done;
+
+// Reader thread, every key 'k' inside of the tree maps to 'k * 2'
+void*
+concurrent_reader(void* arg)
+{
+    ctree* tree  = arg;
+    int    found = 0;
+
+    while(!atomic_load(&concurrent_done)) {
+        ctree_read_enter(tree);
+
+        ctree_iter  iter = ctree_iter_new(tree);
+        ctree_node* node;
+        int         last = -1;
+
+        while((node = ctree_iter_next(&iter)) != NULL) {
+            int key = *(int*) ctree_node_key(node);
+
+            if(key <= last || *(int*) ctree_node_value(node) != key * 2)
+                return NULL;
+
+            last = key;
+            found++;
+        }
+
+        ctree_read_exit(tree);
+    }
+
+    return (void*) (size_t) (found + 1);
+}
+
+TEST(ctree_concurrent_test)
+{
+    ctree* tree = ctree_new_with_mode((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_CONCURRENT);
+    ASSERT_NEQ(tree, NULL);
+
+    pthread_t readers[4];
+    atomic_store(&concurrent_done, false);
+
+    for(int i = 0; i < 4; i++)
+        ASSERT_EQ(pthread_create(&readers[i], NULL, concurrent_reader, tree), 0);
+
+    for(int round = 0; round < 20; round++) {
+        for(int i = 0; i < 500; i++)
+            ASSERT(ctree_insert(tree, int_new(i), int_new(i * 2)));
+
+        ASSERT_EQ(ctree_size(tree), 500);
+
+        for(int i = 0; i < 500; i++) {
+            int key = i;
+            ASSERT_EQ(*(int*) ctree_entry(tree, &key), i * 2);
+            ASSERT(ctree_remove(tree, &key, false));
+        }
+
+        ASSERT_EQ(ctree_size(tree), 0);
+    }
+
+    atomic_store(&concurrent_done, true);
+
+    for(int i = 0; i < 4; i++) {
+        void* result;
+        pthread_join(readers[i], &result);
+        ASSERT_NEQ(result, NULL);
+    }
+
+    ctree_free(tree);
+}
+
+TEST(ctree_snapshot_test)
+{
+    ctree* tree = ctree_new_with_mode((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_PERSISTENT);
+    ASSERT_NEQ(tree, NULL);
+
+    for(int i = 0; i < 100; i++)
+        ASSERT(ctree_insert(tree, int_new(i), int_new(i)));
+
+    ctree* snapshot = ctree_snapshot(tree);
+    ASSERT_NEQ(snapshot, NULL);
+
+    // Modify every key of the tree after the snapshot was taken
+    for(int i = 0; i < 100; i += 2) {
+        int key = i;
+        ASSERT(ctree_remove(tree, &key, false));
+    }
+
+    // Existing keys only get their values updated, key stays with the caller
+    for(int i = 1; i < 100; i += 2) {
+        int key = i;
+        ASSERT(!ctree_insert(tree, &key, int_new(-i)));
+    }
+
+    ASSERT_EQ(ctree_size(tree), 50);
+    ASSERT_EQ(ctree_size(snapshot), 100);
+
+    // Snapshot still sees the tree as it was
+    ctree_iter  iter = ctree_iter_new(snapshot);
+    ctree_node* node;
+    int         expected = 0;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+        ASSERT_EQ(*(int*) ctree_node_value(node), expected);
+        expected++;
+    }
+
+    ASSERT_EQ(expected, 100);
+
+    int key = 3;
+    ASSERT_EQ(*(int*) ctree_entry(tree, &key), -3);
+    ASSERT_EQ(*(int*) ctree_entry(snapshot, &key), 3);
+
+    // Snapshots are read only
+    ASSERT(!ctree_remove(snapshot, &key, false));
+
+    ctree_free(snapshot);
+
+    key = 4;
+    ASSERT_EQ(ctree_entry(tree, &key), NULL);
+
+    ctree_free(tree);
+}
+
+// Tree holding keys 'from', 'from + step', ... below 'to', each key maps to 'key * mult'
+ctree*
+int_tree_new(int from, int to, int step, int mult)
+{
+    ctree* tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+
+    for(int i = from; i < to; i += step)
+        ctree_insert(tree, int_new(i), int_new(i * mult));
+
+    return tree;
+}
+
+cptr_t
+int_sum(cconstptr_t key, cptr_t value, cptr_t other_value)
+{
+    (void) key;
+    *(int*) value += *(int*) other_value;
+    return value;
+}
+
+TEST(ctree_set_operations_test)
+{
+    // Multiples of 2 and multiples of 3 below 3000
+    ctree* tree  = int_tree_new(0, 3000, 2, 1);
+    ctree* other = int_tree_new(0, 3000, 3, 1);
+
+    ASSERT(ctree_union(tree, &other));
+    ASSERT_EQ(other, NULL);
+    ASSERT_EQ(ctree_size(tree), 2000);
+
+    ctree_iter  iter = ctree_iter_new(tree);
+    ctree_node* node;
+    int         last = -1;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        int key = *(int*) ctree_node_key(node);
+        ASSERT(key > last && (key % 2 == 0 || key % 3 == 0));
+        last = key;
+    }
+
+    other = int_tree_new(0, 3000, 6, 1);
+    ASSERT(ctree_difference(tree, &other));
+    ASSERT_EQ(ctree_size(tree), 1500);
+
+    other = int_tree_new(0, 3000, 4, 1);
+    ASSERT(ctree_intersection(tree, &other));
+    ASSERT_EQ(ctree_size(tree), 500);
+
+    for(int i = 0; i < 3000; i++)
+        ASSERT_EQ(ctree_entry(tree, &i) != NULL, i % 4 == 0 && i % 6 != 0);
+
+    other = int_tree_new(0, 3000, 4, 10);
+    ASSERT(ctree_merge_with(tree, &other, int_sum));
+    ASSERT_EQ(ctree_size(tree), 750);
+
+    for(int i = 0; i < 3000; i += 4)
+        ASSERT_EQ(*(int*) ctree_entry(tree, &i), (i % 6 != 0) ? i * 11 : i * 10);
+
+    ctree_free(tree);
+}
+
+TEST(ctree_split_join_test)
+{
+    ctree* tree = int_tree_new(0, 1000, 1, 1);
+    ctree* left;
+    ctree* right;
+    int    key = 400;
+
+    ASSERT(ctree_split(&tree, &key, &left, &right));
+    ASSERT_EQ(tree, NULL);
+    ASSERT_EQ(ctree_size(left), 400);
+    ASSERT_EQ(ctree_size(right), 600);
+    ASSERT_EQ(ctree_entry(left, &key), NULL);
+    ASSERT_NEQ(ctree_entry(right, &key), NULL);
+
+    // Order of the joined trees does not matter
+    ASSERT(ctree_join(right, &left));
+    ASSERT_EQ(left, NULL);
+    ASSERT_EQ(ctree_size(right), 1000);
+
+    ctree* overlapping = int_tree_new(500, 501, 1, 1);
+    ASSERT(!ctree_join(right, &overlapping));
+    ctree_free(overlapping);
+
+    int lo = 100, hi = 900;
+    ASSERT(ctree_remove_range(right, &lo, &hi, false));
+    ASSERT_EQ(ctree_size(right), 200);
+    ASSERT(!ctree_remove_range(right, &lo, &hi, false));
+
+    ctree_iter  iter = ctree_iter_new(right);
+    ctree_node* node;
+    int         expected = 0;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+        expected = (expected == 99) ? 900 : expected + 1;
+    }
+
+    ASSERT_EQ(expected, 1000);
+
+    lo = 0;
+    hi = 1000;
+    ASSERT(ctree_remove_range(right, &lo, &hi, true));
+    ASSERT_EQ(ctree_size(right), 0);
+
+    ctree_free(right);
+}
+
+TEST(ctree_insert_batch_test)
+{
+    // Even keys below 2000
+    ctree* tree = int_tree_new(0, 2000, 2, 1);
+    cptr_t keys[3000];
+    cptr_t values[3000];
+    ulong  updated;
+
+    // Small batch in descending order, half of the keys exist
+    for(int i = 0; i < 200; i++) {
+        keys[i]   = int_new(199 - i);
+        values[i] = int_new(-(199 - i));
+    }
+
+    ASSERT_EQ(ctree_insert_batch(tree, keys, values, 200, &updated), 100);
+    ASSERT_EQ(updated, 100);
+    ASSERT_EQ(ctree_size(tree), 1100);
+
+    for(int i = 0; i < 200; i++)
+        if(ctree_key(tree, keys[i]) != keys[i])
+            free(keys[i]);
+
+    for(int i = 0; i < 2000; i++) {
+        int* value = ctree_entry(tree, &i);
+        ASSERT_EQ(value != NULL, i < 200 || i % 2 == 0);
+        if(value != NULL)
+            ASSERT_EQ(*value, (i < 200) ? -i : i);
+    }
+
+    // Large batch with repeated keys rebuilds the tree
+    for(int i = 0; i < 3000; i++) {
+        keys[i]   = int_new(i % 1500 + 1500);
+        values[i] = int_new(i);
+    }
+
+    ASSERT_EQ(ctree_insert_batch(tree, keys, values, 3000, &updated), 1250);
+    ASSERT_EQ(updated, 1750);
+    ASSERT_EQ(ctree_size(tree), 2350);
+
+    for(int i = 0; i < 3000; i++)
+        if(ctree_key(tree, keys[i]) != keys[i])
+            free(keys[i]);
+
+    for(int i = 1500; i < 3000; i++)
+        ASSERT_EQ(*(int*) ctree_entry(tree, &i), i);
+
+    ctree_iter  iter = ctree_iter_new(tree);
+    ctree_node* node;
+    int         last = -1;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        ASSERT(*(int*) ctree_node_key(node) > last);
+        last = *(int*) ctree_node_key(node);
+    }
+
+    ASSERT_EQ(last, 2999);
+
+    ctree_free(tree);
+
+    // Red-black tree inserts one by one, counts split the same way
+    tree = ctree_new_with_policy((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_DEFAULT, CTREE_RB);
+
+    for(int i = 0; i < 200; i += 2)
+        ASSERT(ctree_insert(tree, int_new(i), int_new(i)));
+
+    for(int i = 0; i < 200; i++) {
+        keys[i]   = int_new(i);
+        values[i] = int_new(-i);
+    }
+
+    ASSERT_EQ(ctree_insert_batch(tree, keys, values, 200, &updated), 100);
+    ASSERT_EQ(updated, 100);
+    ASSERT_EQ(ctree_size(tree), 200);
+
+    for(int i = 0; i < 200; i += 2)
+        free(keys[i]);
+
+    ctree_free(tree);
+
+    // Read-only snapshot takes nothing, nothing is counted
+    tree = ctree_new_with_mode((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_PERSISTENT);
+    ASSERT(ctree_insert(tree, int_new(1), int_new(1)));
+
+    ctree* frozen  = ctree_snapshot(tree);
+
+    int    probe[] = { 0, 1 };
+
+    keys[0] = &probe[0];
+    keys[1] = &probe[1];
+
+    ASSERT_EQ(ctree_insert_batch(frozen, keys, NULL, 2, &updated), 0);
+    ASSERT_EQ(updated, 0);
+
+    ctree_free(frozen);
+    ctree_free(tree);
+}
+
+CTREE_DEFINE_INTKEY(u64tree, uint64_t, int);
+
+TEST(ctree_intkey_test)
+{
+    u64tree* tree = u64tree_new();
+    ASSERT(tree != NULL);
+
+    // Keys 0, 7, 14, ... inserted out of order
+    for(uint64_t i = 0; i < 1000; i++)
+        ASSERT(u64tree_insert(tree, (i * 7 * 333) % 7000, (int) i));
+
+    ASSERT_EQ(u64tree_size(tree), 1000);
+    ASSERT(!u64tree_insert(tree, 7, -1));
+    ASSERT_EQ(*u64tree_entry(tree, 7), -1);
+    ASSERT_EQ(u64tree_entry(tree, 8), NULL);
+
+    int value;
+    ASSERT(u64tree_remove(tree, 7, &value));
+    ASSERT_EQ(value, -1);
+    ASSERT(!u64tree_remove(tree, 7, NULL));
+
+    for(uint64_t i = 700; i < 7000; i += 7)
+        ASSERT(u64tree_remove(tree, i, NULL));
+
+    ASSERT_EQ(u64tree_size(tree), 99);
+
+    u64tree_iter  iter = u64tree_iter_new(tree);
+    u64tree_node* node;
+    uint64_t      expected = 0;
+
+    while((node = u64tree_iter_next(&iter)) != NULL) {
+        ASSERT_EQ(node->key, expected);
+        expected += (expected == 0) ? 14 : 7;
+    }
+
+    ASSERT_EQ(expected, 700);
+
+    iter = u64tree_iter_new(tree);
+    ASSERT_EQ(u64tree_iter_next_back(&iter)->key, 693);
+
+    u64tree_free(tree);
+}
+
+int str_cmp_calls = 0;
+
+int
+str_cmp_counted(const char* left, const char* right)
+{
+    str_cmp_calls++;
+    return strcmp(left, right);
+}
+
+TEST(ctree_prefix_test)
+{
+    ctree*      tree    = ctree_new((CCompareKeyFn) str_cmp_counted, NULL, NULL, NULL, NULL);
+    const char* words[] = { "pear", "apple", "banana", "cherry", "plum", "peach", "apricot", "fig" };
+
+    ASSERT(ctree_set_prefix_fn(tree, ctree_prefix_str));
+
+    for(int i = 0; i < 8; i++)
+        ASSERT(ctree_insert(tree, (cptr_t) words[i], NULL));
+
+    // Prefix can't change once the tree holds the keys
+    ASSERT(!ctree_set_prefix_fn(tree, NULL));
+
+    // Distinct prefixes, comparator only confirms the match
+    str_cmp_calls = 0;
+    ASSERT_EQ(ctree_key(tree, "cherry"), words[3]);
+    ASSERT_EQ(ctree_key(tree, "grape"), NULL);
+#ifndef COL_MEMORY_CONSTRAINED
+    ASSERT_EQ(str_cmp_calls, 1);
+#endif
+
+    // Keys sharing the first 8 bytes fall back to the comparator
+    ASSERT(ctree_insert(tree, "watermelon", NULL));
+    ASSERT(ctree_insert(tree, "watermelons", NULL));
+    ASSERT_EQ(ctree_key(tree, "watermelo"), NULL);
+    ASSERT(ctree_remove(tree, "watermelon", false));
+    ASSERT(ctree_key(tree, "watermelons") != NULL);
+    ASSERT_EQ(ctree_size(tree), 9);
+
+    ctree_iter  iter = ctree_iter_new(tree);
+    ctree_node* node;
+    const char* last = "";
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        ASSERT(strcmp(last, ctree_node_key(node)) < 0);
+        last = ctree_node_key(node);
+    }
+
+    // Nodes of the tree without the prefixes can't be moved over
+    ctree* other = ctree_new((CCompareKeyFn) str_cmp_counted, NULL, NULL, NULL, NULL);
+
+    ASSERT(ctree_insert(other, "avocado", NULL));
+    ASSERT(ctree_insert(other, "zucchini", NULL));
+    ASSERT(!ctree_union(tree, &other));
+    ASSERT(!ctree_join(tree, &other));
+    ASSERT_NEQ(other, NULL);
+    ASSERT_EQ(ctree_size(tree), 9);
+    ASSERT_EQ(ctree_key(tree, "avocado"), NULL);
+
+    ctree_free(other);
+    ctree_free(tree);
+}
+
+cptr_t
+int_zero(cconstptr_t key, cptr_t made)
+{
+    (void) key;
+    (*(int*) made)++;
+    return int_new(0);
+}
+
+cptr_t
+int_increment(cconstptr_t key, cptr_t value, cptr_t ctx)
+{
+    (void) key;
+    (void) ctx;
+
+    if(value == NULL)
+        return int_new(1);
+
+    (*(int*) value)++;
+    return value;
+}
+
+TEST(ctree_entry_api_test)
+{
+    ctree*  tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+    int     made = 0;
+    cptr_t* slot;
+
+    // Counting 0..99 where each key shows up key % 5 + 1 times
+    for(int i = 0; i < 100; i++) {
+        for(int j = 0; j <= i % 5; j++) {
+            int* key = int_new(i);
+            int  old = made;
+
+            slot = ctree_entry_or_insert(tree, key, int_zero, &made);
+            ASSERT(slot != NULL);
+            (*(int*) *slot)++;
+
+            if(made == old)
+                free(key);
+        }
+    }
+
+    ASSERT_EQ(made, 100);
+    ASSERT_EQ(ctree_size(tree), 100);
+
+    for(int i = 0; i < 100; i++)
+        ASSERT_EQ(*(int*) ctree_entry(tree, &i), i % 5 + 1);
+
+    // Slot stays valid while the tree changes
+    int key = 50;
+    slot    = ctree_get_or_insert(tree, &key, NULL);
+    ASSERT_EQ(*(int*) *slot, 1);
+
+    for(int i = 100; i < 200; i++)
+        ctree_insert(tree, int_new(i), int_new(i));
+
+    ASSERT_EQ(*slot, ctree_entry(tree, &key));
+
+    int* value = int_new(-1);
+    key        = 300;
+    ASSERT_EQ(*ctree_get_or_insert(tree, int_new(key), value), value);
+
+    int* stale_key = int_new(key);
+    ASSERT_EQ(*ctree_update_with(tree, stale_key, int_increment, NULL), value);
+    ASSERT_EQ(*value, 0);
+    free(stale_key);
+
+    key = 400;
+    ASSERT_EQ(*(int*) *ctree_update_with(tree, int_new(key), int_increment, NULL), 1);
+    ASSERT_EQ(ctree_size(tree), 202);
+
+    ctree_free(tree);
+}
+
+int int_cmp_calls = 0;
+
+int
+int_cmp_counted(const int* left, const int* right)
+{
+    int_cmp_calls++;
+    return int_cmp(left, right);
+}
+
+TEST(ctree_finger_test)
+{
+    ctree* tree = ctree_new_with_mode((CCompareKeyFn) int_cmp_counted, free, free, NULL, NULL, CTREE_FINGER);
+
+    // Ascending keys with the jitter
+    for(int i = 0; i < 10000; i++) {
+        int* key = int_new(i * 2 + (i % 3 == 1 ? 3 : 0));
+        if(!ctree_insert(tree, key, NULL))
+            free(key);
+    }
+
+    ASSERT(int_cmp_calls < 10000 * 4);
+
+    int key = 4003;
+    ASSERT_EQ(ctree_key(tree, &key), NULL);
+    key = 4000;
+    ASSERT_EQ(*(int*) ctree_key(tree, &key), 4000);
+    ASSERT(ctree_remove(tree, &key, false));
+
+    // Hints work without the finger mode as well
+    ctree*      other = int_tree_new(0, 100, 10, 1);
+    ctree_node* hint  = NULL;
+
+    for(int i = 0; i < 100; i++) {
+        if(i % 10 == 0)
+            continue;
+
+        hint = ctree_insert_hint(other, hint, int_new(i), int_new(i));
+        ASSERT_EQ(*(int*) ctree_node_key(hint), i);
+    }
+
+    ASSERT_EQ(ctree_size(other), 100);
+
+    key = 55;
+    ASSERT_EQ(ctree_find_hint(other, hint, &key), ctree_find_hint(other, NULL, &key));
+    key = 100;
+    ASSERT_EQ(ctree_find_hint(other, hint, &key), NULL);
+
+    ctree_free(other);
+    ctree_free(tree);
+}
+
+const void*
+int_serialize(cconstptr_t element, size_t* size)
+{
+    *size = sizeof(int);
+    return element;
+}
+
+cptr_t
+int_deserialize(const void* bytes, size_t size)
+{
+    (void) size;
+    return int_new(*(const int*) bytes);
+}
+
+int
+int_cmp_desc(const int* left, const int* right)
+{
+    return int_cmp(right, left);
+}
+
+TEST(ctree_save_load_test)
+{
+    ctree* tree   = int_tree_new(0, 5000, 3, 2);
+    char   path[] = "/tmp/ctree_test_XXXXXX";
+    int    fd     = mkstemp(path);
+
+    ASSERT(fd >= 0);
+    ASSERT(ctree_save(tree, fd, int_serialize, int_serialize));
+    close(fd);
+
+    ctree_mapped* map = ctree_load_mmap(path, (CCompareKeyFn) int_cmp);
+    ASSERT(map != NULL);
+    ASSERT_EQ(ctree_mapped_size(map), ctree_size(tree));
+
+    // Lookups straight from the mapping
+    for(int i = 0; i < 5000; i++) {
+        const int* value = ctree_mapped_entry(map, &i);
+        ASSERT_EQ(value != NULL, i % 3 == 0);
+        if(value != NULL)
+            ASSERT_EQ(*value, i * 2);
+    }
+
+    cconstptr_t key;
+    ASSERT(ctree_mapped_at(map, 10, &key, NULL));
+    ASSERT_EQ(*(const int*) key, 30);
+
+    // Live tree built without comparing keys
+    ctree* loaded = ctree_mapped_build(map, int_deserialize, int_deserialize, free, free);
+    ctree_mapped_free(map);
+
+    // Keys out of the comparator order are rejected
+    ASSERT_EQ(ctree_load_mmap(path, (CCompareKeyFn) int_cmp_desc), NULL);
+
+    // So is the misaligned key of the first record (right after the header)
+    uint64_t key_off = 4;
+    fd               = open(path, O_WRONLY);
+    ASSERT(fd >= 0);
+    ASSERT_EQ(pwrite(fd, &key_off, sizeof(key_off), 24), (ssize_t) sizeof(key_off));
+    close(fd);
+    ASSERT_EQ(ctree_load_mmap(path, (CCompareKeyFn) int_cmp), NULL);
+
+    unlink(path);
+
+    ASSERT(loaded != NULL);
+    ASSERT_EQ(ctree_size(loaded), ctree_size(tree));
+
+    for(int i = 0; i < 5000; i += 3)
+        ASSERT_EQ(*(int*) ctree_entry(loaded, &i), i * 2);
+
+    ctree_free(loaded);
+    ctree_free(tree);
+}
+
+// Reallocs fail while set, test binary is linked with '-Wl,--wrap=realloc'
+atomic_bool realloc_fails;
+
+void* __real_realloc(void* ptr, size_t size);
+
+void*
+__wrap_realloc(void* ptr, size_t size)
+{
+    return atomic_load(&realloc_fails) ? NULL : __real_realloc(ptr, size);
+}
+
+TEST(ctree_iterator_drain_test)
+{
+    ctree* tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+
+    for(int i = 0; i < 1000; i++)
+        ctree_insert(tree, int_new(i), int_new(i * 2));
+
+    ctree_iterator* iterator = ctree_iterator_new(&tree);
+    ASSERT(iterator != NULL);
+
+    // Pairs are moved into the slots in order
+    cptr_t keys[100];
+    cptr_t values[100];
+    ASSERT_EQ(ctree_iterator_drain_into(iterator, keys, values, 100), 100);
+    ASSERT_EQ(ctree_iterator_size(iterator), 900);
+
+    for(int i = 0; i < 100; i++) {
+        ASSERT_EQ(*(int*) keys[i], i);
+        ASSERT_EQ(*(int*) values[i], i * 2);
+        free(keys[i]);
+        free(values[i]);
+    }
+
+    // Only the keys are taken, values are freed
+    ASSERT_EQ(ctree_iterator_drain_into(iterator, keys, NULL, 100), 100);
+    for(int i = 0; i < 100; i++) {
+        ASSERT_EQ(*(int*) keys[i], i + 100);
+        free(keys[i]);
+    }
+
+    cvec* kvec = cvec_new(sizeof(cptr_t), NULL);
+    cvec* vvec = cvec_new(sizeof(cptr_t), NULL);
+    ASSERT(kvec != NULL && vvec != NULL);
+
+    // Drain the half, rest is torn down at once
+    ctree_iterator_drain_back(iterator, 400);
+    ASSERT_EQ(ctree_iterator_drain_into_vec(iterator, kvec, vvec), 400);
+    ASSERT_EQ(ctree_iterator_size(iterator), 0);
+    ASSERT_EQ(cvec_len(kvec), 400);
+
+    for(int i = 0; i < 400; i++) {
+        int* key   = *(int* const*) cvec_get_ref(kvec, i);
+        int* value = *(int* const*) cvec_get_ref(vvec, i);
+        ASSERT_EQ(*key, i + 200);
+        ASSERT_EQ(*value, (i + 200) * 2);
+        free(key);
+        free(value);
+    }
+
+    cvec_drop(&kvec, true);
+    cvec_drop(&vvec, true);
+    ctree_iterator_drop(&iterator);
+
+    // Pair whose value doesn't fit stays in the iterator
+    tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+    for(int i = 0; i < 100; i++)
+        ctree_insert(tree, int_new(i), int_new(i * 2));
+
+    iterator = ctree_iterator_new(&tree);
+    kvec     = cvec_new(sizeof(cptr_t), NULL);
+    vvec     = cvec_new(sizeof(cptr_t), NULL);
+
+    // Room for 64 keys and 32 values
+    for(int i = 0; i < 64; i++) {
+        cvec_push(kvec, &(cptr_t) { NULL });
+        if(i < 32)
+            cvec_push(vvec, &(cptr_t) { NULL });
+    }
+
+    cvec_truncate(kvec, 0);
+    cvec_truncate(vvec, 0);
+
+    realloc_fails = true;
+    ASSERT_EQ(ctree_iterator_drain_into_vec(iterator, kvec, vvec), 32);
+    realloc_fails = false;
+
+    ASSERT_EQ(cvec_len(kvec), 32);
+    ASSERT_EQ(cvec_len(vvec), 32);
+    ASSERT_EQ(ctree_iterator_size(iterator), 68);
+
+    ASSERT_EQ(ctree_iterator_drain_into_vec(iterator, kvec, vvec), 68);
+
+    for(int i = 0; i < 100; i++) {
+        int* key   = *(int* const*) cvec_get_ref(kvec, i);
+        int* value = *(int* const*) cvec_get_ref(vvec, i);
+        ASSERT_EQ(*key, i);
+        ASSERT_EQ(*value, i * 2);
+        free(key);
+        free(value);
+    }
+
+    cvec_drop(&kvec, true);
+    cvec_drop(&vvec, true);
+    ctree_iterator_drop(&iterator);
+
+    // Dropping the untouched iterator frees the whole tree post-order
+    tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+    for(int i = 0; i < 1000; i++)
+        ctree_insert(tree, int_new(i), int_new(i));
+
+    iterator = ctree_iterator_new(&tree);
+    ctree_iterator_drain_front(iterator, 10);
+    ctree_iterator_drop(&iterator);
+    ASSERT(iterator == NULL);
+}
+
+TEST(ctree_policy_test)
+{
+    ctree_policy policies[] = {CTREE_RB, CTREE_WAVL, CTREE_SPLAY};
+
+    for(int p = 0; p < 3; p++) {
+        ctree* tree = ctree_new_with_policy((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_DEFAULT, policies[p]);
+        ASSERT(tree != NULL);
+
+        for(int i = 0; i < 1000; i++)
+            ASSERT(ctree_insert(tree, int_new((i * 7) % 1000), int_new(i)));
+
+        // Remove every odd key, update the value of every fourth one
+        for(int i = 1; i < 1000; i += 2)
+            ASSERT(ctree_remove(tree, &i, false));
+
+        for(int i = 0; i < 1000; i += 4)
+            ASSERT(!ctree_insert(tree, &i, int_new(-i)));
+
+        ASSERT_EQ(ctree_size(tree), 500);
+
+        ctree_iter  iter = ctree_iter_new(tree);
+        ctree_node* node;
+        int         expected = 0;
+
+        while((node = ctree_iter_next(&iter)) != NULL) {
+            ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+            if(expected % 4 == 0)
+                ASSERT_EQ(*(int*) ctree_node_value(node), -expected);
+            expected += 2;
+        }
+
+        ASSERT_EQ(expected, 1000);
+
+        // Split and join work on the AVL heights only
+        ctree* left;
+        ctree* right;
+        int    key = 500;
+        ASSERT(!ctree_split(&tree, &key, &left, &right));
+
+        ctree_free(tree);
+    }
+
+    ASSERT_EQ(ctree_new_with_policy((CCompareKeyFn) int_cmp, NULL, NULL, NULL, NULL, CTREE_CONCURRENT, CTREE_RB), NULL);
+}
+
+TEST(ctree_inline_test)
+{
+    ctree* tree = ctree_new_inline(sizeof(int), sizeof(rank), (CCompareKeyFn) int_cmp, CTREE_DEFAULT);
+    ASSERT(tree != NULL);
+
+    // Keys and values are copied, stack variables can be reused
+    for(int i = 0; i < 1000; i++) {
+        int  key  = (i * 7) % 1000;
+        rank slot = { .local = key, .global = key * 2 };
+        ASSERT(ctree_insert(tree, &key, &slot));
+    }
+
+    ASSERT_EQ(ctree_size(tree), 1000);
+
+    int   key   = 42;
+    rank* value = ctree_entry(tree, &key);
+    ASSERT(value != NULL);
+    ASSERT_EQ(value->global, 84);
+    ASSERT(ctree_key(tree, &key) != &key);
+
+    // Updates are copied into the same node
+    rank update = { .local = 1, .global = 2 };
+    ASSERT(!ctree_insert(tree, &key, &update));
+    ASSERT_EQ(ctree_entry(tree, &key), value);
+    ASSERT_EQ(value->global, 2);
+
+    for(int i = 0; i < 1000; i += 2)
+        ASSERT(ctree_remove(tree, &i, false));
+
+    ctree_iter  iter = ctree_iter_new(tree);
+    ctree_node* node;
+    int         expected = 1;
+
+    while((node = ctree_iter_next(&iter)) != NULL) {
+        ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+        expected += 2;
+    }
+
+    ASSERT_EQ(expected, 1001);
+
+    // Nodes can't be moved between the trees storing the keys differently
+    ctree* other = int_tree_new(0, 10, 1, 0);
+    ASSERT(!ctree_union(tree, &other));
+    ASSERT(other != NULL);
+
+    ctree_free(other);
+    ctree_free(tree);
+}
+
+ulong
+int_hash(cconstptr_t key)
+{
+    return (ulong) *(const int*) key;
+}
+
+// Writer thread, inserts every key equal to its id modulo 4
+void*
+sharded_writer(void* arg)
+{
+    ctree_sharded* map = ((void**) arg)[0];
+    int            id  = *(int*) ((void**) arg)[1];
+
+    for(int i = id; i < 4000; i += 4)
+        ctree_sharded_insert(map, int_new(i), int_new(i * 2));
+
+    for(int i = id; i < 4000; i += 8)
+        ctree_sharded_remove(map, &i);
+
+    return NULL;
+}
+
+TEST(ctree_sharded_test)
+{
+    ctree_sharded* map = ctree_sharded_new((CCompareKeyFn) int_cmp, free, free, int_hash, 3);
+    ASSERT(map != NULL);
+
+    pthread_t threads[4];
+    int       ids[4];
+    void*     args[4][2];
+
+    for(int i = 0; i < 4; i++) {
+        ids[i]     = i;
+        args[i][0] = map;
+        args[i][1] = &ids[i];
+        pthread_create(&threads[i], NULL, sharded_writer, args[i]);
+    }
+
+    for(int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    // Every key whose remainder of 8 is not below 4 is left
+    ASSERT_EQ(ctree_sharded_size(map), 2000);
+
+    int key = 6;
+    ASSERT_EQ(*(int*) ctree_sharded_entry(map, &key), 12);
+    key = 2;
+    ASSERT_EQ(ctree_sharded_entry(map, &key), NULL);
+
+    // Shards merge back in order
+    ctree_sharded_iter* iter = ctree_sharded_iter_new(map);
+    ctree_node*         node;
+    int                 count = 0, last = -1;
+
+    while((node = ctree_sharded_iter_next(iter)) != NULL) {
+        ASSERT(*(int*) ctree_node_key(node) > last);
+        ASSERT(*(int*) ctree_node_key(node) % 8 >= 4);
+        last = *(int*) ctree_node_key(node);
+        count++;
+    }
+
+    ASSERT_EQ(count, 2000);
+
+    ctree_sharded_iter_free(iter);
+    ctree_sharded_free(map);
+}
+
+// Adds up the values of the visited pairs
+void
+par_sum_visit(cconstptr_t key, cptr_t value, cptr_t ctx)
+{
+    (void) key;
+    atomic_fetch_add((atomic_long*) ctx, *(int*) value);
+}
+
+// Run of the consecutive keys ['lo', 'hi'], 'sorted' is false once the runs got combined out of order
+typedef struct {
+    int  lo;
+    int  hi;
+    bool sorted;
+} int_run;
+
+cptr_t
+par_run_map(cconstptr_t key, cptr_t value, cptr_t ctx)
+{
+    (void) value;
+    (void) ctx;
+
+    int_run* run = malloc(sizeof(int_run));
+    run->lo      = *(int*) key;
+    run->hi      = *(int*) key;
+    run->sorted  = true;
+
+    return run;
+}
+
+cptr_t
+par_run_combine(cptr_t left, cptr_t right, cptr_t ctx)
+{
+    int_run* l = left;
+    int_run* r = right;
+
+    (void) ctx;
+
+    l->sorted = l->sorted && r->sorted && l->hi + 1 == r->lo;
+    l->hi     = r->hi;
+    free(r);
+
+    return l;
+}
+
+TEST(ctree_par_test)
+{
+    // Large enough to get split between the threads
+    ctree*      tree = int_tree_new(0, 20000, 1, 1);
+    atomic_long sum  = 0;
+
+    ctree_par_for_each(tree, par_sum_visit, &sum);
+    ASSERT_EQ(sum, 20000L * 19999 / 2);
+
+    // Runs are combined in the key order
+    int_run* run = ctree_par_reduce(tree, par_run_map, par_run_combine, NULL);
+    ASSERT(run != NULL);
+    ASSERT(run->sorted);
+    ASSERT_EQ(run->lo, 0);
+    ASSERT_EQ(run->hi, 19999);
+    free(run);
+
+    ctree_free(tree);
+
+    // Shared nodes of the persistent tree have no parent links
+    tree = ctree_new_with_mode((CCompareKeyFn) int_cmp, free, free, NULL, NULL, CTREE_PERSISTENT);
+    sum  = 0;
+
+    for(int i = 0; i < 20000; i++)
+        ASSERT(ctree_insert(tree, int_new(i), int_new(i)));
+
+    ctree_par_for_each(tree, par_sum_visit, &sum);
+    ASSERT_EQ(sum, 20000L * 19999 / 2);
+
+    run = ctree_par_reduce(tree, par_run_map, par_run_combine, NULL);
+    ASSERT(run != NULL);
+    ASSERT(run->sorted);
+    ASSERT_EQ(run->lo, 0);
+    ASSERT_EQ(run->hi, 19999);
+    free(run);
+
+    ctree_free(tree);
+
+    tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+    ASSERT_EQ(ctree_par_reduce(tree, par_run_map, par_run_combine, NULL), NULL);
+    ctree_free(tree);
+}
+
+TEST(ctree_entry_batch_test)
+{
+    ctree* tree = int_tree_new(0, 3000, 2, 3);
+    int    keys[100];
+    cptr_t key_ptrs[100];
+    cptr_t values[100];
+
+    // Every third key is odd and missing, more keys than there are lanes
+    for(int i = 0; i < 100; i++) {
+        keys[i]     = (i % 3 == 0) ? i * 28 + 1 : i * 28;
+        key_ptrs[i] = &keys[i];
+    }
+
+    ASSERT_EQ(ctree_entry_batch(tree, key_ptrs, 100, values), 66);
+
+    for(int i = 0; i < 100; i++) {
+        if(i % 3 == 0)
+            ASSERT_EQ(values[i], NULL);
+        else
+            ASSERT_EQ(*(int*) values[i], keys[i] * 3);
+    }
+
+    ASSERT_EQ(ctree_entry_batch(tree, key_ptrs, 0, values), 0);
+
+    ctree_free(tree);
+}
+
+atomic_int freed_values;
+
+void
+counted_free(cptr_t value)
+{
+    atomic_fetch_add(&freed_values, 1);
+    free(value);
+}
+
+TEST(ctree_free_async_test)
+{
+    // Enough nodes for several reclaimer batches
+    ctree* tree = ctree_new((CCompareKeyFn) int_cmp, free, counted_free, NULL, NULL);
+
+    for(int i = 0; i < 10000; i++)
+        ctree_insert(tree, int_new(i), int_new(i));
+
+    ctree_reclaim* reclaim;
+    ASSERT(ctree_free_async(tree, &reclaim));
+    ASSERT(reclaim != NULL);
+
+    ctree_reclaim_wait(reclaim);
+    ASSERT_EQ(atomic_load(&freed_values), 10000);
+
+    // Persistent tree only loses the nodes the snapshot doesn't share
+    tree         = ctree_new_with_mode((CCompareKeyFn) int_cmp, free, counted_free, NULL, NULL, CTREE_PERSISTENT);
+    freed_values = 0;
+
+    for(int i = 0; i < 100; i++)
+        ctree_insert(tree, int_new(i), int_new(i));
+
+    ctree* snapshot = ctree_snapshot(tree);
+
+    ASSERT(ctree_free_async(tree, &reclaim));
+    ctree_reclaim_wait(reclaim);
+    ASSERT_EQ(atomic_load(&freed_values), 0);
+
+    int key = 42;
+    ASSERT_EQ(*(int*) ctree_entry(snapshot, &key), 42);
+
+    ctree_free(snapshot);
+    ASSERT_EQ(atomic_load(&freed_values), 100);
+}
+
+TEST(ctree_first_last_test)
+{
+    ctree* tree = ctree_new((CCompareKeyFn) int_cmp, free, free, NULL, NULL);
+
+    ASSERT_EQ(ctree_first(tree), NULL);
+    ASSERT(!ctree_pop_first(tree, NULL, NULL));
+
+    // Inserted out of order, edges follow the inserts
+    for(int i = 0; i < 100; i++) {
+        int key = (i * 37) % 100;
+        ctree_insert(tree, int_new(key), int_new(key * 2));
+    }
+
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_first(tree)), 0);
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_last(tree)), 99);
+
+    // Scheduler queue, pops come out in order
+    cptr_t key;
+    cptr_t value;
+
+    for(int i = 0; i < 50; i++) {
+        ASSERT(ctree_pop_first(tree, &key, &value));
+        ASSERT_EQ(*(int*) key, i);
+        ASSERT_EQ(*(int*) value, i * 2);
+        free(key);
+        free(value);
+    }
+
+    ASSERT(ctree_pop_last(tree, NULL, NULL));
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_last(tree)), 98);
+
+    int missing = 98;
+    ASSERT(ctree_remove(tree, &missing, false));
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_last(tree)), 97);
+    ASSERT_EQ(ctree_size(tree), 48);
+
+    ctree_free(tree);
+}
+
+TEST(ctree_freeze_test)
+{
+    ctree*   tree   = int_tree_new(0, 1000, 3, 2);
+    cfrozen* frozen = ctree_freeze(&tree);
+
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(tree, NULL);
+    ASSERT_EQ(cfrozen_size(frozen), 334);
+
+    for(int i = 0; i < 1000; i++) {
+        cptr_t value = cfrozen_get(frozen, &i);
+
+        if(i % 3 == 0)
+            ASSERT_EQ(*(int*) value, i * 2);
+        else
+            ASSERT_EQ(value, NULL);
+    }
+
+    // Lower bound of the missing key is its successor
+    int key = 500;
+    ASSERT_EQ(cfrozen_lower_bound(frozen, &key), 167);
+    key = 1000;
+    ASSERT_EQ(cfrozen_lower_bound(frozen, &key), 334);
+
+    // Positions walk the keys in order
+    cconstptr_t found;
+    cptr_t      value;
+
+    for(ulong i = 0; i < cfrozen_size(frozen); i++) {
+        ASSERT(cfrozen_at(frozen, i, &found, &value));
+        ASSERT_EQ(*(const int*) found, (int) i * 3);
+    }
+
+    ASSERT(!cfrozen_at(frozen, 334, &found, &value));
+
+    cfrozen_free(frozen);
+}
+
+TEST(ctree_compact_test)
+{
+    ctree* tree = int_tree_new(0, 1000, 1, 2);
+
+    ASSERT(ctree_compact(tree));
+
+    for(int i = 0; i < 1000; i++)
+        ASSERT_EQ(*(int*) ctree_entry(tree, &i), i * 2);
+
+    // Compacted tree stays mutable
+    for(int i = 0; i < 1000; i += 2)
+        ASSERT(ctree_remove(tree, &i, false));
+
+    for(int i = 1000; i < 1200; i++)
+        ctree_insert(tree, int_new(i), int_new(i * 2));
+
+    // Steps interleaved with the modifications
+    int  next  = 1200;
+    int  steps = 0;
+    bool more  = true;
+
+    while(more) {
+        more = ctree_compact_step(tree, 64);
+        ctree_insert(tree, int_new(next), int_new(next * 2));
+        next++;
+        steps++;
+    }
+
+    ASSERT(steps > 1);
+    ASSERT_EQ(ctree_size(tree), 700 + (uint) steps);
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_first(tree)), 1);
+    ASSERT_EQ(*(int*) ctree_node_key(ctree_last(tree)), next - 1);
+
+    for(int i = 1; i < next; i++) {
+        cptr_t value = ctree_entry(tree, &i);
+
+        if(i < 1000 && i % 2 == 0)
+            ASSERT_EQ(value, NULL);
+        else
+            ASSERT_EQ(*(int*) value, i * 2);
+    }
+
+    // Split halves own their nodes
+    ctree* left;
+    ctree* right;
+    int    key = 500;
+
+    ASSERT(ctree_compact(tree));
+    ASSERT(ctree_split(&tree, &key, &left, &right));
+    ASSERT_EQ(ctree_size(left), 250);
+
+    ctree_free(left);
+    ctree_free(right);
+}
+
+atomic_int splay_compares;
+
+int
+counted_int_cmp(const int* a, const int* b)
+{
+    atomic_fetch_add(&splay_compares, 1);
+    return int_cmp(a, b);
+}
+
+TEST(ctree_splay_test)
+{
+    ctree* tree = ctree_new_with_policy((CCompareKeyFn) counted_int_cmp, free, free, NULL, NULL, CTREE_DEFAULT, CTREE_SPLAY);
+
+    // Sorted inserts leave the splay tree as deep as it gets
+    for(int i = 0; i < 100000; i++)
+        ASSERT(ctree_insert(tree, int_new(i), int_new(i * 2)));
+
+    int hot[] = {3, 77777, 50000};
+
+    for(int h = 0; h < 3; h++) {
+        ASSERT_EQ(*(int*) ctree_entry(tree, &hot[h]), hot[h] * 2);
+
+        // Found key got splayed near the root
+        splay_compares = 0;
+        ASSERT_EQ(*(int*) ctree_peek(tree, &hot[h]), hot[h] * 2);
+        ASSERT(atomic_load(&splay_compares) <= 5);
+    }
+
+    // Peek leaves the tree as is
+    int cold = 12345;
+    ASSERT_EQ(*(int*) ctree_peek(tree, &cold), cold * 2);
+    splay_compares = 0;
+    ctree_peek(tree, &cold);
+    ASSERT(atomic_load(&splay_compares) > 5);
+
+    for(int i = 0; i < 100000; i += 2)
+        ASSERT(ctree_remove(tree, &i, false));
+
+    ASSERT_EQ(ctree_size(tree), 50000);
+    ASSERT_EQ(ctree_peek(tree, &(int){4}), NULL);
+    ASSERT_EQ(*(int*) ctree_entry(tree, &(int){5}), 10);
+
+    ctree_free(tree);
+
+    // Missed lookups and removes splay the would-be parent
+    tree = ctree_new_with_policy((CCompareKeyFn) counted_int_cmp, free, free, NULL, NULL, CTREE_DEFAULT, CTREE_SPLAY);
+
+    for(int i = 0; i < 20000; i++)
+        ASSERT(ctree_insert(tree, int_new(i * 2), NULL));
+
+    splay_compares = 0;
+    for(int i = 0; i < 1000; i++) {
+        ASSERT_EQ(ctree_entry(tree, &(int){7}), NULL);
+        ASSERT(!ctree_remove(tree, &(int){9}, false));
+    }
+
+    ASSERT(atomic_load(&splay_compares) < 60000);
+
+    ctree_free(tree);
+}
+
+TEST(ctree_cache_test)
+{
+    ctree* tree = ctree_new((CCompareKeyFn) counted_int_cmp, free, free, NULL, NULL);
+    ulong  hits;
+    ulong  misses;
+
+    ASSERT(ctree_cache_enable(tree, int_hash, 64));
+
+    for(int i = 0; i < 10000; i++)
+        ctree_insert(tree, int_new(i), int_new(i * 2));
+
+    // First lookup descends, repeated ones are answered by the cache
+    int hot = 4242;
+    ASSERT_EQ(*(int*) ctree_entry(tree, &hot), hot * 2);
+
+    splay_compares = 0;
+    for(int i = 0; i < 100; i++)
+        ASSERT_EQ(*(int*) ctree_entry(tree, &hot), hot * 2);
+
+    ASSERT_EQ(atomic_load(&splay_compares), 100);
+
+    ctree_cache_stats(tree, &hits, &misses);
+    ASSERT_EQ(hits, 100);
+    ASSERT_EQ(misses, 1);
+
+    // Removed key is not served from the cache anymore
+    ASSERT(ctree_remove(tree, &hot, false));
+    ASSERT_EQ(ctree_entry(tree, &hot), NULL);
+
+    ctree_insert(tree, int_new(hot), int_new(-hot));
+    ASSERT_EQ(*(int*) ctree_entry(tree, &hot), -hot);
+    ASSERT(!ctree_insert(tree, &hot, int_new(hot)));
+    ASSERT_EQ(*(int*) ctree_entry(tree, &hot), hot);
+    ASSERT_EQ(*(int*) ctree_key(tree, &hot), hot);
+
+    // Nodes moved by the compaction are looked up again
+    ASSERT(ctree_compact(tree));
+    ASSERT_EQ(*(int*) ctree_entry(tree, &hot), hot);
+
+    ASSERT(ctree_cache_enable(tree, NULL, 0));
+    ctree_cache_stats(tree, &hits, NULL);
+    ASSERT_EQ(hits, 0);
+
+    ctree_free(tree);
+}
+
+bool
+int_multiple_of(cconstptr_t key, cptr_t value, cptr_t ctx)
+{
+    (void) value;
+    return *(const int*) key % *(int*) ctx == 0;
+}
+
+TEST(ctree_retain_test)
+{
+    ctree_policy policies[] = {CTREE_AVL, CTREE_RB, CTREE_WAVL, CTREE_SPLAY};
+
+    for(int p = 0; p < 4; p++) {
+        ctree* tree = ctree_new_with_policy((CCompareKeyFn) int_cmp, free, counted_free, NULL, NULL, CTREE_DEFAULT, policies[p]);
+        int    by   = 3;
+
+        for(int i = 0; i < 1000; i++)
+            ctree_insert(tree, int_new(i), int_new(i * 2));
+
+        freed_values = 0;
+        ASSERT_EQ(ctree_retain(tree, int_multiple_of, &by), 666);
+        ASSERT_EQ(atomic_load(&freed_values), 666);
+        ASSERT_EQ(ctree_size(tree), 334);
+
+        ctree_iter  iter = ctree_iter_new(tree);
+        ctree_node* node;
+        int         expected = 0;
+
+        while((node = ctree_iter_next(&iter)) != NULL) {
+            ASSERT_EQ(*(int*) ctree_node_key(node), expected);
+            expected += 3;
+        }
+
+        ASSERT_EQ(expected, 1002);
+        ASSERT_EQ(*(int*) ctree_node_key(ctree_last(tree)), 999);
+
+        // Rebuilt tree keeps working under its policy
+        for(int i = 0; i < 1000; i += 3)
+            ASSERT(ctree_remove(tree, &i, false));
+
+        for(int i = 0; i < 1000; i++)
+            ctree_insert(tree, int_new(i), int_new(i * 2));
+
+        int key = 1;
+        by      = 1;
+        ASSERT_EQ(ctree_retain(tree, int_multiple_of, &by), 0);
+        ASSERT_EQ(*(int*) ctree_entry(tree, &key), 2);
+        ASSERT_EQ(ctree_size(tree), 1000);
+
+        ctree_free(tree);
+    }
+}
@@ -6,6 +6,7 @@
 TEST(cvec_create_test);
 TEST(cvec_pop_test);
 TEST(cvec_push_test);
+TEST(cvec_truncate_test);
 
 int
 main(void)
@@ -14,6 +15,7 @@ main(void)
     ssuite_add_test(suite, cvec_create_test);
     ssuite_add_test(suite, cvec_pop_test);
     ssuite_add_test(suite, cvec_push_test);
+    ssuite_add_test(suite, cvec_truncate_test);
 
     srunner* runner = srunner_new();
     srunner_add_suite(runner, suite);
@@ -131,3 +133,32 @@ TEST(cvec_push_test)
 
     cvec_drop(&vec, true);
 }
+
+TEST(cvec_truncate_test)
+{
+    cvec* vec = cvec_new(sizeof(int), NULL);
+    ASSERT(vec != NULL);
+
+    for(int i = 0; i < 10; i++)
+        cvec_push(vec, &i);
+
+    int capacity = cvec_capacity(vec);
+
+    // Longer length leaves the vec as is
+    cvec_truncate(vec, 20);
+    ASSERT_EQ(cvec_len(vec), 10);
+
+    // Buffer is kept
+    cvec_truncate(vec, 4);
+    ASSERT_EQ(cvec_len(vec), 4);
+    ASSERT_EQ(cvec_capacity(vec), capacity);
+    ASSERT_EQ(*(const int*) cvec_get_ref(vec, 3), 3);
+
+    cvec_push(vec, &(int) { 42 });
+    ASSERT_EQ(*(const int*) cvec_get_ref(vec, 4), 42);
+
+    cvec_truncate(vec, 0);
+    ASSERT_EQ(cvec_len(vec), 0);
+
+    cvec_drop(&vec, true);
+}